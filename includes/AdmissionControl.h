@@ -0,0 +1,84 @@
+// AdmissionControl.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Connection limits and backpressure for the SMTP listeners
+
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <boost/asio/ip/address.hpp>
+
+class Logger;
+class DeliveryQueue;
+
+enum Admission {
+    ADMIT,
+    REJECT_TOTAL,   // MAX_CONNECTIONS reached
+    REJECT_PER_IP   // MAX_CONNECTIONS_PER_IP reached for this address
+};
+
+class AdmissionControl {
+public:
+    // queue_high/queue_low: queue depths at which new mail is refused and
+    // accepted again
+    AdmissionControl(size_t max_connections, size_t max_per_ip, size_t max_inflight_bytes,
+                     size_t queue_high, size_t queue_low,
+                     std::shared_ptr<DeliveryQueue> queue, std::shared_ptr<Logger> logger);
+
+    // Count a connection from address unless a limit is reached; every
+    // admitted connection must be released exactly once
+    Admission admitConnection(const boost::asio::ip::address& address);
+    void releaseConnection(const boost::asio::ip::address& address);
+
+    // Account for message data held by sessions; false if it would exceed
+    // MAX_INFLIGHT_BYTES
+    bool reserveBytes(size_t bytes);
+    void releaseBytes(size_t bytes);
+
+    // Account for data that is already held whatever the limit, e.g. a
+    // message kept by a queued job; released with releaseBytes
+    void holdBytes(size_t bytes);
+
+    // True if a message of this size could be received right now
+    bool hasRoomFor(size_t bytes) const;
+
+    // True from when the delivery queue reaches the high watermark until it
+    // drains to the low one
+    bool isCongested();
+
+    size_t connections() const;
+
+private:
+    // Per-address connection counts in a fixed-size open-addressing table;
+    // it has twice as many slots as connections allowed, so it never fills
+    struct Slot {
+        uint8_t address[16];  // IPv4 stored as IPv4-mapped IPv6
+        uint32_t count;       // 0 marks a free slot
+    };
+
+    size_t max_connections_;
+    size_t max_per_ip_;
+    size_t max_inflight_bytes_;
+    size_t queue_high_;
+    size_t queue_low_;
+    std::shared_ptr<DeliveryQueue> queue_;
+    std::shared_ptr<Logger> logger_;
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t connections_;
+    mutable std::mutex mutex_;
+    std::atomic<size_t> inflight_bytes_;
+    std::atomic<bool> congested_;
+
+    size_t find(const uint8_t* address) const;
+    void erase(size_t index);
+};
+
+#endif // ADMISSION_CONTROL_H
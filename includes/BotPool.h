@@ -0,0 +1,99 @@
+// BotPool.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Telegram bots that share the delivery load
+
+#ifndef BOT_POOL_H
+#define BOT_POOL_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+enum BotScheduling {
+    SCHEDULE_LEAST_LOADED,  // the bot with the fewest requests in flight
+    SCHEDULE_CHAT_HASH      // each chat sticks to one bot while it is available
+};
+
+class BotPool {
+private:
+    struct Bot;
+
+public:
+    // A bot reserved for one delivery, with a connection of its own; the
+    // connection goes back to the bot's pool when the lease ends
+    class Lease {
+    public:
+        Lease() : pool_(nullptr), bot_(nullptr), handle_(nullptr) {}
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+        ~Lease();
+
+        const std::string& token() const;
+        size_t index() const;
+
+        // CURL easy handle, or null if it could not be created
+        void* handle() const { return handle_; }
+
+        // Seconds until the bot may be used again; nonzero only when every
+        // bot is sidelined
+        int readyIn() const;
+
+    private:
+        friend class BotPool;
+        Lease(BotPool* pool, Bot* bot, void* handle) : pool_(pool), bot_(bot), handle_(handle) {}
+        void release();
+
+        BotPool* pool_;
+        Bot* bot_;
+        void* handle_;
+    };
+
+    // tokens must not be empty
+    BotPool(const std::vector<std::string>& tokens, BotScheduling scheduling);
+    ~BotPool();
+
+    // Pick a bot for a request to chat_id, skipping sidelined bots unless
+    // all of them are
+    Lease acquire(const std::string& chat_id);
+
+    // Lease on the bot with the given index, sidelined or not, e.g. to
+    // edit a message it posted
+    Lease acquireBot(size_t index);
+
+    // Keep the lease's bot out of rotation for seconds, e.g. after a 429
+    void sideline(const Lease& lease, int seconds);
+
+    size_t size() const { return bots_.size(); }
+    const std::string& token(size_t index) const;
+
+    // Tokens of a comma-separated API_KEY, trimmed; empty if any is empty
+    static std::vector<std::string> splitTokens(const std::string& list);
+
+    // Parse a BOT_SCHEDULING value (least-loaded, chat-hash); false if unknown
+    static bool parseScheduling(const std::string& name, BotScheduling& scheduling);
+
+private:
+    struct Bot {
+        std::string token;
+        size_t index;
+        uint64_t seed;                       // per-bot salt of the chat hash
+        std::atomic<size_t> in_flight;
+        std::atomic<int64_t> sidelined_until;  // steady clock, nanoseconds
+        std::mutex mutex;
+        std::vector<void*> idle;             // connections kept alive for reuse
+    };
+
+    std::vector<std::unique_ptr<Bot>> bots_;
+    BotScheduling scheduling_;
+    std::atomic<size_t> next_;  // rotates ties between equally loaded bots
+
+    void* takeHandle(Bot& bot);
+    void returnHandle(Bot& bot, void* handle);
+};
+
+#endif // BOT_POOL_H
@@ -0,0 +1,36 @@
+// CharsetConverter.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Conversion of legacy single-byte charsets to UTF-8
+
+#ifndef CHARSET_CONVERTER_H
+#define CHARSET_CONVERTER_H
+
+#include <string>
+#include <cstddef>
+
+class CharsetConverter {
+public:
+    // Convert text in charset (a MIME name or common alias, any case) to
+    // UTF-8 in place. UTF-8, ASCII and text without 8-bit bytes are left
+    // untouched without copying. Returns false, leaving text as it is, if
+    // the charset is not known
+    static bool toUtf8(const std::string& charset, std::string& text);
+
+    // True if text in charset can be converted (or needs no conversion)
+    static bool isSupported(const std::string& charset);
+
+    // Length of the leading run of ASCII bytes, checked 16 bytes at a time
+    static size_t asciiPrefix(const char* data, size_t length);
+
+    // Validate text as UTF-8, replacing every malformed sequence with
+    // U+FFFD, and return its length in UTF-16 code units (the unit of
+    // Telegram's limits). Valid text is checked in one pass and not copied
+    static size_t repairUtf8(std::string& text);
+
+    // Length in UTF-16 code units of valid UTF-8 text
+    static size_t utf16Length(const char* data, size_t length);
+};
+
+#endif // CHARSET_CONVERTER_H
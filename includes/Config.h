@@ -8,6 +8,7 @@
 #define CONFIG_H
 
 #include <string>
+#include <map>
 #include <stdexcept>
 
 class ConfigException : public std::runtime_error {
@@ -19,38 +20,128 @@ class Config {
 public:
     Config();
 
-    // Load configuration from environment or create .env file
-    void load();
+    // Load configuration from the .env file and environment; prompts to
+    // create .env when missing unless interactive is false
+    void load(bool interactive = true);
 
     // Validate configuration values
     bool validate() const;
 
     // Getters
     std::string getChatId() const { return chat_id_; }
-    std::string getApiKey() const { return api_key_; }
+    std::string getApiKey() const { return api_key_; }  // one or more comma-separated bot tokens
+    std::string getBotScheduling() const { return bot_scheduling_; }
     std::string getSmtpHostname() const { return smtp_hostname_; }
     int getSmtpPort() const { return smtp_port_; }
     int getLogKeepDays() const { return log_keep_days_; }
     std::string getConfigDir() const { return config_dir_; }
     std::string getLogPath() const { return log_path_; }
+    std::string getEnvPath() const { return env_path_; }
+    std::string getRoutes() const { return routes_; }
+    int getDedupWindow() const { return dedup_window_; }
+    int getDedupCacheSize() const { return dedup_cache_size_; }
+    std::string getDedupFields() const { return dedup_fields_; }
+    int getStormWindow() const { return storm_window_; }
+    std::string getStormFields() const { return storm_fields_; }
+    int getStormEditInterval() const { return storm_edit_interval_; }
+    int getStormMaxGroups() const { return storm_max_groups_; }
+    std::string getPriorityRules() const { return priority_rules_; }
+    int getDeliveryWorkers() const { return delivery_workers_; }
+    int getDeliveryQueueSize() const { return delivery_queue_size_; }
+    int getSmtpWorkers() const { return smtp_workers_; }
+    bool getSmtpCpuPinning() const { return smtp_cpu_pinning_; }
+    std::string getTelegramOverflow() const { return telegram_overflow_; }
+    std::string getMessageTemplate() const { return message_template_; }
+    std::string getMessageFormat() const { return message_format_; }
+    std::string getAttachmentTypes() const { return attachment_types_; }
+    int getAttachmentMaxSize() const { return attachment_max_size_; }
+    int getAttachmentMaxCount() const { return attachment_max_count_; }
+    int getMaxConnections() const { return max_connections_; }
+    int getMaxConnectionsPerIp() const { return max_connections_per_ip_; }
+    int getMaxInflightBytes() const { return max_inflight_bytes_; }
+    int getQueueHighWatermark() const { return queue_high_watermark_; }
+    int getQueueLowWatermark() const { return queue_low_watermark_; }
+    int getSmtpCommandTimeout() const { return smtp_command_timeout_; }
+    int getSmtpDataTimeout() const { return smtp_data_timeout_; }
+    int getSmtpSessionTimeout() const { return smtp_session_timeout_; }
+    std::string getSmtpTlsCert() const { return smtp_tls_cert_; }
+    std::string getSmtpTlsKey() const { return smtp_tls_key_; }
+    bool getSmtpRequireTls() const { return smtp_require_tls_; }
+    std::string getLmtpSocket() const { return lmtp_socket_; }
+    int getLmtpSocketMode() const { return lmtp_socket_mode_; }
+    std::string getRulesFile() const { return rules_file_; }  // absolute path, empty if unset
+    std::string getRules() const { return rules_; }           // contents of RULES_FILE
+    int getRulesBodyBytes() const { return rules_body_bytes_; }
+    std::string getIoBackend() const { return io_backend_; }
+    std::string getCaptureFile() const { return capture_file_; }  // absolute path, empty if unset
+    int getCaptureMaxMb() const { return capture_max_mb_; }
+    std::string getArchiveDir() const { return archive_dir_; }  // absolute path, empty if unset
+    int getArchiveSegmentMb() const { return archive_segment_mb_; }
+    int getArchiveKeepDays() const { return archive_keep_days_; }
 
 private:
     std::string config_dir_;
     std::string env_path_;
     std::string log_path_;
+    std::map<std::string, std::string> file_values_;
 
     std::string chat_id_;
     std::string api_key_;
+    std::string bot_scheduling_;
     std::string smtp_hostname_;
     int smtp_port_;
     int log_keep_days_;
+    std::string routes_;
+    int dedup_window_;
+    int dedup_cache_size_;
+    std::string dedup_fields_;
+    int storm_window_;
+    std::string storm_fields_;
+    int storm_edit_interval_;
+    int storm_max_groups_;
+    std::string priority_rules_;
+    int delivery_workers_;
+    int delivery_queue_size_;
+    int smtp_workers_;
+    bool smtp_cpu_pinning_;
+    std::string telegram_overflow_;
+    std::string message_template_;
+    std::string message_format_;
+    std::string attachment_types_;
+    int attachment_max_size_;
+    int attachment_max_count_;
+    int max_connections_;
+    int max_connections_per_ip_;
+    int max_inflight_bytes_;
+    int queue_high_watermark_;
+    int queue_low_watermark_;
+    int smtp_command_timeout_;
+    int smtp_data_timeout_;
+    int smtp_session_timeout_;
+    std::string smtp_tls_cert_;
+    std::string smtp_tls_key_;
+    bool smtp_require_tls_;
+    std::string lmtp_socket_;
+    int lmtp_socket_mode_;
+    std::string rules_file_;
+    std::string rules_;
+    int rules_body_bytes_;
+    std::string io_backend_;
+    std::string capture_file_;
+    int capture_max_mb_;
+    std::string archive_dir_;
+    int archive_segment_mb_;
+    int archive_keep_days_;
 
     void createConfigDirectory();
     void createEnvFile();
     void loadEnvFile();
+    void loadRulesFile();
+    const char* lookup(const char* key) const;
     void setSecurePermissions();
     bool validatePort(int port) const;
     bool validateChatId(const std::string& chat_id) const;
+    static bool parseBool(const char* value);
 };
 
 #endif // CONFIG_H
@@ -0,0 +1,69 @@
+// ConfigStore.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Atomically published configuration snapshots with live reload
+
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+class Config;
+class Logger;
+class RecipientRouter;
+class PriorityRules;
+class DedupCache;
+class TelegramClient;
+class MessageTemplate;
+class RuleEngine;
+
+// Everything derived from one .env load; never modified once published
+struct RuntimeConfig {
+    std::shared_ptr<const Config> config;
+    std::shared_ptr<TelegramClient> telegram;
+    std::shared_ptr<RecipientRouter> router;
+    std::shared_ptr<PriorityRules> priorities;
+    std::shared_ptr<DedupCache> dedup;  // null when disabled
+    std::shared_ptr<const MessageTemplate> message_template;  // null for the built-in layout
+    std::shared_ptr<const RuleEngine> rules;  // null without RULES_FILE
+};
+
+class ConfigStore {
+public:
+    // Compile the initial snapshot; throws ConfigException if it is invalid
+    ConfigStore(std::shared_ptr<const Config> config, std::shared_ptr<Logger> logger);
+    ~ConfigStore();
+
+    // Current snapshot; callers keep using the one they got until done
+    std::shared_ptr<const RuntimeConfig> current() const;
+
+    // Re-read .env and publish a new snapshot; the old one stays on error
+    bool reload();
+
+    // Ask the watcher thread to reload (async-signal-safe, for SIGHUP)
+    void requestReload() { reload_requested_ = true; }
+
+    // Watch .env for changes and serve reload requests in the background
+    void startWatching();
+    void stopWatching();
+
+private:
+    std::shared_ptr<Logger> logger_;
+    std::shared_ptr<const RuntimeConfig> snapshot_;
+    std::atomic<uint64_t> version_;
+    std::atomic<bool> reload_requested_;
+    std::atomic<bool> watching_;
+    std::thread watcher_;
+
+    std::shared_ptr<const RuntimeConfig> build(std::shared_ptr<const Config> config,
+                                               const RuntimeConfig* previous) const;
+    void publish(std::shared_ptr<const RuntimeConfig> snapshot);
+    void watchLoop();
+};
+
+#endif // CONFIG_STORE_H
@@ -0,0 +1,58 @@
+// DedupCache.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Time-windowed duplicate message suppression
+
+#ifndef DEDUP_CACHE_H
+#define DEDUP_CACHE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+struct ParsedEmail;
+
+class DedupCache {
+public:
+    // fields: comma separated subset of "subject,from,to,body"
+    DedupCache(int window_seconds, size_t capacity, const std::string& fields);
+
+    // True if a message with this fingerprint was remembered within the window
+    bool isDuplicate(uint64_t hash);
+
+    // Remember a message once it has been accepted for delivery, so one
+    // that is deferred (451) is not suppressed when the sender retries
+    void remember(uint64_t hash);
+
+    // Number of suppressed duplicates since startup
+    uint64_t suppressedCount() const { return suppressed_.load(std::memory_order_relaxed); }
+
+    // Hash of the configured fields (non-cryptographic)
+    uint64_t fingerprint(const ParsedEmail& email) const;
+
+private:
+    // Entries are grouped in fixed-size sets; a hash maps to one set and
+    // evicts the oldest entry there, so memory never grows past capacity
+    static const size_t WAYS = 8;
+
+    struct Entry {
+        uint64_t hash;
+        std::time_t first_seen;
+    };
+
+    int window_seconds_;
+    size_t set_mask_;
+    std::vector<Entry> entries_;
+    bool use_subject_;
+    bool use_from_;
+    bool use_to_;
+    bool use_body_;
+    std::atomic<uint64_t> suppressed_;
+    std::mutex mutex_;
+};
+
+#endif // DEDUP_CACHE_H
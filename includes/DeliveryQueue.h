@@ -0,0 +1,110 @@
+// DeliveryQueue.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Prioritized background delivery to Telegram
+
+#ifndef DELIVERY_QUEUE_H
+#define DELIVERY_QUEUE_H
+
+#include "PriorityRules.h"
+#include "TelegramClient.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+class Logger;
+class ConfigStore;
+class StormCollapser;
+
+struct DeliveryJob {
+    std::vector<std::string> chat_ids;
+    std::string message;                   // text, or caption when a document is set
+    TelegramFile document;                 // sent instead of the text when it has a buffer
+    std::vector<TelegramFile> attachments; // sent after the message
+    MessagePriority priority;
+    std::chrono::steady_clock::time_point enqueued;
+    std::shared_ptr<TelegramClient> telegram;  // client of the snapshot that accepted it
+    int attempts = 0;
+    std::shared_ptr<StormCollapser> storm;  // set for the first message of an alert group
+    uint64_t storm_key = 0;
+};
+
+class DeliveryQueue {
+public:
+    DeliveryQueue(std::shared_ptr<ConfigStore> config,
+                  std::shared_ptr<Logger> logger,
+                  size_t workers, size_t max_size);
+    ~DeliveryQueue();
+
+    // Queue a message for delivery; false if the queue is full
+    bool enqueue(DeliveryJob job);
+
+    // Start the worker threads
+    void start();
+
+    // Deliver what is still queued, then stop the workers
+    void stop();
+
+    // Number of messages waiting for delivery
+    size_t size() const;
+
+    // True once getMe has succeeded and deliveries are flowing
+    bool isTelegramReachable() const;
+
+    // Stop the workers and write undelivered messages to fd for a successor
+    // process; if that fails they are delivered here before returning
+    bool handOff(int fd);
+
+    // Queue a predecessor's backlog, read from fd in the background
+    void receiveHandOff(int fd);
+
+private:
+    // High priority is served strictly first; normal and low share the
+    // remaining capacity by weight so low priority is never starved
+    static const int NORMAL_WEIGHT = 4;
+    static const int LOW_WEIGHT = 1;
+
+    // High priority may go this far past max_size, so a full backlog does
+    // not block a page but a flood of them cannot grow without bound
+    static const size_t HIGH_PRIORITY_HEADROOM = 1000;
+
+    // Delivery rounds (each with its own retries) before a message is dropped
+    static const int MAX_DELIVERY_ROUNDS = 3;
+
+    // Health probe backoff while Telegram is unreachable
+    static const int PROBE_MIN_SECONDS = 1;
+    static const int PROBE_MAX_SECONDS = 30;
+
+    std::shared_ptr<ConfigStore> config_;
+    std::shared_ptr<Logger> logger_;
+    size_t worker_count_;
+    size_t max_size_;
+
+    std::deque<DeliveryJob> lanes_[PRIORITY_LEVELS];
+    size_t queued_;
+    int normal_credit_;
+    bool stopping_;
+    bool drain_;
+    bool reachable_;
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    std::condition_variable health_changed_;
+    std::vector<std::thread> workers_;
+    std::thread handoff_thread_;
+    std::thread health_thread_;
+
+    bool dequeue(DeliveryJob& job);
+    void workerLoop();
+    void joinWorkers();
+    void healthLoop();
+    void markUnreachable();
+    void readHandOff(int fd);
+};
+
+#endif // DELIVERY_QUEUE_H
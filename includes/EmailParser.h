@@ -9,6 +9,16 @@
 
 #include <string>
 #include <map>
+#include <vector>
+
+// A non-text MIME part, located in the raw message rather than copied
+struct EmailAttachment {
+    std::string content_type;  // lowercase, without parameters
+    std::string filename;
+    bool base64;
+    size_t offset;             // part body within the raw message
+    size_t length;
+};
 
 struct ParsedEmail {
     std::string subject;
@@ -17,6 +27,7 @@ struct ParsedEmail {
     std::string body;
     std::string content_type;
     std::map<std::string, std::string> headers;
+    std::vector<EmailAttachment> attachments;
 };
 
 class EmailParser {
@@ -36,7 +47,21 @@ private:
     std::string decodeHeader(const std::string& header);
     void parseHeaders(const std::string& header_section, ParsedEmail& email);
     std::string extractBoundary(const std::string& content_type);
-    std::string parseMultipart(const std::string& body, const std::string& boundary);
+    std::string extractParameter(const std::string& value, const std::string& name);
+
+    // A text part, located in the raw message rather than copied
+    struct MimePart {
+        ParsedEmail headers;
+        size_t offset = 0;
+        size_t length = 0;
+        bool found = false;
+    };
+
+    // Walk the multipart in raw[start, end) and the ones nested in it,
+    // adding attachments to email and noting the first inline text/plain
+    // and text/html parts
+    void walkMultipart(const std::string& raw, size_t start, size_t end, const std::string& boundary,
+                       int depth, ParsedEmail& email, MimePart& plain, MimePart& html);
 };
 
 #endif // EMAIL_PARSER_H
@@ -0,0 +1,39 @@
+// HotRestart.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Listening socket inheritance and zero-downtime re-exec
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+class Logger;
+
+class HotRestart {
+public:
+    // Listening sockets passed in by systemd socket activation or by a
+    // previous process via LISTEN_FDS/LISTEN_PID (empty if none)
+    static std::vector<int> inheritedListeners();
+
+    // Read end of the delivery backlog pipe from a previous process, or -1
+    static int inheritedBacklogFd();
+
+    // Tell the process that started this one that its listeners are open
+    // (no-op when not started by a hot restart)
+    static void notifyPredecessor();
+
+    // Start a fresh copy of this binary that inherits the listening
+    // sockets and wait until it reports ready; returns the write end of the
+    // backlog pipe, or -1 on failure (a successor that did not start is
+    // reaped)
+    static int spawnSuccessor(const std::vector<int>& listeners, std::shared_ptr<Logger> logger);
+
+    // Send a state string to systemd (no-op when not run as a notify service)
+    static void notifySystemd(const std::string& state);
+};
+
+#endif // HOT_RESTART_H
@@ -0,0 +1,81 @@
+// IoUring.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Minimal io_uring ring on the raw system calls
+
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+struct IoCompletion {
+    uint64_t user_data;
+    int result;   // as the system call would return it, or -errno
+    bool more;    // a multishot request stays armed and will complete again
+};
+
+// One submission and one completion queue, used from a single thread at a
+// time. Only the operations smtp2telegram needs are wrapped
+class IoUring {
+public:
+    // Set up a ring with room for entries requests. Fails, leaving the ring
+    // unavailable, when built without io_uring (IO_URING=0) or when the
+    // kernel lacks it or forbids it
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool isAvailable() const { return fd_ >= 0; }
+
+    // Why the ring is unavailable
+    const std::string& error() const { return error_; }
+
+    // Pin one buffer for *_FIXED operations (buffer index 0)
+    bool registerBuffer(void* data, size_t length);
+
+    // Have the kernel signal event_fd for every completion
+    bool registerEventFd(int event_fd);
+
+    // Queue a request; false if the submission queue is full
+    bool prepareWriteFixed(int fd, const void* data, unsigned length, uint64_t user_data);
+    bool prepareMultishotAccept(int listen_fd, uint64_t user_data);
+    bool prepareCancel(uint64_t target, uint64_t user_data);
+
+    // Submit everything queued in one system call, then wait until at
+    // least wait_for completions are ready; returns -errno on failure
+    int submit(unsigned wait_for = 0);
+
+    // Take the next completion; false if there is none
+    bool popCompletion(IoCompletion& completion);
+
+private:
+    int fd_;
+    std::string error_;
+    unsigned pending_;  // prepared but not yet submitted
+
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    void* sqes_;
+    size_t sqes_size_;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    void* cqes_;
+
+    // Zeroed submission entry, or null if the queue is full
+    void* nextEntry();
+};
+
+#endif // IO_URING_H
@@ -10,6 +10,12 @@
 #include <string>
 #include <mutex>
 #include <fstream>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+
+class IoUring;
 
 class Logger {
 public:
@@ -27,13 +33,36 @@ public:
     // Rotate logs (remove old entries)
     void rotateLogs();
 
+    // Change retention for subsequent rotations
+    void setKeepDays(int keep_days);
+
+    // Hand file writes to a background thread that batches lines into one
+    // io_uring write from a registered buffer. Returns false with the
+    // reason, leaving plain write() in place, if io_uring is unavailable
+    bool useIoUring(std::string& error);
+
 private:
     std::string log_path_;
     int keep_days_;
     std::mutex log_mutex_;
+    int fd_;  // kept open in append mode; rotation rewrites the same file
+
+    // io_uring writer, when enabled
+    std::unique_ptr<IoUring> ring_;
+    std::vector<char> ring_buffer_;
+    std::string pending_;  // lines waiting for the writer
+    bool writing_;
+    bool stopping_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::thread writer_;
 
     std::string getTimestamp() const;
     void writeLog(const std::string& level, const std::string& message);
+    void openLogFile();
+    void writeAll(const char* data, size_t length);
+    void writerLoop();
+    void flushRing(size_t length);
 };
 
 #endif // LOGGER_H
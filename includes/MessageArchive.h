@@ -0,0 +1,98 @@
+// MessageArchive.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Compressed, indexed archive of received raw emails
+
+#ifndef MESSAGE_ARCHIVE_H
+#define MESSAGE_ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <ctime>
+
+class Logger;
+struct ParsedEmail;
+
+// One archived message as listed in a segment's index
+struct ArchiveEntry {
+    std::time_t time;
+    std::string segment;  // segment file name within the archive directory
+    uint64_t offset;      // of its compressed frame in the segment
+    uint64_t compressed;
+    uint64_t length;      // of the raw message
+    std::string message_id;
+    std::string from;
+    std::string subject;
+};
+
+// Messages go to segment files as one zlib frame each, so any message can
+// be read back on its own; every segment has a tab-separated .idx sidecar
+// with one line per message: time, offset, compressed and raw length,
+// Message-ID, From and Subject
+class MessageArchive {
+public:
+    // Archive into dir, starting a new segment once one reaches
+    // segment_bytes and deleting segments older than keep_days (0: never).
+    // Throws ConfigException if dir cannot be created
+    MessageArchive(const std::string& dir, uint64_t segment_bytes, int keep_days,
+                   std::shared_ptr<Logger> logger);
+
+    // Writes what is still queued
+    ~MessageArchive();
+
+    MessageArchive(const MessageArchive&) = delete;
+    MessageArchive& operator=(const MessageArchive&) = delete;
+
+    // Queue a message; a background thread compresses and writes it. False,
+    // leaving it unarchived, if too much is already waiting
+    bool add(std::shared_ptr<const std::string> raw, const ParsedEmail& email);
+
+    // Every entry of every segment in dir, oldest first
+    static std::vector<ArchiveEntry> readIndex(const std::string& dir);
+
+    // Decompress one message; throws std::runtime_error on failure
+    static std::string readMessage(const std::string& dir, const ArchiveEntry& entry);
+
+private:
+    struct Pending {
+        std::time_t time;
+        std::shared_ptr<const std::string> raw;
+        std::string message_id;
+        std::string from;
+        std::string subject;
+    };
+
+    std::string dir_;
+    uint64_t segment_bytes_;
+    int keep_days_;
+    std::shared_ptr<Logger> logger_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<Pending> pending_;
+    size_t pending_bytes_;
+    bool stopping_;
+    std::thread writer_;
+
+    // Written by the writer thread only
+    int segment_fd_;
+    int index_fd_;
+    uint64_t segment_size_;
+    std::string segment_name_;
+    unsigned segment_sequence_;
+
+    void writerLoop();
+    void write(const Pending& message);
+    bool openSegment();
+    void closeSegment();
+    void removeExpired();
+};
+
+#endif // MESSAGE_ARCHIVE_H
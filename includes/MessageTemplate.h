@@ -0,0 +1,57 @@
+// MessageTemplate.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Compiled Telegram message templates
+
+#ifndef MESSAGE_TEMPLATE_H
+#define MESSAGE_TEMPLATE_H
+
+#include <string>
+#include <vector>
+
+struct ParsedEmail;
+
+enum MessageFormat {
+    FORMAT_PLAIN,
+    FORMAT_MARKDOWN_V2,
+    FORMAT_HTML
+};
+
+class MessageTemplate {
+public:
+    // Compile a MESSAGE_TEMPLATE such as "*{subject}*\n_{from}_\n{body:1500}".
+    // Fields: subject, from, to, body, host, or header.<Name>; ":N" keeps at
+    // most N characters of the field. "\n" and "\t" are newline and tab,
+    // "{{" and "}}" literal braces. Field values are escaped for format;
+    // literal text is sent as written. Throws ConfigException on errors
+    MessageTemplate(const std::string& spec, MessageFormat format);
+
+    // Render into a single allocation of the exact output size
+    std::string render(const ParsedEmail& email) const;
+
+    // Value for Telegram's parse_mode, empty for plain text
+    const char* parseMode() const;
+
+    // Parse a MESSAGE_FORMAT value (plain, markdownv2, html); false if unknown
+    static bool parseFormat(const std::string& name, MessageFormat& format);
+
+private:
+    enum OpType { OP_LITERAL, OP_SUBJECT, OP_FROM, OP_TO, OP_BODY, OP_HOST, OP_HEADER };
+
+    struct Op {
+        OpType type;
+        std::string text;  // literal text, or lowercase header name
+        size_t max_chars;  // 0 for no limit
+    };
+
+    std::vector<Op> ops_;
+    MessageFormat format_;
+    std::string host_;
+
+    // Bytes of the field an op expands to; sets truncated if it was cut
+    void fieldValue(const Op& op, const ParsedEmail& email,
+                    const char*& data, size_t& length, bool& truncated) const;
+};
+
+#endif // MESSAGE_TEMPLATE_H
@@ -0,0 +1,55 @@
+// PriorityRules.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Message priority classification
+
+#ifndef PRIORITY_RULES_H
+#define PRIORITY_RULES_H
+
+#include <string>
+#include <vector>
+
+struct ParsedEmail;
+
+enum MessagePriority {
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL = 1,
+    PRIORITY_LOW = 2
+};
+
+const int PRIORITY_LEVELS = 3;
+
+class PriorityRules {
+public:
+    // Compile a PRIORITY_RULES spec of the form "field~text=level;..."
+    // Fields: subject, from, rcpt, or header.<Name>; levels: high, normal, low
+    explicit PriorityRules(const std::string& spec);
+
+    // First matching rule wins, then X-Priority/Importance headers, else normal
+    MessagePriority classify(const ParsedEmail& email,
+                             const std::vector<std::string>& recipients) const;
+
+    static std::string name(MessagePriority priority);
+
+private:
+    enum Field { FIELD_SUBJECT, FIELD_FROM, FIELD_RCPT, FIELD_HEADER };
+
+    struct Rule {
+        Field field;
+        std::string header;  // lowercase header name for FIELD_HEADER
+        std::string needle;  // lowercase substring to look for
+        MessagePriority priority;
+    };
+
+    std::vector<Rule> rules_;
+
+    bool matches(const Rule& rule, const ParsedEmail& email,
+                 const std::vector<std::string>& recipients) const;
+    MessagePriority fromHeaders(const ParsedEmail& email) const;
+    static std::string findHeader(const ParsedEmail& email, const std::string& lower_name);
+    static bool containsIgnoreCase(const std::string& haystack, const std::string& lower_needle);
+    static std::string toLower(const std::string& value);
+};
+
+#endif // PRIORITY_RULES_H
@@ -0,0 +1,50 @@
+// RecipientRouter.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Recipient address to Telegram chat routing
+
+#ifndef RECIPIENT_ROUTER_H
+#define RECIPIENT_ROUTER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+class RecipientRouter {
+public:
+    // Compile a ROUTES spec of the form "pattern:chat[,chat];pattern:chat"
+    // Patterns: "user@domain" (address), "user@" (local-part), "@domain" or
+    // "domain" (domain and its subdomains)
+    RecipientRouter(const std::string& spec, const std::string& default_chat_id);
+
+    // Chat IDs for one recipient (default chat if nothing matches)
+    std::vector<std::string> resolve(const std::string& address) const;
+
+    // Union of chat IDs for all recipients, in first-seen order
+    std::vector<std::string> resolveAll(const std::vector<std::string>& addresses) const;
+
+    // Number of compiled routes
+    size_t size() const { return route_count_; }
+
+private:
+    struct DomainNode {
+        std::unordered_map<std::string, std::unique_ptr<DomainNode>> children;
+        std::vector<std::string> chat_ids;
+    };
+
+    std::unordered_map<std::string, std::vector<std::string>> addresses_;
+    std::unordered_map<std::string, std::vector<std::string>> local_parts_;
+    DomainNode domains_;
+    std::vector<std::string> default_chat_ids_;
+    size_t route_count_;
+
+    void addRoute(const std::string& pattern, const std::vector<std::string>& chat_ids);
+    void addDomain(const std::string& domain, const std::vector<std::string>& chat_ids);
+    const std::vector<std::string>* findDomain(const std::string& domain) const;
+    static std::string toLower(const std::string& value);
+    static std::string trim(const std::string& value);
+};
+
+#endif // RECIPIENT_ROUTER_H
@@ -0,0 +1,88 @@
+// RuleEngine.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Filter rules matched against every message in one pass
+
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include "PriorityRules.h"
+#include <string>
+#include <vector>
+#include <regex>
+#include <cstdint>
+
+struct ParsedEmail;
+
+// What the matching rules decided for one message
+struct RuleOutcome {
+    bool drop = false;
+    std::vector<std::string> chat_ids;  // empty: route by recipient as usual
+    bool has_priority = false;
+    MessagePriority priority = PRIORITY_NORMAL;
+    std::string prefix;                 // put in front of the subject
+    int rule_line = 0;                  // line of the drop rule, for logging
+};
+
+class RuleEngine {
+public:
+    // Compile a rules file: one rule per line, "field pattern action [arg]".
+    // Fields: subject, from, body (its first body_bytes bytes) or any.
+    // Patterns: "literal text" or /regex/, both case-insensitive. Actions:
+    // drop, route <chat[,chat]>, priority <high|normal|low>, prefix "text".
+    // Blank lines and lines starting with # are skipped. Throws
+    // ConfigException with the line number on errors
+    RuleEngine(const std::string& spec, size_t body_bytes);
+
+    // Evaluate every rule; drop wins, otherwise the first matching rule of
+    // each kind of action applies
+    RuleOutcome evaluate(const ParsedEmail& email) const;
+
+    size_t size() const { return rules_.size(); }
+
+private:
+    enum FieldBits { FIELD_SUBJECT = 1, FIELD_FROM = 2, FIELD_BODY = 4 };
+    enum Action { ACTION_DROP, ACTION_ROUTE, ACTION_PRIORITY, ACTION_PREFIX };
+
+    struct Rule {
+        int line;
+        unsigned fields;         // FieldBits the pattern is looked for in
+        bool is_regex;
+        std::regex regex;
+        int literal;             // automaton pattern: the literal, or a string
+                                 // every regex match contains; -1 if none
+        Action action;
+        std::vector<std::string> chat_ids;
+        MessagePriority priority;
+        std::string prefix;
+    };
+
+    // Aho-Corasick automaton over the lowercased literals, as a full
+    // transition table on compressed byte classes so each input byte costs
+    // one lookup
+    struct State {
+        std::vector<uint32_t> matches;  // patterns ending here, including via suffixes
+    };
+
+    std::vector<Rule> rules_;
+    std::vector<std::string> patterns_;
+    std::vector<State> states_;
+    std::vector<uint32_t> transitions_;  // states_.size() x class_count_
+    uint8_t classes_[256];
+    size_t class_count_;
+    size_t body_bytes_;
+
+    void parseLine(const std::string& line, int number);
+    int addPattern(const std::string& literal);
+    void buildAutomaton();
+
+    // Set bit in hits[pattern] for every pattern found in data
+    void scan(const char* data, size_t length, unsigned bit, std::vector<unsigned>& hits) const;
+
+    // Longest run of literal characters every match of a regex must contain,
+    // or empty if none can be found safely
+    static std::string requiredLiteral(const std::string& regex);
+};
+
+#endif // RULE_ENGINE_H
@@ -7,48 +7,152 @@
 #ifndef SMTP_SERVER_H
 #define SMTP_SERVER_H
 
+#include "EmailParser.h"
+#include "SMTPSession.h"
+#include "IoUring.h"
 #include <string>
+#include <vector>
 #include <memory>
 #include <atomic>
+#include <thread>
 #include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
 
 class Logger;
-class TelegramClient;
-class EmailParser;
+class SessionCapture;
+class MessageArchive;
+class StormCollapser;
+class DeliveryQueue;
+class ConfigStore;
+class AdmissionControl;
 
 class SMTPServer {
 public:
     SMTPServer(const std::string& hostname, int port,
-               std::shared_ptr<TelegramClient> telegram,
+               std::shared_ptr<DeliveryQueue> queue,
                std::shared_ptr<Logger> logger,
-               std::shared_ptr<EmailParser> parser);
+               std::shared_ptr<EmailParser> parser,
+               std::shared_ptr<ConfigStore> config,
+               std::shared_ptr<AdmissionControl> admission);
     ~SMTPServer();
 
+    // Number of listener threads, each with its own SO_REUSEPORT socket
+    // and io_context; optionally pin worker N to CPU N
+    void configureWorkers(int workers, bool pin_cpus);
+
+    // Offer STARTTLS with a PEM certificate chain and key; with required,
+    // mail is refused until the client has switched to TLS. Throws
+    // ConfigException if the files cannot be loaded
+    void configureTls(const std::string& cert_path, const std::string& key_path, bool required);
+
+    // Context shared by all TLS sessions (so tickets and cached sessions
+    // work across workers), or null when STARTTLS is not offered
+    boost::asio::ssl::context* tlsContext() { return tls_context_.get(); }
+    bool isTlsRequired() const { return tls_required_; }
+
+    // Also accept LMTP on a Unix-domain socket at path, created with the
+    // given permission bits, for hand-off from a local MTA
+    void configureLmtp(const std::string& path, int mode);
+
+    // Accept TCP connections through an io_uring multishot accept instead
+    // of epoll; falls back to epoll where the kernel cannot do it
+    void configureIoUring(bool enabled);
+
+    // Record every inbound session to a capture file for offline replay;
+    // throws ConfigException if the file cannot be opened
+    void configureCapture(const std::string& path, uint64_t max_bytes);
+
+    // Keep a compressed copy of every accepted message in dir; throws
+    // ConfigException if the directory cannot be created
+    void configureArchive(const std::string& dir, uint64_t segment_bytes, int keep_days);
+
+    // Send only the first of repeated alerts within window_seconds and edit
+    // a repeat count into it; throws ConfigException for unknown fields
+    void configureStorm(const std::string& fields, int window_seconds, int edit_interval, size_t max_groups);
+
+    // Capture file writer, or null when sessions are not recorded
+    SessionCapture* capture() { return capture_.get(); }
+
     // Start the server (blocking)
     void run();
 
-    // Request graceful shutdown
+    // Request graceful shutdown; only sets a flag, so it is safe to call
+    // from a signal handler
     void shutdown();
 
     // Check if shutdown was requested
     bool isShutdownRequested() const { return shutdown_requested_; }
 
+    // Request a hot restart: start a new process on the same listening
+    // sockets, then drain this one. Safe to call from a signal handler
+    void requestRestart();
+
+    // Deadlines for a new session, from the current configuration
+    SessionTimeouts sessionTimeouts() const;
+
+    // Connection and memory limits shared by all listener workers
+    AdmissionControl& admission() { return *admission_; }
+
+    // Write end of the backlog pipe to the successor after a hot restart, or -1
+    int handoffFd() const { return handoff_fd_; }
+
+    // Parse once, queue for every routed chat and return the SMTP reply;
+    // email_data may be moved into the job when it is sent as a file
+    std::string deliverEmail(EmailParser& parser,
+                             std::string& email_data,
+                             const std::vector<std::string>& recipients);
+
 private:
+    // Everything a listener thread touches on the accept and session path
+    struct Worker {
+        explicit Worker(const EmailParser& prototype)
+            : acceptor(io_context), ring_event_count(0), shutdown_timer(io_context), parser(prototype) {}
+
+        boost::asio::io_context io_context;
+        boost::asio::ip::tcp::acceptor acceptor;
+        std::unique_ptr<boost::asio::local::stream_protocol::acceptor> lmtp_acceptor;  // first worker only
+        std::unique_ptr<IoUring> ring;  // with io_uring accept
+        std::unique_ptr<boost::asio::posix::stream_descriptor> ring_event;  // signalled on ring completions
+        uint64_t ring_event_count;
+        boost::asio::steady_timer shutdown_timer;
+        EmailParser parser;
+        SMTPSession::Registry sessions;
+        std::thread thread;
+    };
+
     std::string hostname_;
     int port_;
-    std::shared_ptr<TelegramClient> telegram_;
+    std::shared_ptr<DeliveryQueue> queue_;
     std::shared_ptr<Logger> logger_;
     std::shared_ptr<EmailParser> parser_;
+    std::shared_ptr<ConfigStore> config_;
+    std::shared_ptr<AdmissionControl> admission_;
     std::atomic<bool> shutdown_requested_;
+    std::atomic<bool> restart_requested_;
+    int worker_count_;
+    bool pin_cpus_;
+    int handoff_fd_;
+    std::unique_ptr<boost::asio::ssl::context> tls_context_;
+    bool tls_required_;
+    std::string lmtp_path_;
+    int lmtp_mode_;
+    bool io_uring_;
+    std::shared_ptr<SessionCapture> capture_;
+    std::shared_ptr<MessageArchive> archive_;
+    std::shared_ptr<StormCollapser> storm_;
 
-    void handleConnection(boost::asio::ip::tcp::socket& socket);
-    void sendResponse(boost::asio::ip::tcp::socket& socket, const std::string& response);
-    bool readCommand(boost::asio::ip::tcp::socket& socket,
-                     boost::asio::streambuf& buf,
-                     std::string& command);
-    bool readData(boost::asio::ip::tcp::socket& socket,
-                  boost::asio::streambuf& buf,
-                  std::string& data);
+    void openAcceptor(Worker& worker, bool reuse_port);
+    void assignAcceptor(Worker& worker, int fd);
+    void openLmtpAcceptor(Worker& worker, int inherited_fd);
+    void restart(const std::vector<std::unique_ptr<Worker>>& workers);
+    bool openRing(Worker& worker, std::string& error);
+    void startAccept(Worker& worker);
+    bool startRingAccept(Worker& worker);
+    void watchRing(Worker& worker);
+    bool drainRing(Worker& worker);
+    void startAcceptLmtp(Worker& worker);
+    void watchShutdown(Worker& worker);
+    void runWorker(Worker& worker, int index);
 };
 
 #endif // SMTP_SERVER_H
@@ -0,0 +1,146 @@
+// SMTPSession.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Asynchronous SMTP session state machine
+
+#ifndef SMTP_SESSION_H
+#define SMTP_SESSION_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+class Logger;
+class SMTPServer;
+class EmailParser;
+class SessionCapture;
+
+// Deadlines of one session, in seconds; a session deadline of 0 is unlimited
+struct SessionTimeouts {
+    int command;  // waiting for each command line
+    int data;     // whole DATA phase, or one BDAT chunk
+    int session;  // connection lifetime
+};
+
+class SMTPSession : public std::enable_shared_from_this<SMTPSession> {
+public:
+    // Sessions owned by one worker; only touched from that worker's thread
+    typedef std::unordered_set<SMTPSession*> Registry;
+
+    SMTPSession(boost::asio::ip::tcp::socket socket,
+                SMTPServer& server,
+                EmailParser& parser,
+                Registry& registry,
+                std::shared_ptr<Logger> logger);
+
+    // LMTP session (RFC 2033) on a connection to the Unix-domain socket
+    SMTPSession(boost::asio::local::stream_protocol::socket socket,
+                SMTPServer& server,
+                EmailParser& parser,
+                Registry& registry,
+                std::shared_ptr<Logger> logger);
+    ~SMTPSession();
+
+    // Send the greeting and start reading commands
+    void start();
+
+    // Close now if idle, otherwise once the current transaction completes
+    void requestClose();
+
+private:
+    boost::asio::ip::tcp::socket socket_;  // unopened for LMTP sessions
+    std::unique_ptr<boost::asio::local::stream_protocol::socket> local_;  // LMTP only
+    std::unique_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>> tls_;  // after STARTTLS
+    boost::asio::steady_timer timer_;          // current command or DATA deadline
+    boost::asio::steady_timer session_timer_;  // overall session deadline
+    boost::asio::streambuf buf_;
+    SMTPServer& server_;
+    EmailParser& parser_;
+    Registry& registry_;
+    std::shared_ptr<Logger> logger_;
+    SessionTimeouts timeouts_;
+
+    std::vector<std::string> pending_;
+    std::vector<std::string> writing_;
+    std::string email_data_;
+    std::vector<std::string> recipients_;
+    boost::asio::ip::address remote_address_;
+    bool admitted_;
+    size_t reserved_bytes_;   // share of MAX_INFLIGHT_BYTES held by email_data_
+    std::string data_reply_;  // set when the message is being discarded
+    bool awaiting_command_;
+    bool close_requested_;
+    bool closed_;
+    SessionCapture* capture_;  // null unless CAPTURE_FILE is set
+    uint64_t capture_id_;
+
+    // Handle every buffered command, then flush replies and read more
+    void processInput();
+
+    // Returns false when the command continues asynchronously
+    bool handleCommand(const std::string& cmd);
+
+    // Run an I/O operation on the TLS stream once STARTTLS has completed,
+    // on the Unix-domain socket for LMTP, on the plain socket otherwise
+    template <typename Operation>
+    void withStream(Operation&& operation) {
+        if (tls_) {
+            operation(*tls_);
+        } else if (local_) {
+            operation(*local_);
+        } else {
+            operation(socket_);
+        }
+    }
+
+    void startTls();
+    void readCommand();
+
+    // Reply 500 to a command line over MAX_COMMAND_LINE and close
+    void rejectLongLine();
+    void readData();
+    void readDataBody();
+    void finishData();
+    void readChunk(size_t size, size_t remaining, bool last);
+    void discardChunk(size_t remaining, bool last);
+    void finishChunk(size_t size, bool last);
+
+    // Account for size more bytes of message data; on failure the message
+    // is discarded and reply is sent once it has been read
+    bool reserve(size_t size, const std::string& reply);
+    void releaseReservation();
+    void resetTransaction();
+
+    // Queue a reply; queued replies go out in one gathered write on flush
+    void queueResponse(const std::string& response);
+    void flush(std::function<void()> then);
+
+    // Queue the outcome of a message: once in SMTP, once per accepted
+    // recipient in LMTP
+    void queueMessageReply(const std::string& reply);
+
+    // Close the session if the current phase is not done within seconds
+    void armTimer(int seconds, const char* phase);
+    void armSessionTimer();
+    void expire(const char* phase);
+    void close();
+
+    // True if a complete command line is already buffered (pipelined)
+    bool hasBufferedCommand() const;
+
+    // Extract the bare address from a MAIL FROM/RCPT TO argument
+    std::string extractAddress(const std::string& command) const;
+
+    // True for the commands refused before STARTTLS when TLS is required
+    bool startsTransaction(const std::string& cmd) const;
+
+    // Message size announced with MAIL FROM SIZE=, or 0
+    size_t declaredSize(const std::string& command) const;
+};
+
+#endif // SMTP_SESSION_H
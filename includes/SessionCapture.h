@@ -0,0 +1,100 @@
+// SessionCapture.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Recording of inbound SMTP sessions for offline replay
+
+#ifndef SESSION_CAPTURE_H
+#define SESSION_CAPTURE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// File layout: the magic "S2TCAP1\n", then records of
+//   type (1 byte), session (varint), time (varint), length (varint), payload
+// Varints are LEB128. Every process appending to the file starts with a
+// CAPTURE_START record whose time is absolute (microseconds since the
+// epoch); later records store microseconds since the previous record
+enum CaptureRecordType {
+    CAPTURE_START = 0,    // payload empty; session ids restart
+    CAPTURE_OPEN = 1,     // payload "smtp" or "lmtp"
+    CAPTURE_COMMAND = 2,  // one command line without CRLF
+    CAPTURE_DATA = 3,     // message after DATA, dot-stuffed, without the terminator
+    CAPTURE_CHUNK = 4,    // BDAT chunk bytes, possibly in several records
+    CAPTURE_CLOSE = 5
+};
+
+struct CaptureRecord {
+    CaptureRecordType type;
+    uint64_t session;  // unique within the file
+    int64_t time_us;   // absolute, microseconds since the epoch
+    std::string data;
+};
+
+class SessionCapture {
+public:
+    // Append to path, creating it with mode 0600. Recording stops once the
+    // file would grow past max_bytes (0: unlimited). Throws ConfigException
+    // if the file cannot be opened
+    SessionCapture(const std::string& path, uint64_t max_bytes);
+    ~SessionCapture();
+
+    SessionCapture(const SessionCapture&) = delete;
+    SessionCapture& operator=(const SessionCapture&) = delete;
+
+    // New session id; records for it are written by the calls below
+    uint64_t open(bool lmtp);
+    void command(uint64_t session, const std::string& line);
+    void data(uint64_t session, const char* data, size_t length);
+    void chunk(uint64_t session, const char* data, size_t length);
+    void close(uint64_t session);
+
+    // Write buffered records to the file and record nothing more, e.g.
+    // before a hot-restart successor starts appending
+    void stop();
+
+    // Record again after stop(), e.g. when the successor failed to start;
+    // a capture stopped at max_bytes or by a write error stays stopped
+    void resume();
+
+private:
+    uint64_t max_bytes_;
+    int fd_;
+    std::mutex mutex_;
+    std::string buffer_;  // records not yet written
+    uint64_t written_;    // file size including buffer_
+    int64_t last_time_us_;
+    std::atomic<uint64_t> next_session_;
+    bool stopped_;        // at max_bytes or by a write error
+    bool paused_;         // by stop() until resume()
+
+    void append(CaptureRecordType type, uint64_t session, const char* data, size_t length);
+    void writeBuffer();
+};
+
+// Sequential reader for capture files
+class CaptureReader {
+public:
+    // Throws std::runtime_error if the file cannot be read or is not a capture
+    explicit CaptureReader(const std::string& path);
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    // Next session record, skipping CAPTURE_START; false at the end of the
+    // file or at a truncated record
+    bool next(CaptureRecord& record);
+
+private:
+    std::FILE* file_;
+    int64_t time_us_;
+    uint64_t segment_;  // CAPTURE_START records seen, keeps session ids unique
+
+    bool readVarint(uint64_t& value);
+};
+
+#endif // SESSION_CAPTURE_H
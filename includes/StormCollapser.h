@@ -0,0 +1,100 @@
+// StormCollapser.h
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Collapsing of repeated alerts into one edited Telegram message
+
+#ifndef STORM_COLLAPSER_H
+#define STORM_COLLAPSER_H
+
+#include "TelegramClient.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+class Logger;
+struct ParsedEmail;
+
+// Messages with the same key (the configured fields plus the target chats)
+// form a group for window_seconds from the first one. Only the first is
+// sent; later ones are counted, and a background thread edits a
+// "repeated ×N, last at hh:mm:ss" footer into the first message, at most
+// once every edit_interval seconds per group
+class StormCollapser {
+public:
+    // Characters a message must leave free for the footer
+    static const size_t FOOTER_RESERVE = 48;
+
+    // fields: comma separated subset of "subject,from,to"; at most
+    // max_groups groups are kept. Throws ConfigException for unknown fields
+    StormCollapser(const std::string& fields, int window_seconds, int edit_interval, size_t max_groups,
+                   std::shared_ptr<Logger> logger);
+
+    // Makes the edits still due, then stops the edit thread
+    ~StormCollapser();
+
+    StormCollapser(const StormCollapser&) = delete;
+    StormCollapser& operator=(const StormCollapser&) = delete;
+
+    // Group key of a message sent to chat_ids
+    uint64_t key(const ParsedEmail& email, const std::vector<std::string>& chat_ids) const;
+
+    // True if the message was counted into an open group and must not be
+    // sent; otherwise it opens a group and is sent with the key attached
+    bool collapse(uint64_t key);
+
+    // The first message of a group went out (or failed for good): sent has
+    // one entry per chat, telegram is the client that posted it
+    void posted(uint64_t key, const std::string& message, const std::vector<std::string>& chat_ids,
+                const std::vector<TelegramSent>& sent, std::shared_ptr<TelegramClient> telegram);
+
+    // The first message of a group will not be posted by this process
+    // (refused by the queue or handed to a successor): closes the group
+    void abandon(uint64_t key);
+
+    // Messages collapsed since startup
+    uint64_t collapsedCount() const;
+
+private:
+    struct Group {
+        std::chrono::steady_clock::time_point opened;
+        std::chrono::steady_clock::time_point last_edit;
+        std::time_t last_at;    // wall clock time of the latest message
+        unsigned count;         // messages in the group, including the first
+        unsigned shown;         // count the posted footer shows
+        bool posted;            // the first message has been sent
+        std::string message;    // text of the first message, without footer
+        std::vector<std::string> chat_ids;
+        std::vector<TelegramSent> sent;
+        std::shared_ptr<TelegramClient> telegram;
+    };
+
+    std::chrono::seconds window_;
+    std::chrono::seconds edit_interval_;
+    size_t max_groups_;
+    bool use_subject_;
+    bool use_from_;
+    bool use_to_;
+    std::shared_ptr<Logger> logger_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::unordered_map<uint64_t, Group> groups_;
+    uint64_t collapsed_;
+    bool stopping_;
+    std::thread editor_;
+
+    void editLoop();
+    void drop(std::unordered_map<uint64_t, Group>::iterator it);
+    void evict(std::chrono::steady_clock::time_point now);
+    static std::string footer(unsigned count, std::time_t last_at);
+};
+
+#endif // STORM_COLLAPSER_H
@@ -8,30 +8,136 @@
 #define TELEGRAM_CLIENT_H
 
 #include <string>
+#include <vector>
 #include <memory>
+#include <functional>
+#include <cstdint>
+#include "BotPool.h"
 
 class Logger;
 
+// A file for sendDocument or sendPhoto, read in place from a buffer that
+// is shared with the rest of the email
+struct TelegramFile {
+    std::shared_ptr<const std::string> buffer;
+    size_t offset = 0;
+    size_t length = 0;     // bytes taken from buffer, still encoded
+    bool base64 = false;   // decoded while it is uploaded
+    std::string filename;
+    std::string content_type;
+
+    // Size of the file as uploaded
+    size_t size() const;
+};
+
+// Where a message was posted, so it can be edited later
+struct TelegramSent {
+    int64_t message_id = 0;  // 0 if it was not sent
+    size_t bot = 0;          // index of the bot that sent it; only it may edit
+};
+
+enum TelegramHealth {
+    TELEGRAM_OK,
+    TELEGRAM_UNAUTHORIZED,  // API key rejected
+    TELEGRAM_UNREACHABLE
+};
+
+enum TelegramResult {
+    TELEGRAM_SENT,
+    TELEGRAM_FAILED,    // worth retrying later
+    TELEGRAM_REJECTED,  // the same request would fail again (HTTP 400/403/413)
+    TELEGRAM_THROTTLED  // the bot hit a rate limit (HTTP 429); another bot may send it
+};
+
 class TelegramClient {
 public:
-    TelegramClient(const std::string& api_key, const std::string& chat_id,
+    // Requests are spread over the bots of the pool, which must all be
+    // members of the target chats
+    TelegramClient(std::shared_ptr<BotPool> bots, const std::string& chat_id,
                    std::shared_ptr<Logger> logger);
     ~TelegramClient();
 
     // Send a message to Telegram (with retry logic)
     bool sendMessage(const std::string& message, int max_retries = 3);
 
-    // Test if the bot configuration is valid
-    bool testConnection();
+    // Send a message to a specific chat (with retry logic)
+    bool sendMessage(const std::string& chat_id, const std::string& message, int max_retries = 3);
+
+    // Send the same message to several chats concurrently; returns successful
+    // sends and adds the chats that rejected it to rejected. With sent, it
+    // also gets where each chat's message was posted (not for split messages)
+    size_t broadcastMessage(const std::vector<std::string>& chat_ids, const std::string& message,
+                            size_t* rejected = nullptr, std::vector<TelegramSent>* sent = nullptr);
+
+    // Replace the text of a message posted earlier, through the bot that
+    // posted it; an unchanged text counts as success
+    TelegramResult editMessage(const std::string& chat_id, const TelegramSent& sent, const std::string& message);
+
+    // Upload a file with sendPhoto (small JPEG/PNG) or sendDocument; the
+    // body is streamed from the file's buffer, so it is never copied again
+    bool sendFile(const std::string& chat_id, const TelegramFile& file,
+                  const std::string& caption, int max_retries = 3);
+
+    // Send the same file to several chats concurrently; returns successful sends
+    size_t broadcastFile(const std::vector<std::string>& chat_ids, const TelegramFile& file,
+                         const std::string& caption, size_t* rejected = nullptr);
+
+    // True if message can be sent with sendMessage without truncation; the
+    // limit counts characters (UTF-16 code units, as Telegram does)
+    static bool fitsInMessage(const std::string& message);
+    static bool fitsInMessage(size_t characters);
+
+    // Repair invalid UTF-8 and cut text to the caption limit of sendDocument
+    static std::string fitCaption(const std::string& caption);
+
+    // Send over-limit text as several numbered messages instead of truncating it
+    void setSplitLongMessages(bool split) { split_long_messages_ = split; }
+
+    // parse_mode for sendMessage (MarkdownV2 or HTML), empty for plain text.
+    // Text that has to be truncated or split is sent as plain text, since
+    // cutting it could break the markup
+    void setParseMode(const std::string& parse_mode) { parse_mode_ = parse_mode; }
+
+    // Split text into numbered parts that each fit in one message, cutting
+    // at line or word breaks and never inside a UTF-8 sequence
+    static std::vector<std::string> splitMessage(const std::string& message);
+
+    // Verify every bot's API key with getMe without posting anything to the
+    // chat; bot_username lists the bots' usernames
+    TelegramHealth checkHealth(std::string& bot_username);
 
 private:
-    std::string api_key_;
+    std::shared_ptr<BotPool> bots_;
     std::string chat_id_;
     std::shared_ptr<Logger> logger_;
+    bool split_long_messages_;
+    std::string parse_mode_;
 
+    TelegramHealth checkBot(const std::string& token, std::string& bot_username);
     static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp);
-    bool performRequest(const std::string& message, std::string& response);
-    std::string escapeMessage(const std::string& message);
+    // sendMessage, or editMessageText of message_id when it is not 0
+    TelegramResult performRequest(const BotPool::Lease& bot, const std::string& chat_id,
+                                  const std::string& message, bool formatted, std::string& response,
+                                  int64_t message_id = 0);
+    TelegramResult sendWithRetries(BotPool::Lease& bot, const std::string& chat_id, const std::string& message,
+                                   bool formatted, int max_retries, TelegramSent* sent = nullptr);
+    TelegramResult deliverMessage(const std::string& chat_id, const std::string& message, int max_retries,
+                                  TelegramSent* sent = nullptr);
+    TelegramResult deliverFile(const std::string& chat_id, const TelegramFile& file,
+                               const std::string& caption, int max_retries);
+    TelegramResult performUpload(const BotPool::Lease& bot, const std::string& chat_id,
+                                 const TelegramFile& file, const std::string& caption, std::string& response);
+    TelegramResult finishRequest(void* curl, std::string& response);
+
+    // Take a throttled bot out of rotation for as long as Telegram asks and
+    // switch to another; true if the new bot can send right away
+    bool switchBot(BotPool::Lease& bot, const std::string& chat_id, const std::string& response);
+
+    // Sleep until a sidelined bot may send again (only when all bots are)
+    void waitForBot(const BotPool::Lease& bot);
+    size_t broadcast(const std::vector<std::string>& chat_ids,
+                     const std::function<TelegramResult(size_t)>& send, size_t* rejected);
+    std::string escapeMessage(void* curl, const std::string& message);
     void truncateIfNeeded(std::string& message);
 };
 
@@ -9,9 +9,25 @@
 
 // Include all component headers
 #include "Config.h"
+#include "ConfigStore.h"
 #include "Logger.h"
 #include "TelegramClient.h"
 #include "EmailParser.h"
 #include "SMTPServer.h"
+#include "SMTPSession.h"
+#include "RecipientRouter.h"
+#include "DedupCache.h"
+#include "PriorityRules.h"
+#include "DeliveryQueue.h"
+#include "HotRestart.h"
+#include "AdmissionControl.h"
+#include "MessageTemplate.h"
+#include "CharsetConverter.h"
+#include "BotPool.h"
+#include "RuleEngine.h"
+#include "IoUring.h"
+#include "SessionCapture.h"
+#include "MessageArchive.h"
+#include "StormCollapser.h"
 
 #endif // SMTP2TELEGRAM_H
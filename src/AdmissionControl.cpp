@@ -0,0 +1,152 @@
+// AdmissionControl.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Connection limits and backpressure implementation
+
+#include "../includes/AdmissionControl.h"
+#include "../includes/DeliveryQueue.h"
+#include "../includes/Logger.h"
+#include <cstring>
+
+namespace {
+
+void addressKey(const boost::asio::ip::address& address, uint8_t* key) {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    if (address.is_v4()) {
+        bytes = boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+    } else {
+        bytes = address.to_v6().to_bytes();
+    }
+    std::memcpy(key, bytes.data(), 16);
+}
+
+size_t hashKey(const uint8_t* key) {
+    uint64_t high, low;
+    std::memcpy(&high, key, 8);
+    std::memcpy(&low, key + 8, 8);
+    uint64_t h = (high ^ (low * 0x9E3779B97F4A7C15ULL)) * 0xFF51AFD7ED558CCDULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+size_t roundUpPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) result <<= 1;
+    return result;
+}
+
+} // namespace
+
+AdmissionControl::AdmissionControl(size_t max_connections, size_t max_per_ip, size_t max_inflight_bytes,
+                                   size_t queue_high, size_t queue_low,
+                                   std::shared_ptr<DeliveryQueue> queue, std::shared_ptr<Logger> logger)
+    : max_connections_(max_connections), max_per_ip_(max_per_ip),
+      max_inflight_bytes_(max_inflight_bytes), queue_high_(queue_high), queue_low_(queue_low),
+      queue_(queue), logger_(logger), connections_(0), inflight_bytes_(0), congested_(false) {
+    size_t slots = roundUpPowerOfTwo(max_connections_ * 2);
+    mask_ = slots - 1;
+    slots_.assign(slots, Slot());
+}
+
+size_t AdmissionControl::find(const uint8_t* address) const {
+    // Linear probing: the address is in the first slot that is free or holds it
+    size_t index = hashKey(address) & mask_;
+    while (slots_[index].count != 0 && std::memcmp(slots_[index].address, address, 16) != 0) {
+        index = (index + 1) & mask_;
+    }
+    return index;
+}
+
+void AdmissionControl::erase(size_t index) {
+    // Shift later entries of the probe run back so lookups need no tombstones
+    size_t next = (index + 1) & mask_;
+    while (slots_[next].count != 0) {
+        size_t home = hashKey(slots_[next].address) & mask_;
+        bool movable = index <= next ? (home <= index || home > next) : (home <= index && home > next);
+        if (movable) {
+            slots_[index] = slots_[next];
+            index = next;
+        }
+        next = (next + 1) & mask_;
+    }
+    slots_[index].count = 0;
+}
+
+Admission AdmissionControl::admitConnection(const boost::asio::ip::address& address) {
+    uint8_t key[16];
+    addressKey(address, key);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (connections_ >= max_connections_) {
+        return REJECT_TOTAL;
+    }
+
+    Slot& slot = slots_[find(key)];
+    if (slot.count >= max_per_ip_) {
+        return REJECT_PER_IP;
+    }
+
+    if (slot.count == 0) {
+        std::memcpy(slot.address, key, 16);
+    }
+    ++slot.count;
+    ++connections_;
+    return ADMIT;
+}
+
+void AdmissionControl::releaseConnection(const boost::asio::ip::address& address) {
+    uint8_t key[16];
+    addressKey(address, key);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t index = find(key);
+    if (slots_[index].count == 0) return;
+
+    --connections_;
+    if (--slots_[index].count == 0) {
+        erase(index);
+    }
+}
+
+size_t AdmissionControl::connections() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connections_;
+}
+
+bool AdmissionControl::reserveBytes(size_t bytes) {
+    size_t current = inflight_bytes_.load();
+    do {
+        if (current + bytes > max_inflight_bytes_) return false;
+    } while (!inflight_bytes_.compare_exchange_weak(current, current + bytes));
+    return true;
+}
+
+void AdmissionControl::releaseBytes(size_t bytes) {
+    inflight_bytes_ -= bytes;
+}
+
+void AdmissionControl::holdBytes(size_t bytes) {
+    inflight_bytes_ += bytes;
+}
+
+bool AdmissionControl::hasRoomFor(size_t bytes) const {
+    return inflight_bytes_.load() + bytes <= max_inflight_bytes_;
+}
+
+bool AdmissionControl::isCongested() {
+    size_t depth = queue_->size();
+
+    // Hysteresis keeps the server from flapping around a single threshold
+    if (!congested_ && depth >= queue_high_) {
+        if (!congested_.exchange(true)) {
+            logger_->warning("Delivery queue at " + std::to_string(depth) +
+                             " messages, deferring new mail");
+        }
+    } else if (congested_ && depth <= queue_low_) {
+        if (congested_.exchange(false)) {
+            logger_->info("Delivery queue down to " + std::to_string(depth) +
+                          " messages, accepting mail again");
+        }
+    }
+    return congested_;
+}
@@ -0,0 +1,211 @@
+// BotPool.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Bot selection and per-bot connection pools
+
+#include "../includes/BotPool.h"
+#include <curl/curl.h>
+#include <chrono>
+#include <functional>
+#include <limits>
+
+// Connections kept open per bot between requests; more concurrent requests
+// than this still work, their extra handles are closed afterwards
+const size_t MAX_IDLE_CONNECTIONS = 16;
+
+namespace {
+
+int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// splitmix64 finalizer; spreads similar inputs over the whole range
+uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+} // namespace
+
+BotPool::Lease::Lease(Lease&& other) : pool_(other.pool_), bot_(other.bot_), handle_(other.handle_) {
+    other.pool_ = nullptr;
+    other.bot_ = nullptr;
+    other.handle_ = nullptr;
+}
+
+BotPool::Lease& BotPool::Lease::operator=(Lease&& other) {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        bot_ = other.bot_;
+        handle_ = other.handle_;
+        other.pool_ = nullptr;
+        other.bot_ = nullptr;
+        other.handle_ = nullptr;
+    }
+    return *this;
+}
+
+BotPool::Lease::~Lease() {
+    release();
+}
+
+void BotPool::Lease::release() {
+    if (!bot_) return;
+    pool_->returnHandle(*bot_, handle_);
+    bot_->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    pool_ = nullptr;
+    bot_ = nullptr;
+    handle_ = nullptr;
+}
+
+const std::string& BotPool::Lease::token() const {
+    return bot_->token;
+}
+
+size_t BotPool::Lease::index() const {
+    return bot_->index;
+}
+
+int BotPool::Lease::readyIn() const {
+    int64_t wait = bot_->sidelined_until.load(std::memory_order_relaxed) - nowNanos();
+    return wait > 0 ? static_cast<int>((wait + 999999999) / 1000000000) : 0;
+}
+
+BotPool::BotPool(const std::vector<std::string>& tokens, BotScheduling scheduling)
+    : scheduling_(scheduling), next_(0) {
+    // curl_global_init is not thread-safe; do it once before any concurrent sends
+    static std::once_flag curl_init;
+    std::call_once(curl_init, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    for (const auto& token : tokens) {
+        std::unique_ptr<Bot> bot(new Bot());
+        bot->token = token;
+        bot->index = bots_.size();
+        bot->seed = mix(std::hash<std::string>()(token));
+        bot->in_flight = 0;
+        bot->sidelined_until = 0;
+        bots_.push_back(std::move(bot));
+    }
+}
+
+BotPool::~BotPool() {
+    for (auto& bot : bots_) {
+        for (void* handle : bot->idle) {
+            curl_easy_cleanup(static_cast<CURL*>(handle));
+        }
+    }
+}
+
+BotPool::Lease BotPool::acquire(const std::string& chat_id) {
+    int64_t now = nowNanos();
+    uint64_t chat_hash = mix(std::hash<std::string>()(chat_id));
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+
+    // Among available bots pick the least loaded one, or with chat hashing
+    // the one scoring highest for this chat (rendezvous hashing: a bot that
+    // is sidelined only moves its own chats); if all are sidelined, the one
+    // that comes back first
+    Bot* chosen = nullptr;
+    Bot* earliest = nullptr;
+    uint64_t best = 0;
+    for (size_t i = 0; i < bots_.size(); ++i) {
+        Bot* bot = bots_[(start + i) % bots_.size()].get();
+        int64_t until = bot->sidelined_until.load(std::memory_order_relaxed);
+        if (until > now) {
+            if (!earliest || until < earliest->sidelined_until.load(std::memory_order_relaxed)) {
+                earliest = bot;
+            }
+            continue;
+        }
+
+        uint64_t score = scheduling_ == SCHEDULE_CHAT_HASH
+                             ? mix(chat_hash ^ bot->seed)
+                             : std::numeric_limits<uint64_t>::max() - bot->in_flight.load(std::memory_order_relaxed);
+        if (!chosen || score > best) {
+            chosen = bot;
+            best = score;
+        }
+    }
+    if (!chosen) chosen = earliest;
+
+    chosen->in_flight.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, chosen, takeHandle(*chosen));
+}
+
+BotPool::Lease BotPool::acquireBot(size_t index) {
+    Bot* bot = bots_[index].get();
+    bot->in_flight.fetch_add(1, std::memory_order_relaxed);
+    return Lease(this, bot, takeHandle(*bot));
+}
+
+void BotPool::sideline(const Lease& lease, int seconds) {
+    int64_t until = nowNanos() + static_cast<int64_t>(seconds) * 1000000000;
+    int64_t current = lease.bot_->sidelined_until.load(std::memory_order_relaxed);
+    while (current < until &&
+           !lease.bot_->sidelined_until.compare_exchange_weak(current, until, std::memory_order_relaxed)) {
+    }
+}
+
+const std::string& BotPool::token(size_t index) const {
+    return bots_[index]->token;
+}
+
+std::vector<std::string> BotPool::splitTokens(const std::string& list) {
+    std::vector<std::string> tokens;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+
+        std::string token = list.substr(start, end - start);
+        token.erase(0, token.find_first_not_of(" \t"));
+        token.erase(token.find_last_not_of(" \t") + 1);
+        if (token.empty()) return std::vector<std::string>();
+
+        tokens.push_back(token);
+        start = end + 1;
+    }
+    return tokens;
+}
+
+bool BotPool::parseScheduling(const std::string& name, BotScheduling& scheduling) {
+    if (name.empty() || name == "least-loaded") {
+        scheduling = SCHEDULE_LEAST_LOADED;
+    } else if (name == "chat-hash") {
+        scheduling = SCHEDULE_CHAT_HASH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void* BotPool::takeHandle(Bot& bot) {
+    {
+        std::lock_guard<std::mutex> lock(bot.mutex);
+        if (!bot.idle.empty()) {
+            void* handle = bot.idle.back();
+            bot.idle.pop_back();
+            return handle;
+        }
+    }
+    return curl_easy_init();
+}
+
+void BotPool::returnHandle(Bot& bot, void* handle) {
+    if (!handle) return;
+    {
+        std::lock_guard<std::mutex> lock(bot.mutex);
+        if (bot.idle.size() < MAX_IDLE_CONNECTIONS) {
+            bot.idle.push_back(handle);
+            return;
+        }
+    }
+    curl_easy_cleanup(static_cast<CURL*>(handle));
+}
@@ -0,0 +1,375 @@
+// CharsetConverter.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Table-driven charset conversion implementation
+
+#include "../includes/CharsetConverter.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Code points of bytes 0x80-0xFF, generated from the charset definitions
+
+// ISO 8859-2 (Central European)
+const uint16_t ISO_8859_2[128] = {
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+    0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+    0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+    0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+    0x00A0, 0x0104, 0x02D8, 0x0141, 0x00A4, 0x013D, 0x015A, 0x00A7,
+    0x00A8, 0x0160, 0x015E, 0x0164, 0x0179, 0x00AD, 0x017D, 0x017B,
+    0x00B0, 0x0105, 0x02DB, 0x0142, 0x00B4, 0x013E, 0x015B, 0x02C7,
+    0x00B8, 0x0161, 0x015F, 0x0165, 0x017A, 0x02DD, 0x017E, 0x017C,
+    0x0154, 0x00C1, 0x00C2, 0x0102, 0x00C4, 0x0139, 0x0106, 0x00C7,
+    0x010C, 0x00C9, 0x0118, 0x00CB, 0x011A, 0x00CD, 0x00CE, 0x010E,
+    0x0110, 0x0143, 0x0147, 0x00D3, 0x00D4, 0x0150, 0x00D6, 0x00D7,
+    0x0158, 0x016E, 0x00DA, 0x0170, 0x00DC, 0x00DD, 0x0162, 0x00DF,
+    0x0155, 0x00E1, 0x00E2, 0x0103, 0x00E4, 0x013A, 0x0107, 0x00E7,
+    0x010D, 0x00E9, 0x0119, 0x00EB, 0x011B, 0x00ED, 0x00EE, 0x010F,
+    0x0111, 0x0144, 0x0148, 0x00F3, 0x00F4, 0x0151, 0x00F6, 0x00F7,
+    0x0159, 0x016F, 0x00FA, 0x0171, 0x00FC, 0x00FD, 0x0163, 0x02D9
+};
+
+// ISO 8859-15 (Western European with euro sign)
+const uint16_t ISO_8859_15[128] = {
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+    0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+    0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+    0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x20AC, 0x00A5, 0x0160, 0x00A7,
+    0x0161, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x017D, 0x00B5, 0x00B6, 0x00B7,
+    0x017E, 0x00B9, 0x00BA, 0x00BB, 0x0152, 0x0153, 0x0178, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF
+};
+
+// Windows-1250 (Central European)
+const uint16_t WINDOWS_1250[128] = {
+    0x20AC, 0xFFFD, 0x201A, 0xFFFD, 0x201E, 0x2026, 0x2020, 0x2021,
+    0xFFFD, 0x2030, 0x0160, 0x2039, 0x015A, 0x0164, 0x017D, 0x0179,
+    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0xFFFD, 0x2122, 0x0161, 0x203A, 0x015B, 0x0165, 0x017E, 0x017A,
+    0x00A0, 0x02C7, 0x02D8, 0x0141, 0x00A4, 0x0104, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x015E, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x017B,
+    0x00B0, 0x00B1, 0x02DB, 0x0142, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x0105, 0x015F, 0x00BB, 0x013D, 0x02DD, 0x013E, 0x017C,
+    0x0154, 0x00C1, 0x00C2, 0x0102, 0x00C4, 0x0139, 0x0106, 0x00C7,
+    0x010C, 0x00C9, 0x0118, 0x00CB, 0x011A, 0x00CD, 0x00CE, 0x010E,
+    0x0110, 0x0143, 0x0147, 0x00D3, 0x00D4, 0x0150, 0x00D6, 0x00D7,
+    0x0158, 0x016E, 0x00DA, 0x0170, 0x00DC, 0x00DD, 0x0162, 0x00DF,
+    0x0155, 0x00E1, 0x00E2, 0x0103, 0x00E4, 0x013A, 0x0107, 0x00E7,
+    0x010D, 0x00E9, 0x0119, 0x00EB, 0x011B, 0x00ED, 0x00EE, 0x010F,
+    0x0111, 0x0144, 0x0148, 0x00F3, 0x00F4, 0x0151, 0x00F6, 0x00F7,
+    0x0159, 0x016F, 0x00FA, 0x0171, 0x00FC, 0x00FD, 0x0163, 0x02D9
+};
+
+// Windows-1251 (Cyrillic)
+const uint16_t WINDOWS_1251[128] = {
+    0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+    0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0xFFFD, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+    0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+    0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+    0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+    0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+    0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+    0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+    0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+    0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+    0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+    0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+    0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+    0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F
+};
+
+// Windows-1252 (Western European); undefined bytes map to the C1
+// controls, as browsers do
+const uint16_t WINDOWS_1252[128] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF
+};
+
+// KOI8-R (Russian)
+const uint16_t KOI8_R[128] = {
+    0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518, 0x251C, 0x2524,
+    0x252C, 0x2534, 0x253C, 0x2580, 0x2584, 0x2588, 0x258C, 0x2590,
+    0x2591, 0x2592, 0x2593, 0x2320, 0x25A0, 0x2219, 0x221A, 0x2248,
+    0x2264, 0x2265, 0x00A0, 0x2321, 0x00B0, 0x00B2, 0x00B7, 0x00F7,
+    0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556,
+    0x2557, 0x2558, 0x2559, 0x255A, 0x255B, 0x255C, 0x255D, 0x255E,
+    0x255F, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565,
+    0x2566, 0x2567, 0x2568, 0x2569, 0x256A, 0x256B, 0x256C, 0x00A9,
+    0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,
+    0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,
+    0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,
+    0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,
+    0x042E, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413,
+    0x0425, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E,
+    0x041F, 0x042F, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412,
+    0x042C, 0x042B, 0x0417, 0x0428, 0x042D, 0x0429, 0x0427, 0x042A
+};
+// UTF-8 encoding of the upper half of a single-byte charset, so converting
+// a byte is one table lookup and a copy of at most three bytes
+struct Utf8Table {
+    uint8_t length[128];
+    char bytes[128][3];
+
+    explicit Utf8Table(const uint16_t* code_points) {
+        for (int i = 0; i < 128; ++i) {
+            uint16_t cp = code_points[i];
+            if (cp < 0x800) {
+                length[i] = 2;
+                bytes[i][0] = static_cast<char>(0xC0 | (cp >> 6));
+                bytes[i][1] = static_cast<char>(0x80 | (cp & 0x3F));
+            } else {
+                length[i] = 3;
+                bytes[i][0] = static_cast<char>(0xE0 | (cp >> 12));
+                bytes[i][1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                bytes[i][2] = static_cast<char>(0x80 | (cp & 0x3F));
+            }
+        }
+    }
+};
+
+const Utf8Table ISO_8859_2_UTF8(ISO_8859_2);
+const Utf8Table ISO_8859_15_UTF8(ISO_8859_15);
+const Utf8Table WINDOWS_1250_UTF8(WINDOWS_1250);
+const Utf8Table WINDOWS_1251_UTF8(WINDOWS_1251);
+const Utf8Table WINDOWS_1252_UTF8(WINDOWS_1252);
+const Utf8Table KOI8_R_UTF8(KOI8_R);
+
+struct CharsetName {
+    const char* name;
+    const Utf8Table* table;  // null for charsets that are already UTF-8
+};
+
+// ISO 8859-1 and ASCII labels are decoded as Windows-1252, like browsers
+// do: senders routinely label Windows-1252 text (curly quotes, euro sign)
+// as Latin-1, and for real Latin-1 text the result is the same
+const CharsetName CHARSETS[] = {
+    {"utf-8", nullptr}, {"utf8", nullptr},
+    {"us-ascii", nullptr}, {"ascii", nullptr},
+    {"iso-8859-1", &WINDOWS_1252_UTF8}, {"iso8859-1", &WINDOWS_1252_UTF8},
+    {"iso_8859-1", &WINDOWS_1252_UTF8}, {"latin1", &WINDOWS_1252_UTF8},
+    {"l1", &WINDOWS_1252_UTF8}, {"cp819", &WINDOWS_1252_UTF8},
+    {"windows-1252", &WINDOWS_1252_UTF8}, {"cp1252", &WINDOWS_1252_UTF8},
+    {"x-cp1252", &WINDOWS_1252_UTF8},
+    {"iso-8859-2", &ISO_8859_2_UTF8}, {"iso8859-2", &ISO_8859_2_UTF8},
+    {"iso_8859-2", &ISO_8859_2_UTF8}, {"latin2", &ISO_8859_2_UTF8},
+    {"iso-8859-15", &ISO_8859_15_UTF8}, {"iso8859-15", &ISO_8859_15_UTF8},
+    {"iso_8859-15", &ISO_8859_15_UTF8}, {"latin9", &ISO_8859_15_UTF8},
+    {"windows-1250", &WINDOWS_1250_UTF8}, {"cp1250", &WINDOWS_1250_UTF8},
+    {"windows-1251", &WINDOWS_1251_UTF8}, {"cp1251", &WINDOWS_1251_UTF8},
+    {"koi8-r", &KOI8_R_UTF8},
+};
+
+// Find the table for charset, null if text in it is already UTF-8; false
+// if the charset is unknown. An empty name is ASCII (RFC 2045 default)
+bool findTable(const std::string& charset, const Utf8Table*& table) {
+    std::string name;
+    name.reserve(charset.size());
+    for (char c : charset) {
+        if (c == '"' || c == ' ' || c == '\t') continue;
+        // RFC 2231 language suffix, e.g. iso-8859-1*en
+        if (c == '*') break;
+        name += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    table = nullptr;
+    if (name.empty()) return true;
+
+    for (const auto& entry : CHARSETS) {
+        if (name == entry.name) {
+            table = entry.table;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Length of the well-formed UTF-8 sequence at data (Unicode table 3-7:
+// no overlong forms, surrogates or code points above U+10FFFF), or 0 if
+// it is malformed; then invalid is the length of its maximal invalid
+// prefix, which is replaced by a single U+FFFD
+size_t sequenceLength(const unsigned char* data, size_t available, size_t& invalid) {
+    unsigned char lead = data[0];
+    size_t length;
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0) low = 0xA0;
+        if (lead == 0xED) high = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0) low = 0x90;
+        if (lead == 0xF4) high = 0x8F;
+    } else {
+        invalid = 1;
+        return 0;
+    }
+
+    for (size_t i = 1; i < length; ++i) {
+        if (i >= available || data[i] < low || data[i] > high) {
+            invalid = i;
+            return 0;
+        }
+        low = 0x80;
+        high = 0xBF;
+    }
+    return length;
+}
+
+const char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+} // namespace
+
+size_t CharsetConverter::asciiPrefix(const char* data, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int high_bits = _mm_movemask_epi8(chunk);
+        if (high_bits != 0) return i + __builtin_ctz(high_bits);
+    }
+#endif
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        if (word & 0x8080808080808080ULL) break;
+    }
+    while (i < length && !(static_cast<unsigned char>(data[i]) & 0x80)) ++i;
+    return i;
+}
+
+bool CharsetConverter::isSupported(const std::string& charset) {
+    const Utf8Table* table;
+    return findTable(charset, table);
+}
+
+bool CharsetConverter::toUtf8(const std::string& charset, std::string& text) {
+    const Utf8Table* table;
+    if (!findTable(charset, table)) return false;
+    if (!table) return true;
+
+    const char* in = text.data();
+    size_t length = text.size();
+    size_t ascii = asciiPrefix(in, length);
+    if (ascii == length) return true;
+
+    // Every byte turns into at most three; one allocation, trimmed at the end
+    std::string result(ascii + (length - ascii) * 3, '\0');
+    char* out = &result[0];
+    std::memcpy(out, in, ascii);
+    out += ascii;
+
+    size_t i = ascii;
+    while (i < length) {
+        unsigned char byte = static_cast<unsigned char>(in[i]);
+        if (byte & 0x80) {
+            uint8_t n = table->length[byte - 0x80];
+            std::memcpy(out, table->bytes[byte - 0x80], n);
+            out += n;
+            ++i;
+        } else {
+            // Copy the whole ASCII run at once
+            size_t run = asciiPrefix(in + i, length - i);
+            std::memcpy(out, in + i, run);
+            out += run;
+            i += run;
+        }
+    }
+
+    result.resize(out - result.data());
+    text.swap(result);
+    return true;
+}
+
+size_t CharsetConverter::utf16Length(const char* data, size_t length) {
+    // Every byte but a continuation byte starts a character; 4-byte
+    // sequences are surrogate pairs in UTF-16 and count twice
+    size_t units = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i last_continuation = _mm_set1_epi8(static_cast<char>(0xBF));
+    const __m128i before_four_byte = _mm_set1_epi8(static_cast<char>(0xEF));
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int starts = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, last_continuation));
+        int four_byte = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, before_four_byte)) & _mm_movemask_epi8(chunk);
+        units += __builtin_popcount(starts) + __builtin_popcount(four_byte);
+    }
+#endif
+    for (; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        units += ((c & 0xC0) != 0x80) + (c >= 0xF0);
+    }
+    return units;
+}
+
+size_t CharsetConverter::repairUtf8(std::string& text) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(text.data());
+    size_t length = text.size();
+    size_t units = 0;
+    size_t i = 0;
+    std::string repaired;  // only used once a malformed sequence is found
+    size_t copied = 0;     // bytes of text already moved to repaired
+
+    while (i < length) {
+        size_t ascii = asciiPrefix(text.data() + i, length - i);
+        units += ascii;
+        i += ascii;
+        if (i == length) break;
+
+        size_t invalid;
+        size_t sequence = sequenceLength(in + i, length - i, invalid);
+        if (sequence) {
+            units += sequence == 4 ? 2 : 1;
+            i += sequence;
+            continue;
+        }
+
+        if (repaired.empty()) repaired.reserve(length + 16);
+        repaired.append(text, copied, i - copied);
+        repaired += REPLACEMENT_CHARACTER;
+        ++units;
+        i += invalid;
+        copied = i;
+    }
+
+    if (copied > 0) {
+        repaired.append(text, copied, std::string::npos);
+        text.swap(repaired);
+    }
+    return units;
+}
@@ -5,15 +5,27 @@
 // Configuration management implementation
 
 #include "../includes/Config.h"
+#include "../includes/BotPool.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstdlib>
 #include <sys/stat.h>
 #include <cerrno>
 #include <cstring>
 
 Config::Config()
-    : smtp_port_(2525), log_keep_days_(3) {
+    : bot_scheduling_("least-loaded"), smtp_port_(2525), log_keep_days_(3), dedup_window_(0),
+      dedup_cache_size_(4096), dedup_fields_("subject,from,body"), storm_window_(0),
+      storm_fields_("subject,from"), storm_edit_interval_(10), storm_max_groups_(1024), delivery_workers_(4), delivery_queue_size_(10000),
+      smtp_workers_(1), smtp_cpu_pinning_(false), telegram_overflow_("truncate"),
+      message_format_("plain"),
+      attachment_max_size_(10 * 1024 * 1024), attachment_max_count_(5), max_connections_(1000),
+      max_connections_per_ip_(100), max_inflight_bytes_(256 * 1024 * 1024),
+      queue_high_watermark_(90), queue_low_watermark_(75), smtp_command_timeout_(30),
+      smtp_data_timeout_(300), smtp_session_timeout_(1800), smtp_require_tls_(false),
+      lmtp_socket_mode_(0666), rules_body_bytes_(4096), io_backend_("epoll"),
+      capture_max_mb_(1024), archive_segment_mb_(64), archive_keep_days_(30) {
     const char* home = std::getenv("HOME");
     if (!home) {
         throw ConfigException("HOME environment variable not set");
@@ -24,11 +36,14 @@ Config::Config()
     log_path_ = config_dir_ + "/smtp_server.log";
 }
 
-void Config::load() {
+void Config::load(bool interactive) {
     createConfigDirectory();
 
     std::ifstream env_file(env_path_);
     if (!env_file) {
+        if (!interactive) {
+            throw ConfigException(".env file not found at " + env_path_);
+        }
         createEnvFile();
         env_file.open(env_path_);
     }
@@ -37,12 +52,12 @@ void Config::load() {
         loadEnvFile();
     }
 
-    // Load from environment variables
-    const char* chat_id = std::getenv("CHAT_ID");
-    const char* api_key = std::getenv("API_KEY");
-    const char* hostname = std::getenv("SMTP_HOSTNAME");
-    const char* port_str = std::getenv("SMTP_PORT");
-    const char* log_keep_days_str = std::getenv("LOG_KEEP_DAYS");
+    // .env values take precedence over the process environment
+    const char* chat_id = lookup("CHAT_ID");
+    const char* api_key = lookup("API_KEY");
+    const char* hostname = lookup("SMTP_HOSTNAME");
+    const char* port_str = lookup("SMTP_PORT");
+    const char* log_keep_days_str = lookup("LOG_KEEP_DAYS");
 
     if (!chat_id || !api_key || !hostname || !port_str || !log_keep_days_str) {
         throw ConfigException("Missing required environment variables. Set CHAT_ID, API_KEY, SMTP_HOSTNAME, SMTP_PORT, LOG_KEEP_DAYS.");
@@ -52,13 +67,140 @@ void Config::load() {
     api_key_ = api_key;
     smtp_hostname_ = hostname;
 
+    // Optional recipient routing table
+    const char* routes = lookup("ROUTES");
+    routes_ = routes ? routes : "";
+
+    // Optional duplicate suppression (disabled when DEDUP_WINDOW is 0)
+    const char* dedup_window_str = lookup("DEDUP_WINDOW");
+    const char* dedup_cache_size_str = lookup("DEDUP_CACHE_SIZE");
+    const char* dedup_fields = lookup("DEDUP_FIELDS");
+    if (dedup_fields && *dedup_fields) dedup_fields_ = dedup_fields;
+
+    // Optional collapsing of repeated alerts (disabled when STORM_WINDOW is 0)
+    const char* storm_window_str = lookup("STORM_WINDOW");
+    const char* storm_edit_interval_str = lookup("STORM_EDIT_INTERVAL");
+    const char* storm_max_groups_str = lookup("STORM_MAX_GROUPS");
+    const char* storm_fields = lookup("STORM_FIELDS");
+    if (storm_fields && *storm_fields) storm_fields_ = storm_fields;
+
+    // Optional delivery tuning
+    const char* priority_rules = lookup("PRIORITY_RULES");
+    const char* delivery_workers_str = lookup("DELIVERY_WORKERS");
+    const char* delivery_queue_size_str = lookup("DELIVERY_QUEUE_SIZE");
+    priority_rules_ = priority_rules ? priority_rules : "";
+
+    // What to do with emails too long for one Telegram message
+    const char* telegram_overflow = lookup("TELEGRAM_OVERFLOW");
+    if (telegram_overflow && *telegram_overflow) telegram_overflow_ = telegram_overflow;
+
+    // How messages are spread over several bots in API_KEY
+    const char* bot_scheduling = lookup("BOT_SCHEDULING");
+    if (bot_scheduling && *bot_scheduling) bot_scheduling_ = bot_scheduling;
+
+    // Optional message layout, compiled by ConfigStore
+    const char* message_template = lookup("MESSAGE_TEMPLATE");
+    message_template_ = message_template ? message_template : "";
+    const char* message_format = lookup("MESSAGE_FORMAT");
+    if (message_format && *message_format) message_format_ = message_format;
+
+    // Optional attachment forwarding (disabled when ATTACHMENT_TYPES is empty)
+    const char* attachment_types = lookup("ATTACHMENT_TYPES");
+    const char* attachment_max_size_str = lookup("ATTACHMENT_MAX_SIZE");
+    const char* attachment_max_count_str = lookup("ATTACHMENT_MAX_COUNT");
+    attachment_types_ = attachment_types ? attachment_types : "";
+
+    // Optional listener sharding
+    const char* smtp_workers_str = lookup("SMTP_WORKERS");
+    smtp_cpu_pinning_ = parseBool(lookup("SMTP_CPU_PINNING"));
+
+    // Optional admission control
+    const char* max_connections_str = lookup("MAX_CONNECTIONS");
+    const char* max_connections_per_ip_str = lookup("MAX_CONNECTIONS_PER_IP");
+    const char* max_inflight_bytes_str = lookup("MAX_INFLIGHT_BYTES");
+    const char* queue_high_watermark_str = lookup("QUEUE_HIGH_WATERMARK");
+    const char* queue_low_watermark_str = lookup("QUEUE_LOW_WATERMARK");
+
+    // Optional session deadlines
+    const char* smtp_command_timeout_str = lookup("SMTP_COMMAND_TIMEOUT");
+    const char* smtp_data_timeout_str = lookup("SMTP_DATA_TIMEOUT");
+    const char* smtp_session_timeout_str = lookup("SMTP_SESSION_TIMEOUT");
+
+    // Optional STARTTLS (offered when a certificate and key are configured)
+    const char* smtp_tls_cert = lookup("SMTP_TLS_CERT");
+    const char* smtp_tls_key = lookup("SMTP_TLS_KEY");
+    smtp_tls_cert_ = smtp_tls_cert ? smtp_tls_cert : "";
+    smtp_tls_key_ = smtp_tls_key ? smtp_tls_key : "";
+    smtp_require_tls_ = parseBool(lookup("SMTP_REQUIRE_TLS"));
+
+    // Optional LMTP listener on a Unix-domain socket
+    const char* lmtp_socket = lookup("LMTP_SOCKET");
+    lmtp_socket_ = lmtp_socket ? lmtp_socket : "";
+    const char* lmtp_socket_mode_str = lookup("LMTP_SOCKET_MODE");
+
+    // Listener and log I/O: epoll (boost::asio) or io_uring
+    const char* io_backend = lookup("IO_BACKEND");
+    if (io_backend && *io_backend) io_backend_ = io_backend;
+
+    // Optional recording of inbound sessions; relative to the config directory
+    const char* capture_file = lookup("CAPTURE_FILE");
+    const char* capture_max_mb_str = lookup("CAPTURE_MAX_MB");
+    capture_file_ = capture_file ? capture_file : "";
+    if (!capture_file_.empty() && capture_file_[0] != '/') {
+        capture_file_ = config_dir_ + "/" + capture_file_;
+    }
+
+    // Optional archive of received messages; relative to the config directory
+    const char* archive_dir = lookup("ARCHIVE_DIR");
+    const char* archive_segment_mb_str = lookup("ARCHIVE_SEGMENT_MB");
+    const char* archive_keep_days_str = lookup("ARCHIVE_KEEP_DAYS");
+    archive_dir_ = archive_dir ? archive_dir : "";
+    if (!archive_dir_.empty() && archive_dir_[0] != '/') {
+        archive_dir_ = config_dir_ + "/" + archive_dir_;
+    }
+
+    // Optional filter rules, compiled by ConfigStore; relative to the config directory
+    const char* rules_file = lookup("RULES_FILE");
+    const char* rules_body_bytes_str = lookup("RULES_BODY_BYTES");
+    rules_file_ = rules_file ? rules_file : "";
+    if (!rules_file_.empty() && rules_file_[0] != '/') {
+        rules_file_ = config_dir_ + "/" + rules_file_;
+    }
+
     try {
         smtp_port_ = std::stoi(port_str);
         log_keep_days_ = std::stoi(log_keep_days_str);
+        if (dedup_window_str && *dedup_window_str) dedup_window_ = std::stoi(dedup_window_str);
+        if (dedup_cache_size_str && *dedup_cache_size_str) dedup_cache_size_ = std::stoi(dedup_cache_size_str);
+        if (storm_window_str && *storm_window_str) storm_window_ = std::stoi(storm_window_str);
+        if (storm_edit_interval_str && *storm_edit_interval_str) storm_edit_interval_ = std::stoi(storm_edit_interval_str);
+        if (storm_max_groups_str && *storm_max_groups_str) storm_max_groups_ = std::stoi(storm_max_groups_str);
+        if (delivery_workers_str && *delivery_workers_str) delivery_workers_ = std::stoi(delivery_workers_str);
+        if (delivery_queue_size_str && *delivery_queue_size_str) delivery_queue_size_ = std::stoi(delivery_queue_size_str);
+        if (smtp_workers_str && *smtp_workers_str) smtp_workers_ = std::stoi(smtp_workers_str);
+        if (attachment_max_size_str && *attachment_max_size_str) attachment_max_size_ = std::stoi(attachment_max_size_str);
+        if (attachment_max_count_str && *attachment_max_count_str) attachment_max_count_ = std::stoi(attachment_max_count_str);
+        if (max_connections_str && *max_connections_str) max_connections_ = std::stoi(max_connections_str);
+        if (max_connections_per_ip_str && *max_connections_per_ip_str) max_connections_per_ip_ = std::stoi(max_connections_per_ip_str);
+        if (max_inflight_bytes_str && *max_inflight_bytes_str) max_inflight_bytes_ = std::stoi(max_inflight_bytes_str);
+        if (queue_high_watermark_str && *queue_high_watermark_str) queue_high_watermark_ = std::stoi(queue_high_watermark_str);
+        if (queue_low_watermark_str && *queue_low_watermark_str) queue_low_watermark_ = std::stoi(queue_low_watermark_str);
+        if (smtp_command_timeout_str && *smtp_command_timeout_str) smtp_command_timeout_ = std::stoi(smtp_command_timeout_str);
+        if (smtp_data_timeout_str && *smtp_data_timeout_str) smtp_data_timeout_ = std::stoi(smtp_data_timeout_str);
+        if (smtp_session_timeout_str && *smtp_session_timeout_str) smtp_session_timeout_ = std::stoi(smtp_session_timeout_str);
+        if (lmtp_socket_mode_str && *lmtp_socket_mode_str) lmtp_socket_mode_ = std::stoi(lmtp_socket_mode_str, nullptr, 8);
+        if (rules_body_bytes_str && *rules_body_bytes_str) rules_body_bytes_ = std::stoi(rules_body_bytes_str);
+        if (capture_max_mb_str && *capture_max_mb_str) capture_max_mb_ = std::stoi(capture_max_mb_str);
+        if (archive_segment_mb_str && *archive_segment_mb_str) archive_segment_mb_ = std::stoi(archive_segment_mb_str);
+        if (archive_keep_days_str && *archive_keep_days_str) archive_keep_days_ = std::stoi(archive_keep_days_str);
     } catch (const std::exception& e) {
         throw ConfigException("Invalid numeric configuration value: " + std::string(e.what()));
     }
 
+    if (!rules_file_.empty()) {
+        loadRulesFile();
+    }
+
     if (!validate()) {
         throw ConfigException("Configuration validation failed");
     }
@@ -116,6 +258,16 @@ void Config::createEnvFile() {
     }
 }
 
+void Config::loadRulesFile() {
+    std::ifstream rules_file(rules_file_, std::ios::binary);
+    if (!rules_file) {
+        throw ConfigException("Cannot read RULES_FILE " + rules_file_);
+    }
+    std::ostringstream contents;
+    contents << rules_file.rdbuf();
+    rules_ = contents.str();
+}
+
 void Config::loadEnvFile() {
     std::ifstream env_file(env_path_);
     std::string line;
@@ -134,11 +286,19 @@ void Config::loadEnvFile() {
             value.erase(0, value.find_first_not_of(" \t\r\n"));
             value.erase(value.find_last_not_of(" \t\r\n") + 1);
 
-            setenv(key.c_str(), value.c_str(), 1);
+            file_values_[key] = value;
         }
     }
 }
 
+const char* Config::lookup(const char* key) const {
+    auto it = file_values_.find(key);
+    if (it != file_values_.end()) {
+        return it->second.c_str();
+    }
+    return std::getenv(key);
+}
+
 void Config::setSecurePermissions() {
     // Ensure .env file has restricted permissions
     chmod(env_path_.c_str(), 0600);
@@ -155,6 +315,17 @@ bool Config::validate() const {
         return false;
     }
 
+    if (BotPool::splitTokens(api_key_).empty()) {
+        std::cerr << "Error: API_KEY must list bot tokens separated by commas\n";
+        return false;
+    }
+
+    BotScheduling scheduling;
+    if (!BotPool::parseScheduling(bot_scheduling_, scheduling)) {
+        std::cerr << "Error: BOT_SCHEDULING must be least-loaded or chat-hash\n";
+        return false;
+    }
+
     if (smtp_hostname_.empty()) {
         std::cerr << "Error: SMTP_HOSTNAME cannot be empty\n";
         return false;
@@ -170,6 +341,133 @@ bool Config::validate() const {
         return false;
     }
 
+    if (dedup_window_ < 0) {
+        std::cerr << "Error: DEDUP_WINDOW cannot be negative\n";
+        return false;
+    }
+
+    if (dedup_cache_size_ < 1) {
+        std::cerr << "Error: DEDUP_CACHE_SIZE must be at least 1\n";
+        return false;
+    }
+
+    if (storm_window_ < 0) {
+        std::cerr << "Error: STORM_WINDOW cannot be negative\n";
+        return false;
+    }
+
+    if (storm_edit_interval_ < 1 || storm_max_groups_ < 1) {
+        std::cerr << "Error: STORM_EDIT_INTERVAL and STORM_MAX_GROUPS must be at least 1\n";
+        return false;
+    }
+
+    if (delivery_workers_ < 1) {
+        std::cerr << "Error: DELIVERY_WORKERS must be at least 1\n";
+        return false;
+    }
+
+    if (delivery_queue_size_ < 1) {
+        std::cerr << "Error: DELIVERY_QUEUE_SIZE must be at least 1\n";
+        return false;
+    }
+
+    if (smtp_workers_ < 1) {
+        std::cerr << "Error: SMTP_WORKERS must be at least 1\n";
+        return false;
+    }
+
+    if (telegram_overflow_ != "truncate" && telegram_overflow_ != "split" &&
+        telegram_overflow_ != "document" && telegram_overflow_ != "eml") {
+        std::cerr << "Error: TELEGRAM_OVERFLOW must be truncate, split, document or eml\n";
+        return false;
+    }
+
+    if (message_format_ != "plain" && message_format_ != "markdownv2" && message_format_ != "html") {
+        std::cerr << "Error: MESSAGE_FORMAT must be plain, markdownv2 or html\n";
+        return false;
+    }
+
+    if (message_format_ != "plain" && message_template_.empty()) {
+        std::cerr << "Error: MESSAGE_FORMAT " << message_format_ << " needs a MESSAGE_TEMPLATE\n";
+        return false;
+    }
+
+    if (attachment_max_size_ < 1) {
+        std::cerr << "Error: ATTACHMENT_MAX_SIZE must be at least 1\n";
+        return false;
+    }
+
+    if (attachment_max_count_ < 0) {
+        std::cerr << "Error: ATTACHMENT_MAX_COUNT cannot be negative\n";
+        return false;
+    }
+
+    if (max_connections_ < 1 || max_connections_per_ip_ < 1) {
+        std::cerr << "Error: MAX_CONNECTIONS and MAX_CONNECTIONS_PER_IP must be at least 1\n";
+        return false;
+    }
+
+    if (max_inflight_bytes_ < 1) {
+        std::cerr << "Error: MAX_INFLIGHT_BYTES must be at least 1\n";
+        return false;
+    }
+
+    if (queue_high_watermark_ < 1 || queue_high_watermark_ > 100 ||
+        queue_low_watermark_ < 0 || queue_low_watermark_ > queue_high_watermark_) {
+        std::cerr << "Error: QUEUE_HIGH_WATERMARK must be 1-100 and QUEUE_LOW_WATERMARK at most that\n";
+        return false;
+    }
+
+    if (smtp_command_timeout_ < 1 || smtp_data_timeout_ < 1) {
+        std::cerr << "Error: SMTP_COMMAND_TIMEOUT and SMTP_DATA_TIMEOUT must be at least 1\n";
+        return false;
+    }
+
+    if (smtp_session_timeout_ < 0) {
+        std::cerr << "Error: SMTP_SESSION_TIMEOUT cannot be negative\n";
+        return false;
+    }
+
+    if (smtp_tls_cert_.empty() != smtp_tls_key_.empty()) {
+        std::cerr << "Error: SMTP_TLS_CERT and SMTP_TLS_KEY must be set together\n";
+        return false;
+    }
+
+    if (rules_body_bytes_ < 0) {
+        std::cerr << "Error: RULES_BODY_BYTES cannot be negative\n";
+        return false;
+    }
+
+    if (lmtp_socket_mode_ < 0 || lmtp_socket_mode_ > 0777) {
+        std::cerr << "Error: LMTP_SOCKET_MODE must be an octal file mode such as 0660\n";
+        return false;
+    }
+
+    if (capture_max_mb_ < 0) {
+        std::cerr << "Error: CAPTURE_MAX_MB cannot be negative\n";
+        return false;
+    }
+
+    if (archive_segment_mb_ <= 0) {
+        std::cerr << "Error: ARCHIVE_SEGMENT_MB must be positive\n";
+        return false;
+    }
+
+    if (archive_keep_days_ < 0) {
+        std::cerr << "Error: ARCHIVE_KEEP_DAYS cannot be negative\n";
+        return false;
+    }
+
+    if (io_backend_ != "epoll" && io_backend_ != "io_uring") {
+        std::cerr << "Error: IO_BACKEND must be epoll or io_uring\n";
+        return false;
+    }
+
+    if (smtp_require_tls_ && smtp_tls_cert_.empty()) {
+        std::cerr << "Error: SMTP_REQUIRE_TLS needs SMTP_TLS_CERT and SMTP_TLS_KEY\n";
+        return false;
+    }
+
     if (!validateChatId(chat_id_)) {
         std::cerr << "Warning: CHAT_ID format may be invalid\n";
     }
@@ -194,3 +492,9 @@ bool Config::validateChatId(const std::string& chat_id) const {
 
     return true;
 }
+
+bool Config::parseBool(const char* value) {
+    if (!value) return false;
+    std::string v(value);
+    return v == "1" || v == "true" || v == "yes" || v == "on";
+}
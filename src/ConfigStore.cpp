@@ -0,0 +1,222 @@
+// ConfigStore.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Configuration snapshot and reload implementation
+
+#include "../includes/ConfigStore.h"
+#include "../includes/Config.h"
+#include "../includes/Logger.h"
+#include "../includes/RecipientRouter.h"
+#include "../includes/PriorityRules.h"
+#include "../includes/DedupCache.h"
+#include "../includes/TelegramClient.h"
+#include "../includes/MessageTemplate.h"
+#include "../includes/RuleEngine.h"
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+ConfigStore::ConfigStore(std::shared_ptr<const Config> config, std::shared_ptr<Logger> logger)
+    : logger_(logger), version_(0), reload_requested_(false), watching_(false) {
+    snapshot_ = build(config, nullptr);
+}
+
+ConfigStore::~ConfigStore() {
+    stopWatching();
+}
+
+std::shared_ptr<const RuntimeConfig> ConfigStore::current() const {
+    // Each thread keeps its own reference and only goes to the shared
+    // pointer when a newer snapshot has been published
+    struct Cache {
+        const ConfigStore* owner = nullptr;
+        uint64_t version = 0;
+        std::shared_ptr<const RuntimeConfig> snapshot;
+    };
+    thread_local Cache cache;
+
+    uint64_t version = version_.load(std::memory_order_acquire);
+    if (cache.owner != this || cache.version != version || !cache.snapshot) {
+        cache.snapshot = std::atomic_load(&snapshot_);
+        cache.owner = this;
+        cache.version = version;
+    }
+    return cache.snapshot;
+}
+
+void ConfigStore::publish(std::shared_ptr<const RuntimeConfig> snapshot) {
+    std::atomic_store(&snapshot_, snapshot);
+    version_.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const RuntimeConfig> ConfigStore::build(std::shared_ptr<const Config> config,
+                                                        const RuntimeConfig* previous) const {
+    auto runtime = std::make_shared<RuntimeConfig>();
+    runtime->config = config;
+    BotScheduling scheduling = SCHEDULE_LEAST_LOADED;
+    BotPool::parseScheduling(config->getBotScheduling(), scheduling);
+    auto bots = std::make_shared<BotPool>(BotPool::splitTokens(config->getApiKey()), scheduling);
+    runtime->telegram = std::make_shared<TelegramClient>(bots, config->getChatId(), logger_);
+    runtime->telegram->setSplitLongMessages(config->getTelegramOverflow() == "split");
+    runtime->router = std::make_shared<RecipientRouter>(config->getRoutes(), config->getChatId());
+    runtime->priorities = std::make_shared<PriorityRules>(config->getPriorityRules());
+
+    if (!config->getMessageTemplate().empty()) {
+        MessageFormat format = FORMAT_PLAIN;
+        MessageTemplate::parseFormat(config->getMessageFormat(), format);
+        runtime->message_template = std::make_shared<MessageTemplate>(config->getMessageTemplate(), format);
+        runtime->telegram->setParseMode(runtime->message_template->parseMode());
+    }
+
+    if (!config->getRulesFile().empty()) {
+        runtime->rules = std::make_shared<RuleEngine>(config->getRules(),
+                                                      static_cast<size_t>(config->getRulesBodyBytes()));
+        logger_->info("Loaded " + std::to_string(runtime->rules->size()) + " filter rule(s) from " +
+                      config->getRulesFile());
+    }
+
+    if (bots->size() > 1) {
+        logger_->info("Delivering through " + std::to_string(bots->size()) + " bots (" +
+                      config->getBotScheduling() + ")");
+    }
+
+    if (runtime->router->size() > 0) {
+        logger_->info("Loaded " + std::to_string(runtime->router->size()) + " recipient route(s)");
+    }
+
+    if (config->getDedupWindow() > 0) {
+        const Config* old = previous ? previous->config.get() : nullptr;
+        bool unchanged = old && previous->dedup &&
+                         old->getDedupWindow() == config->getDedupWindow() &&
+                         old->getDedupCacheSize() == config->getDedupCacheSize() &&
+                         old->getDedupFields() == config->getDedupFields();
+
+        // Keep the remembered hashes across reloads unless the settings changed
+        if (unchanged) {
+            runtime->dedup = previous->dedup;
+        } else {
+            runtime->dedup = std::make_shared<DedupCache>(config->getDedupWindow(),
+                                                          config->getDedupCacheSize(),
+                                                          config->getDedupFields());
+            logger_->info("Duplicate suppression enabled (" +
+                          std::to_string(config->getDedupWindow()) + "s window)");
+        }
+    }
+
+    return runtime;
+}
+
+bool ConfigStore::reload() {
+    std::shared_ptr<const RuntimeConfig> previous = current();
+    std::shared_ptr<const RuntimeConfig> next;
+
+    try {
+        auto config = std::make_shared<Config>();
+        config->load(false);
+        next = build(config, previous.get());
+    } catch (const std::exception& e) {
+        logger_->error("Configuration reload failed, keeping current settings: " + std::string(e.what()));
+        return false;
+    }
+
+    const Config& old = *previous->config;
+    const Config& now = *next->config;
+
+    // Listener and queue sizing are fixed for the life of the process
+    if (old.getSmtpHostname() != now.getSmtpHostname() || old.getSmtpPort() != now.getSmtpPort() ||
+        old.getSmtpWorkers() != now.getSmtpWorkers() || old.getSmtpCpuPinning() != now.getSmtpCpuPinning() ||
+        old.getDeliveryWorkers() != now.getDeliveryWorkers() ||
+        old.getDeliveryQueueSize() != now.getDeliveryQueueSize() ||
+        old.getMaxConnections() != now.getMaxConnections() ||
+        old.getMaxConnectionsPerIp() != now.getMaxConnectionsPerIp() ||
+        old.getMaxInflightBytes() != now.getMaxInflightBytes() ||
+        old.getQueueHighWatermark() != now.getQueueHighWatermark() ||
+        old.getQueueLowWatermark() != now.getQueueLowWatermark() ||
+        old.getSmtpTlsCert() != now.getSmtpTlsCert() || old.getSmtpTlsKey() != now.getSmtpTlsKey() ||
+        old.getSmtpRequireTls() != now.getSmtpRequireTls() ||
+        old.getLmtpSocket() != now.getLmtpSocket() || old.getLmtpSocketMode() != now.getLmtpSocketMode() ||
+        old.getIoBackend() != now.getIoBackend() ||
+        old.getCaptureFile() != now.getCaptureFile() || old.getCaptureMaxMb() != now.getCaptureMaxMb() ||
+        old.getArchiveDir() != now.getArchiveDir() || old.getArchiveSegmentMb() != now.getArchiveSegmentMb() ||
+        old.getArchiveKeepDays() != now.getArchiveKeepDays() ||
+        old.getStormWindow() != now.getStormWindow() || old.getStormFields() != now.getStormFields() ||
+        old.getStormEditInterval() != now.getStormEditInterval() ||
+        old.getStormMaxGroups() != now.getStormMaxGroups()) {
+        logger_->warning("Listener, TLS, admission and delivery queue settings take effect after a hot restart (SIGUSR2)");
+    }
+
+    if (old.getLogKeepDays() != now.getLogKeepDays()) {
+        logger_->setKeepDays(now.getLogKeepDays());
+        logger_->rotateLogs();
+    }
+
+    publish(next);
+    logger_->info("Configuration reloaded");
+    return true;
+}
+
+void ConfigStore::startWatching() {
+    if (watching_.exchange(true)) return;
+    watcher_ = std::thread(&ConfigStore::watchLoop, this);
+}
+
+void ConfigStore::stopWatching() {
+    watching_ = false;
+    if (watcher_.joinable()) {
+        watcher_.join();
+    }
+}
+
+void ConfigStore::watchLoop() {
+    std::string env_path = current()->config->getEnvPath();
+    std::string dir = env_path.substr(0, env_path.rfind('/'));
+    std::string name = env_path.substr(env_path.rfind('/') + 1);
+
+    // A rules file next to .env is reloaded on change as well
+    std::string rules_path = current()->config->getRulesFile();
+    std::string rules_name;
+    if (rules_path.substr(0, rules_path.rfind('/')) == dir) {
+        rules_name = rules_path.substr(rules_path.rfind('/') + 1);
+    }
+
+    // Watch the directory: editors usually replace the file rather than write it
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        logger_->warning("Cannot watch " + env_path + " for changes; reload with SIGHUP");
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    while (watching_) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = fd >= 0 ? poll(&pfd, 1, 200) : poll(nullptr, 0, 200);
+
+        if (ready > 0) {
+            ssize_t len;
+            while ((len = read(fd, events, sizeof(events))) > 0) {
+                for (char* p = events; p < events + len; ) {
+                    auto* event = reinterpret_cast<struct inotify_event*>(p);
+                    if (event->len > 0 && (name == event->name || rules_name == event->name)) changed = true;
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            // Let a burst of writes settle before reading the file
+            if (changed) continue;
+        }
+
+        if (changed || reload_requested_.exchange(false)) {
+            changed = false;
+            reload();
+        }
+    }
+
+    if (fd >= 0) close(fd);
+}
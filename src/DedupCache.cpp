@@ -0,0 +1,185 @@
+// DedupCache.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Duplicate suppression implementation
+
+#include "../includes/DedupCache.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Config.h"
+#include <sstream>
+#include <cstring>
+
+namespace {
+
+// Streaming 64-bit hash that mixes 8 bytes at a time
+class Hasher {
+public:
+    Hasher() : state_(0x9E3779B97F4A7C15ULL), word_(0), filled_(0), length_(0) {}
+
+    void update(char c) {
+        word_ |= static_cast<uint64_t>(static_cast<unsigned char>(c)) << (filled_ * 8);
+        ++length_;
+        if (++filled_ == 8) {
+            mix(word_);
+            word_ = 0;
+            filled_ = 0;
+        }
+    }
+
+    void update(const std::string& data) {
+        const char* p = data.data();
+        size_t n = data.size();
+
+        // Top up a partial word, then consume whole words directly
+        while (n > 0 && filled_ != 0) {
+            update(*p++);
+            --n;
+        }
+        while (n >= 8) {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            mix(w);
+            p += 8;
+            n -= 8;
+            length_ += 8;
+        }
+        while (n > 0) {
+            update(*p++);
+            --n;
+        }
+    }
+
+    uint64_t finish() {
+        mix(word_ ^ (length_ << 56));
+        uint64_t h = state_;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    uint64_t state_;
+    uint64_t word_;
+    unsigned filled_;
+    uint64_t length_;
+
+    void mix(uint64_t w) {
+        w *= 0x87C37B91114253D5ULL;
+        w = (w << 31) | (w >> 33);
+        w *= 0x4CF5AD432745937FULL;
+        state_ ^= w;
+        state_ = ((state_ << 27) | (state_ >> 37)) * 5 + 0x52DCE729;
+    }
+};
+
+// Hash the body with whitespace runs collapsed, so re-wrapped or
+// trailing-space variations of the same alert still match
+void hashNormalizedBody(Hasher& hasher, const std::string& body) {
+    bool pending_space = false;
+    bool started = false;
+
+    for (char c : body) {
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            pending_space = started;
+            continue;
+        }
+        if (pending_space) {
+            hasher.update(' ');
+            pending_space = false;
+        }
+        hasher.update(c);
+        started = true;
+    }
+}
+
+size_t roundUpPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) result <<= 1;
+    return result;
+}
+
+} // namespace
+
+DedupCache::DedupCache(int window_seconds, size_t capacity, const std::string& fields)
+    : window_seconds_(window_seconds), use_subject_(false), use_from_(false),
+      use_to_(false), use_body_(false), suppressed_(0) {
+    std::istringstream stream(fields);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+        field.erase(0, field.find_first_not_of(" \t"));
+        field.erase(field.find_last_not_of(" \t") + 1);
+
+        if (field == "subject") use_subject_ = true;
+        else if (field == "from") use_from_ = true;
+        else if (field == "to") use_to_ = true;
+        else if (field == "body") use_body_ = true;
+        else if (!field.empty()) throw ConfigException("Unknown DEDUP_FIELDS entry: " + field);
+    }
+
+    if (!use_subject_ && !use_from_ && !use_to_ && !use_body_) {
+        throw ConfigException("DEDUP_FIELDS must name at least one of subject, from, to, body");
+    }
+
+    size_t sets = roundUpPowerOfTwo((capacity + WAYS - 1) / WAYS);
+    set_mask_ = sets - 1;
+    entries_.assign(sets * WAYS, Entry{0, 0});
+}
+
+uint64_t DedupCache::fingerprint(const ParsedEmail& email) const {
+    Hasher hasher;
+
+    // Field tags keep e.g. subject "a" + from "b" distinct from subject "ab"
+    if (use_subject_) { hasher.update('S'); hasher.update(email.subject); hasher.update('\0'); }
+    if (use_from_) { hasher.update('F'); hasher.update(email.from); hasher.update('\0'); }
+    if (use_to_) { hasher.update('T'); hasher.update(email.to); hasher.update('\0'); }
+    if (use_body_) { hasher.update('B'); hashNormalizedBody(hasher, email.body); }
+
+    uint64_t hash = hasher.finish();
+    return hash ? hash : 1; // 0 marks an empty slot
+}
+
+bool DedupCache::isDuplicate(uint64_t hash) {
+    std::time_t now = std::time(nullptr);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Entry* set = &entries_[(hash & set_mask_) * WAYS];
+    for (size_t i = 0; i < WAYS; ++i) {
+        if (set[i].hash == hash && now - set[i].first_seen < window_seconds_) {
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DedupCache::remember(uint64_t hash) {
+    std::time_t now = std::time(nullptr);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Entry* set = &entries_[(hash & set_mask_) * WAYS];
+    Entry* victim = &set[0];
+
+    for (size_t i = 0; i < WAYS; ++i) {
+        Entry& entry = set[i];
+        bool live = entry.hash != 0 && now - entry.first_seen < window_seconds_;
+
+        // A concurrent copy got here first; keep its time
+        if (live && entry.hash == hash) return;
+
+        // Prefer a free or expired slot, otherwise evict the oldest
+        if (!live) {
+            if (victim->hash != 0 && now - victim->first_seen < window_seconds_) victim = &entry;
+        } else if (victim->hash != 0 && now - victim->first_seen < window_seconds_ &&
+                   entry.first_seen < victim->first_seen) {
+            victim = &entry;
+        }
+    }
+
+    victim->hash = hash;
+    victim->first_seen = now;
+}
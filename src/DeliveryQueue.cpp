@@ -0,0 +1,429 @@
+// DeliveryQueue.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Prioritized delivery queue implementation
+
+#include "../includes/DeliveryQueue.h"
+#include "../includes/StormCollapser.h"
+#include "../includes/TelegramClient.h"
+#include "../includes/ConfigStore.h"
+#include "../includes/HotRestart.h"
+#include <algorithm>
+#include "../includes/Logger.h"
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+
+namespace {
+
+// Backlog hand-off records: priority byte, chat count, chat IDs, message,
+// document (empty name when the job has none), attachment count and
+// attachments; strings and counts are prefixed with a 32-bit length
+bool writeAll(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool readAll(int fd, void* data, size_t len) {
+    char* p = static_cast<char*>(data);
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool writeString(int fd, const std::string& value) {
+    uint32_t len = static_cast<uint32_t>(value.size());
+    return writeAll(fd, &len, sizeof(len)) && writeAll(fd, value.data(), value.size());
+}
+
+bool readString(int fd, std::string& value) {
+    uint32_t len = 0;
+    if (!readAll(fd, &len, sizeof(len))) return false;
+    value.resize(len);
+    return len == 0 || readAll(fd, &value[0], len);
+}
+
+// Files are written as stored (still encoded): name, type, base64 flag,
+// then their slice of the shared buffer
+bool writeFile(int fd, const TelegramFile& file) {
+    uint8_t base64 = file.base64 ? 1 : 0;
+    uint32_t len = file.buffer ? static_cast<uint32_t>(file.length) : 0;
+    return writeString(fd, file.filename) && writeString(fd, file.content_type) &&
+           writeAll(fd, &base64, 1) && writeAll(fd, &len, sizeof(len)) &&
+           (len == 0 || writeAll(fd, file.buffer->data() + file.offset, len));
+}
+
+bool readFile(int fd, TelegramFile& file) {
+    uint8_t base64 = 0;
+    auto buffer = std::make_shared<std::string>();
+    if (!readString(fd, file.filename) || !readString(fd, file.content_type) ||
+        !readAll(fd, &base64, 1) || !readString(fd, *buffer)) {
+        return false;
+    }
+    file.base64 = base64 != 0;
+    file.offset = 0;
+    file.length = buffer->size();
+    file.buffer.reset();
+    if (!file.filename.empty()) {
+        file.buffer = buffer;
+    }
+    return true;
+}
+
+bool writeJob(int fd, const DeliveryJob& job) {
+    uint8_t priority = static_cast<uint8_t>(job.priority);
+    uint32_t chats = static_cast<uint32_t>(job.chat_ids.size());
+    if (!writeAll(fd, &priority, 1) || !writeAll(fd, &chats, sizeof(chats))) return false;
+    for (const auto& chat_id : job.chat_ids) {
+        if (!writeString(fd, chat_id)) return false;
+    }
+    uint32_t attachments = static_cast<uint32_t>(job.attachments.size());
+    if (!writeString(fd, job.message) || !writeFile(fd, job.document) ||
+        !writeAll(fd, &attachments, sizeof(attachments))) {
+        return false;
+    }
+    for (const auto& attachment : job.attachments) {
+        if (!writeFile(fd, attachment)) return false;
+    }
+    return true;
+}
+
+bool readJob(int fd, DeliveryJob& job) {
+    uint8_t priority = 0;
+    uint32_t chats = 0;
+    if (!readAll(fd, &priority, 1) || !readAll(fd, &chats, sizeof(chats))) return false;
+    if (priority >= PRIORITY_LEVELS) return false;
+
+    job.priority = static_cast<MessagePriority>(priority);
+    job.chat_ids.assign(chats, std::string());
+    for (auto& chat_id : job.chat_ids) {
+        if (!readString(fd, chat_id)) return false;
+    }
+
+    uint32_t attachments = 0;
+    if (!readString(fd, job.message) || !readFile(fd, job.document) ||
+        !readAll(fd, &attachments, sizeof(attachments))) {
+        return false;
+    }
+    job.attachments.assign(attachments, TelegramFile());
+    for (auto& attachment : job.attachments) {
+        if (!readFile(fd, attachment)) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+DeliveryQueue::DeliveryQueue(std::shared_ptr<ConfigStore> config,
+                             std::shared_ptr<Logger> logger,
+                             size_t workers, size_t max_size)
+    : config_(config), logger_(logger), worker_count_(workers), max_size_(max_size),
+      queued_(0), normal_credit_(NORMAL_WEIGHT), stopping_(false), drain_(true),
+      reachable_(false) {
+}
+
+DeliveryQueue::~DeliveryQueue() {
+    stop();
+}
+
+bool DeliveryQueue::enqueue(DeliveryJob job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // High priority may exceed the limit so a full backlog never blocks a page
+        size_t limit = job.priority == PRIORITY_HIGH ? max_size_ + HIGH_PRIORITY_HEADROOM : max_size_;
+        if (stopping_ || queued_ >= limit) {
+            return false;
+        }
+        job.enqueued = std::chrono::steady_clock::now();
+        lanes_[job.priority].push_back(std::move(job));
+        ++queued_;
+    }
+    available_.notify_one();
+    return true;
+}
+
+void DeliveryQueue::start() {
+    for (size_t i = 0; i < worker_count_; ++i) {
+        workers_.emplace_back(&DeliveryQueue::workerLoop, this);
+    }
+    if (!health_thread_.joinable()) {
+        health_thread_ = std::thread(&DeliveryQueue::healthLoop, this);
+    }
+}
+
+bool DeliveryQueue::isTelegramReachable() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reachable_;
+}
+
+void DeliveryQueue::markUnreachable() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!reachable_) return;
+        reachable_ = false;
+    }
+    logger_->warning("Telegram unreachable, holding queued messages");
+    HotRestart::notifySystemd("STATUS=Waiting for Telegram API");
+    health_changed_.notify_all();
+}
+
+void DeliveryQueue::healthLoop() {
+    int interval = PROBE_MIN_SECONDS;
+    TelegramHealth last = TELEGRAM_OK;
+    bool first = true;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        if (reachable_) {
+            health_changed_.wait(lock, [this]() { return !reachable_ || stopping_; });
+            interval = PROBE_MIN_SECONDS;
+            continue;
+        }
+
+        lock.unlock();
+        std::string bot;
+        TelegramHealth health = config_->current()->telegram->checkHealth(bot);
+        lock.lock();
+
+        if (health == TELEGRAM_OK) {
+            reachable_ = true;
+            size_t waiting = queued_;
+            lock.unlock();
+            std::string msg = "Telegram API reachable as @" + bot;
+            if (waiting > 0) {
+                msg += ", delivering " + std::to_string(waiting) + " queued message(s)";
+            }
+            logger_->info(msg);
+            HotRestart::notifySystemd("STATUS=Telegram API reachable");
+            available_.notify_all();
+            lock.lock();
+            first = false;
+            continue;
+        }
+
+        // Log state changes only, not every probe
+        if (first || health != last) {
+            if (health == TELEGRAM_UNAUTHORIZED) {
+                logger_->error("Telegram rejected API_KEY; queuing messages until it is fixed");
+            } else {
+                logger_->warning("Telegram API unreachable; queuing messages and retrying");
+            }
+            first = false;
+        }
+        last = health;
+
+        health_changed_.wait_for(lock, std::chrono::seconds(interval), [this]() { return stopping_; });
+        interval = std::min(interval * 2, PROBE_MAX_SECONDS);
+    }
+}
+
+void DeliveryQueue::stop() {
+    if (handoff_thread_.joinable()) {
+        handoff_thread_.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ && workers_.empty()) return;
+        stopping_ = true;
+        drain_ = true;
+        if (queued_ > 0 && reachable_) {
+            logger_->info("Delivering " + std::to_string(queued_) + " queued message(s) before exit");
+        }
+    }
+    available_.notify_all();
+    joinWorkers();
+
+    if (queued_ > 0) {
+        logger_->error("Telegram unreachable, discarding " + std::to_string(queued_) + " queued message(s)");
+    }
+}
+
+void DeliveryQueue::joinWorkers() {
+    health_changed_.notify_all();
+    if (health_thread_.joinable()) {
+        health_thread_.join();
+    }
+
+    for (auto& worker : workers_) {
+        if (worker.joinable()) worker.join();
+    }
+    workers_.clear();
+}
+
+bool DeliveryQueue::handOff(int fd) {
+    if (handoff_thread_.joinable()) {
+        handoff_thread_.join();
+    }
+
+    // Let in-flight sends finish but leave the backlog queued
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        drain_ = false;
+    }
+    available_.notify_all();
+    joinWorkers();
+
+    size_t handed = 0;
+    bool ok = true;
+    for (int lane = 0; lane < PRIORITY_LEVELS && ok; ++lane) {
+        while (!lanes_[lane].empty()) {
+            DeliveryJob& job = lanes_[lane].front();
+            if (!writeJob(fd, job)) {
+                ok = false;
+                break;
+            }
+            // The successor posts it without a group; repeats counted here are gone
+            if (job.storm) {
+                job.storm->abandon(job.storm_key);
+            }
+            lanes_[lane].pop_front();
+            --queued_;
+            ++handed;
+        }
+    }
+    close(fd);
+
+    if (ok) {
+        logger_->info("Handed " + std::to_string(handed) + " queued message(s) to the new process");
+        return true;
+    }
+
+    // Deliver what is left here, the same as on a plain shutdown
+    size_t left;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = false;
+        drain_ = true;
+        left = queued_;
+    }
+    logger_->error("Backlog hand-off failed, " + std::to_string(left) + " message(s) stay with this process");
+    start();
+    stop();
+    return false;
+}
+
+void DeliveryQueue::receiveHandOff(int fd) {
+    handoff_thread_ = std::thread(&DeliveryQueue::readHandOff, this, fd);
+}
+
+void DeliveryQueue::readHandOff(int fd) {
+    size_t received = 0;
+    DeliveryJob job;
+
+    // The previous process writes once its sessions have drained; EOF ends the backlog
+    while (readJob(fd, job)) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job.enqueued = std::chrono::steady_clock::now();
+            lanes_[job.priority].push_back(std::move(job));
+            ++queued_;
+        }
+        available_.notify_one();
+        ++received;
+    }
+    close(fd);
+
+    if (received > 0) {
+        logger_->info("Received " + std::to_string(received) + " queued message(s) from the previous process");
+    }
+}
+
+size_t DeliveryQueue::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_;
+}
+
+bool DeliveryQueue::dequeue(DeliveryJob& job) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Messages stay queued until Telegram is known to be reachable
+    available_.wait(lock, [this]() { return (queued_ > 0 && reachable_) || stopping_; });
+
+    if (queued_ == 0) return false; // Stopping and drained
+    if (stopping_ && !drain_) return false; // Backlog is being handed off
+    if (stopping_ && !reachable_) return false; // Nothing can be delivered
+
+    std::deque<DeliveryJob>* lane = &lanes_[PRIORITY_HIGH];
+    if (lane->empty()) {
+        bool take_normal = !lanes_[PRIORITY_NORMAL].empty() &&
+                           (normal_credit_ > 0 || lanes_[PRIORITY_LOW].empty());
+        if (take_normal) {
+            lane = &lanes_[PRIORITY_NORMAL];
+            --normal_credit_;
+        } else {
+            lane = &lanes_[PRIORITY_LOW];
+            normal_credit_ = NORMAL_WEIGHT / LOW_WEIGHT;
+        }
+    }
+
+    job = std::move(lane->front());
+    lane->pop_front();
+    --queued_;
+    return true;
+}
+
+void DeliveryQueue::workerLoop() {
+    DeliveryJob job;
+    while (dequeue(job)) {
+        auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - job.enqueued);
+
+        // Jobs handed over from a previous process use the current settings
+        std::shared_ptr<TelegramClient> telegram = job.telegram ? job.telegram : config_->current()->telegram;
+        size_t rejected = 0;
+        std::vector<TelegramSent> sent;
+        size_t delivered = job.document.buffer
+            ? telegram->broadcastFile(job.chat_ids, job.document, job.message, &rejected)
+            : telegram->broadcastMessage(job.chat_ids, job.message, &rejected, job.storm ? &sent : nullptr);
+
+        // Attachments follow the message they belong to
+        if (delivered > 0) {
+            for (const auto& attachment : job.attachments) {
+                telegram->broadcastFile(job.chat_ids, attachment, attachment.filename);
+            }
+        }
+
+        bool retry = delivered == 0 && rejected < job.chat_ids.size() && job.attempts + 1 < MAX_DELIVERY_ROUNDS;
+        if (job.storm && !retry) {
+            job.storm->posted(job.storm_key, job.message, job.chat_ids, sent, telegram);
+        }
+
+        std::string summary = "(" + PriorityRules::name(job.priority) + " priority, queued " +
+                              std::to_string(waited.count()) + " ms)";
+        if (delivered == job.chat_ids.size()) {
+            logger_->info("Email forwarded to Telegram " + summary);
+        } else if (retry) {
+            // Nothing got through: keep the message and wait for Telegram to come back
+            ++job.attempts;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                MessagePriority priority = job.priority;
+                lanes_[priority].push_front(std::move(job));
+                ++queued_;
+            }
+            markUnreachable();
+        } else {
+            logger_->error("Email forwarded to " + std::to_string(delivered) + " of " +
+                           std::to_string(job.chat_ids.size()) + " chats " + summary +
+                           (rejected > 0 ? ", rejected by " + std::to_string(rejected) : ""));
+        }
+        job.telegram.reset();
+        job.storm.reset();
+        job.document = TelegramFile();
+        job.attachments.clear();
+    }
+}
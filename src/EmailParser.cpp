@@ -5,10 +5,100 @@
 // Email parsing implementation
 
 #include "../includes/EmailParser.h"
+#include "../includes/CharsetConverter.h"
 #include <sstream>
 #include <algorithm>
 #include <cctype>
 #include <vector>
+#include <cstring>
+#include <strings.h>
+
+namespace {
+
+// Value of a header, matching its name in any case
+std::string headerValue(const ParsedEmail& email, const std::string& name) {
+    for (const auto& header : email.headers) {
+        if (header.first.size() == name.size() &&
+            std::equal(name.begin(), name.end(), header.first.begin(), [](char a, char b) {
+                return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+            })) {
+            return header.second;
+        }
+    }
+    return "";
+}
+
+// Lowercase media type of a Content-Type value, without parameters
+std::string mediaType(const std::string& content_type) {
+    std::string type = content_type.substr(0, content_type.find(';'));
+    type.erase(type.find_last_not_of(" \t") + 1);
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    return type;
+}
+
+// Finds the delimiter lines of one multipart. Delimiters start a line, so
+// the scan hops from line break to line break with memchr (vectorized in
+// glibc) and compares "\n--boundary" only there; base64 and quoted-printable
+// bodies have a break every 76 bytes at most
+class DelimiterScanner {
+public:
+    explicit DelimiterScanner(const std::string& boundary) : pattern_("\n--" + boundary) {}
+
+    // Length of "--boundary"
+    size_t length() const { return pattern_.size() - 1; }
+
+    // Offset of the next "--boundary" that starts a line within
+    // [from, end), or npos; from itself counts as a line start when the
+    // byte before it is a line break
+    size_t find(const std::string& text, size_t from, size_t end) const {
+        const char* data = text.data();
+        const char* stop = data + end;
+        const char* p = data + (from > 0 && text[from - 1] == '\n' ? from - 1 : from);
+        while (static_cast<size_t>(stop - p) >= pattern_.size()) {
+            p = static_cast<const char*>(std::memchr(p, '\n', stop - p - pattern_.size() + 1));
+            if (!p) break;
+            if (std::memcmp(p + 1, pattern_.data() + 1, pattern_.size() - 1) == 0 &&
+                isDelimiterEnd(text, p - data + pattern_.size(), end)) {
+                return p - data + 1;
+            }
+            ++p;
+        }
+        return std::string::npos;
+    }
+
+private:
+    std::string pattern_;
+
+    // A boundary that is a prefix of a nested one must not match it
+    static bool isDelimiterEnd(const std::string& text, size_t pos, size_t end) {
+        if (pos >= end) return true;
+        char c = text[pos];
+        return c == '-' || c == '\r' || c == '\n' || c == ' ' || c == '\t';
+    }
+};
+
+// Start of the body of the part raw[start, end), just past the blank line
+// that ends its headers (which may be the first line), or npos
+size_t headerEnd(const std::string& raw, size_t start, size_t end) {
+    for (size_t line = start; line < end;) {
+        if (raw[line] == '\n') return line + 1;
+        if (raw[line] == '\r' && line + 1 < end && raw[line + 1] == '\n') return line + 2;
+
+        const void* lf = std::memchr(raw.data() + line, '\n', end - line);
+        if (!lf) break;
+        line = static_cast<const char*>(lf) - raw.data() + 1;
+    }
+    return std::string::npos;
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+} // namespace
 
 EmailParser::EmailParser() {
 }
@@ -86,8 +176,65 @@ std::string EmailParser::stripHtmlTags(const std::string& html) {
 }
 
 std::string EmailParser::decodeHeader(const std::string& header) {
-    // Simple implementation - can be enhanced for RFC 2047 encoded words
-    return header;
+    // RFC 2047 encoded words: =?charset?B|Q?text?=
+    if (header.find("=?") == std::string::npos) return header;
+
+    std::string result;
+    size_t pos = 0;
+    size_t last_word_end = std::string::npos;
+    while (pos < header.size()) {
+        size_t start = header.find("=?", pos);
+        if (start == std::string::npos) break;
+
+        size_t charset_end = header.find('?', start + 2);
+        size_t text_start = charset_end == std::string::npos ? charset_end : charset_end + 3;
+        size_t end = text_start >= header.size() ? std::string::npos : header.find("?=", text_start);
+        if (end == std::string::npos || header[charset_end + 2] != '?') {
+            break;
+        }
+
+        char encoding = static_cast<char>(std::toupper(static_cast<unsigned char>(header[charset_end + 1])));
+        if (encoding != 'B' && encoding != 'Q') {
+            result.append(header, pos, start + 2 - pos);
+            pos = start + 2;
+            continue;
+        }
+
+        // Whitespace between two adjacent encoded words is not displayed
+        bool only_space = header.find_first_not_of(" \t", pos) >= start;
+        if (!(only_space && last_word_end == pos)) {
+            result.append(header, pos, start - pos);
+        }
+
+        std::string charset = header.substr(start + 2, charset_end - start - 2);
+        std::string text = header.substr(text_start, end - text_start);
+        std::string decoded;
+        if (encoding == 'B') {
+            decoded = decodeBase64(text);
+        } else {
+            decoded.reserve(text.size());
+            for (size_t i = 0; i < text.size(); ++i) {
+                int high, low;
+                if (text[i] == '_') {
+                    decoded += ' ';
+                } else if (text[i] == '=' && i + 2 < text.size() &&
+                           (high = hexValue(text[i + 1])) >= 0 && (low = hexValue(text[i + 2])) >= 0) {
+                    decoded += static_cast<char>(high * 16 + low);
+                    i += 2;
+                } else {
+                    decoded += text[i];
+                }
+            }
+        }
+        CharsetConverter::toUtf8(charset, decoded);
+        result += decoded;
+
+        pos = end + 2;
+        last_word_end = pos;
+    }
+
+    result.append(header, pos, std::string::npos);
+    return result;
 }
 
 void EmailParser::parseHeaders(const std::string& header_section, ParsedEmail& email) {
@@ -96,6 +243,21 @@ void EmailParser::parseHeaders(const std::string& header_section, ParsedEmail& e
     std::string current_header;
     std::string current_value;
 
+    // Header names are matched in any case
+    auto store = [this, &email](const std::string& name, const std::string& value) {
+        email.headers[name] = value;
+
+        if (strcasecmp(name.c_str(), "Subject") == 0) {
+            email.subject = decodeHeader(value);
+        } else if (strcasecmp(name.c_str(), "From") == 0) {
+            email.from = decodeHeader(value);
+        } else if (strcasecmp(name.c_str(), "To") == 0) {
+            email.to = decodeHeader(value);
+        } else if (strcasecmp(name.c_str(), "Content-Type") == 0) {
+            email.content_type = value;
+        }
+    };
+
     while (std::getline(stream, line)) {
         if (!line.empty() && line.back() == '\r') {
             line.pop_back();
@@ -111,17 +273,7 @@ void EmailParser::parseHeaders(const std::string& header_section, ParsedEmail& e
 
         // Save previous header if exists
         if (!current_header.empty()) {
-            email.headers[current_header] = current_value;
-
-            if (current_header == "Subject") {
-                email.subject = decodeHeader(current_value);
-            } else if (current_header == "From") {
-                email.from = current_value;
-            } else if (current_header == "To") {
-                email.to = current_value;
-            } else if (current_header == "Content-Type") {
-                email.content_type = current_value;
-            }
+            store(current_header, current_value);
         }
 
         // Parse new header
@@ -140,25 +292,30 @@ void EmailParser::parseHeaders(const std::string& header_section, ParsedEmail& e
 
     // Save last header
     if (!current_header.empty()) {
-        email.headers[current_header] = current_value;
-
-        if (current_header == "Subject") {
-            email.subject = decodeHeader(current_value);
-        } else if (current_header == "From") {
-            email.from = current_value;
-        } else if (current_header == "To") {
-            email.to = current_value;
-        } else if (current_header == "Content-Type") {
-            email.content_type = current_value;
-        }
+        store(current_header, current_value);
     }
 }
 
+// Nested multiparts are followed this deep
+const int MAX_MULTIPART_DEPTH = 8;
+
 std::string EmailParser::extractBoundary(const std::string& content_type) {
-    size_t boundary_pos = content_type.find("boundary=");
-    if (boundary_pos == std::string::npos) return "";
+    return extractParameter(content_type, "boundary");
+}
+
+std::string EmailParser::extractParameter(const std::string& value, const std::string& name) {
+    // Names are case-insensitive and must start a parameter, so that
+    // "name" is not found inside "filename"
+    std::string lower = value;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t param_pos = lower.find(name + "=");
+    while (param_pos != std::string::npos && param_pos > 0 && lower[param_pos - 1] != ';' &&
+           lower[param_pos - 1] != ' ' && lower[param_pos - 1] != '\t') {
+        param_pos = lower.find(name + "=", param_pos + 1);
+    }
+    if (param_pos == std::string::npos) return "";
 
-    std::string boundary = content_type.substr(boundary_pos + 9);
+    std::string boundary = value.substr(param_pos + name.length() + 1);
 
     // Remove quotes if present
     if (!boundary.empty() && boundary[0] == '"') {
@@ -173,82 +330,116 @@ std::string EmailParser::extractBoundary(const std::string& content_type) {
         if (end != std::string::npos) {
             boundary = boundary.substr(0, end);
         }
+        boundary.erase(boundary.find_last_not_of(" \t") + 1);
     }
 
     return boundary;
 }
 
-std::string EmailParser::parseMultipart(const std::string& body, const std::string& boundary) {
-    if (boundary.empty()) return body;
-
-    std::string delimiter = "--" + boundary;
-    size_t pos = body.find(delimiter);
-    std::string text_content;
+void EmailParser::walkMultipart(const std::string& raw, size_t start, size_t end, const std::string& boundary,
+                                int depth, ParsedEmail& email, MimePart& plain, MimePart& html) {
+    DelimiterScanner scanner(boundary);
+    size_t pos = scanner.find(raw, start, end);
 
     while (pos != std::string::npos) {
-        size_t start = pos + delimiter.length();
-        size_t end = body.find(delimiter, start);
-
-        if (end == std::string::npos) break;
-
-        std::string part = body.substr(start, end - start);
-
-        // Check if this is a text part
-        if (part.find("Content-Type: text/plain") != std::string::npos) {
-            // Find the body of this part (after double newline)
-            size_t body_start = part.find("\n\n");
-            if (body_start == std::string::npos) {
-                body_start = part.find("\r\n\r\n");
-                if (body_start != std::string::npos) body_start += 4;
-            } else {
-                body_start += 2;
-            }
-
-            if (body_start != std::string::npos) {
-                text_content = part.substr(body_start);
-                break; // Found text/plain part
+        // Closing delimiter ends this multipart
+        if (raw.compare(pos + scanner.length(), 2, "--") == 0) break;
+
+        size_t part_start = raw.find('\n', pos + scanner.length());
+        if (part_start == std::string::npos || part_start >= end) break;
+        ++part_start;
+
+        size_t next = scanner.find(raw, part_start, end);
+        if (next == std::string::npos) break;
+
+        // The line break before a delimiter belongs to the delimiter
+        size_t part_end = next > part_start ? next - 1 : part_start;
+        if (part_end > part_start && raw[part_end - 1] == '\r') --part_end;
+
+        size_t body_start = headerEnd(raw, part_start, part_end);
+        if (body_start != std::string::npos) {
+            ParsedEmail part;
+            parseHeaders(raw.substr(part_start, body_start - part_start), part);
+
+            std::string type = mediaType(part.content_type);
+            std::string disposition = headerValue(part, "Content-Disposition");
+            std::string filename = extractParameter(disposition, "filename");
+            if (filename.empty()) filename = extractParameter(part.content_type, "name");
+
+            if (type.compare(0, 10, "multipart/") == 0) {
+                std::string nested = extractBoundary(part.content_type);
+                if (!nested.empty() && depth < MAX_MULTIPART_DEPTH) {
+                    walkMultipart(raw, body_start, part_end, nested, depth + 1, email, plain, html);
+                }
+            } else if (!filename.empty() || (!type.empty() && type.compare(0, 5, "text/") != 0)) {
+                std::string encoding = headerValue(part, "Content-Transfer-Encoding");
+                std::transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+
+                EmailAttachment attachment;
+                attachment.content_type = type.empty() ? "application/octet-stream" : type;
+                attachment.filename = filename;
+                attachment.base64 = encoding.find("base64") != std::string::npos;
+                attachment.offset = body_start;
+                attachment.length = part_end - body_start;
+                email.attachments.push_back(attachment);
+            } else if (strncasecmp(disposition.c_str(), "attachment", 10) != 0) {
+                // Inline text; a part without Content-Type is text/plain
+                MimePart* text = type.empty() || type == "text/plain" ? &plain
+                               : type == "text/html" ? &html : nullptr;
+                if (text && !text->found) {
+                    text->found = true;
+                    text->headers = std::move(part);
+                    text->offset = body_start;
+                    text->length = part_end - body_start;
+                }
             }
         }
 
-        pos = end;
+        pos = next;
     }
-
-    return text_content.empty() ? body : text_content;
 }
 
 ParsedEmail EmailParser::parse(const std::string& raw_data) {
     ParsedEmail email;
 
-    // Split headers and body
-    size_t header_end = raw_data.find("\n\n");
-    if (header_end == std::string::npos) {
-        header_end = raw_data.find("\r\n\r\n");
-        if (header_end != std::string::npos) {
-            header_end += 4;
-        }
-    } else {
-        header_end += 2;
-    }
+    // Split headers and body at the first blank line
+    size_t header_end = headerEnd(raw_data, 0, raw_data.size());
 
     if (header_end != std::string::npos) {
-        std::string headers = raw_data.substr(0, header_end);
-        std::string body = raw_data.substr(header_end);
-
-        parseHeaders(headers, email);
-
-        // Check if multipart
+        parseHeaders(raw_data.substr(0, header_end), email);
+
+        // A multipart body is the first inline text/plain part found
+        // anywhere in the tree, else the first text/html one; that part's
+        // own headers describe it
+        const ParsedEmail* text_headers = &email;
+        std::string body;
+        MimePart plain;
+        MimePart html;
         std::string boundary = extractBoundary(email.content_type);
         if (!boundary.empty()) {
-            body = parseMultipart(body, boundary);
+            walkMultipart(raw_data, header_end, raw_data.size(), boundary, 1, email, plain, html);
+
+            const MimePart& text = plain.found ? plain : html;
+            if (text.found) {
+                body.assign(raw_data, text.offset, text.length);
+                text_headers = &text.headers;
+            }
+        } else {
+            body = raw_data.substr(header_end);
         }
 
-        // Check for quoted-printable encoding
-        if (email.content_type.find("quoted-printable") != std::string::npos) {
+        // Undo the transfer encoding, then convert the charset to UTF-8
+        std::string encoding = headerValue(*text_headers, "Content-Transfer-Encoding");
+        std::transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+        if (encoding.find("quoted-printable") != std::string::npos ||
+            email.content_type.find("quoted-printable") != std::string::npos) {
             body = decodeQuotedPrintable(body);
+        } else if (encoding.find("base64") != std::string::npos) {
+            body = decodeBase64(body);
         }
+        CharsetConverter::toUtf8(extractParameter(text_headers->content_type, "charset"), body);
 
-        // Check for HTML content
-        if (email.content_type.find("text/html") != std::string::npos) {
+        if (mediaType(text_headers->content_type) == "text/html") {
             body = stripHtmlTags(body);
         }
 
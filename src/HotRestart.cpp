@@ -0,0 +1,287 @@
+// HotRestart.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Hot restart implementation
+
+#include "../includes/HotRestart.h"
+#include "../includes/Logger.h"
+#include <cstdlib>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+// First fd passed by the LISTEN_FDS protocol
+const int LISTEN_FDS_START = 3;
+
+// Environment variable naming the backlog pipe fd
+const char* const BACKLOG_FD_ENV = "SMTP2TELEGRAM_BACKLOG_FD";
+
+// Environment variable naming the fd the successor reports readiness on
+const char* const READY_FD_ENV = "SMTP2TELEGRAM_READY_FD";
+
+// Seconds the successor gets to open its listeners before it is given up
+const int SUCCESSOR_READY_TIMEOUT = 30;
+
+namespace {
+
+// Async-signal-safe decimal formatting for use between fork() and exec()
+void formatNumber(char* out, long value) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (n > 0) *out++ = digits[--n];
+    *out = '\0';
+}
+
+std::string executablePath() {
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) return "";
+    std::string result(path, len);
+
+    // After a package upgrade the running image is unlinked; exec the new file
+    const std::string deleted = " (deleted)";
+    if (result.size() > deleted.size() &&
+        result.compare(result.size() - deleted.size(), deleted.size(), deleted) == 0) {
+        result.erase(result.size() - deleted.size());
+    }
+    return result;
+}
+
+std::string exitStatus(int status) {
+    if (WIFEXITED(status)) return "exit status " + std::to_string(WEXITSTATUS(status));
+    if (WIFSIGNALED(status)) return "signal " + std::to_string(WTERMSIG(status));
+    return "status " + std::to_string(status);
+}
+
+// Wait for the successor's ready byte; a successor that exits first or
+// misses the deadline is reaped and the restart abandoned
+bool awaitSuccessor(int fd, pid_t pid, std::shared_ptr<Logger> logger) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SUCCESSOR_READY_TIMEOUT);
+    ssize_t n = -1;
+    for (;;) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) break;
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, static_cast<int>(left));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready > 0) {
+            char byte;
+            do {
+                n = read(fd, &byte, 1);
+            } while (n < 0 && errno == EINTR);
+        }
+        break;
+    }
+    close(fd);
+    if (n == 1) return true;
+
+    int status = 0;
+    if (n < 0) {
+        logger->error("Hot restart failed: successor process " + std::to_string(pid) + " not ready after " +
+                      std::to_string(SUCCESSOR_READY_TIMEOUT) + "s, stopping it");
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+    } else if (waitpid(pid, &status, 0) == pid) {
+        logger->error("Hot restart failed: successor process " + std::to_string(pid) +
+                      " exited before listening (" + exitStatus(status) + ")");
+    } else {
+        logger->error("Hot restart failed: successor process " + std::to_string(pid) + " exited before listening");
+    }
+    return false;
+}
+
+} // namespace
+
+std::vector<int> HotRestart::inheritedListeners() {
+    std::vector<int> fds;
+
+    const char* pid_str = std::getenv("LISTEN_PID");
+    const char* count_str = std::getenv("LISTEN_FDS");
+    if (!pid_str || !count_str) return fds;
+
+    // The variables are only meant for the process they were set for
+    if (std::atol(pid_str) != static_cast<long>(getpid())) return fds;
+
+    int count = std::atoi(count_str);
+    for (int i = 0; i < count; ++i) {
+        int fd = LISTEN_FDS_START + i;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds.push_back(fd);
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+int HotRestart::inheritedBacklogFd() {
+    const char* fd_str = std::getenv(BACKLOG_FD_ENV);
+    if (!fd_str) return -1;
+
+    int fd = std::atoi(fd_str);
+    unsetenv(BACKLOG_FD_ENV);
+    if (fcntl(fd, F_GETFD) == -1) return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+void HotRestart::notifyPredecessor() {
+    const char* fd_str = std::getenv(READY_FD_ENV);
+    if (!fd_str) return;
+
+    int fd = std::atoi(fd_str);
+    unsetenv(READY_FD_ENV);
+    if (fcntl(fd, F_GETFD) == -1) return;
+
+    // The predecessor may have given up on us already; nothing to do then
+    char ready = 1;
+    ssize_t ignored = write(fd, &ready, 1);
+    (void)ignored;
+    close(fd);
+}
+
+int HotRestart::spawnSuccessor(const std::vector<int>& listeners, std::shared_ptr<Logger> logger) {
+    std::string exe = executablePath();
+    if (exe.empty() || access(exe.c_str(), X_OK) != 0) {
+        logger->error("Hot restart failed: cannot locate executable");
+        return -1;
+    }
+
+    int backlog_pipe[2];
+    if (pipe2(backlog_pipe, O_CLOEXEC) != 0) {
+        logger->error("Hot restart failed: pipe: " + std::string(strerror(errno)));
+        return -1;
+    }
+
+    int ready_pipe[2];
+    if (pipe2(ready_pipe, O_CLOEXEC) != 0) {
+        logger->error("Hot restart failed: pipe: " + std::string(strerror(errno)));
+        close(backlog_pipe[0]);
+        close(backlog_pipe[1]);
+        return -1;
+    }
+
+    // Everything the child needs is prepared here: only async-signal-safe
+    // calls are allowed between fork() and exec() in a threaded process
+    int count = static_cast<int>(listeners.size());
+    int backlog_target = LISTEN_FDS_START + count;
+    int ready_target = backlog_target + 1;
+
+    std::string listen_fds = "LISTEN_FDS=" + std::to_string(count);
+    std::string backlog_env = std::string(BACKLOG_FD_ENV) + "=" + std::to_string(backlog_target);
+    std::string ready_env = std::string(READY_FD_ENV) + "=" + std::to_string(ready_target);
+    char listen_pid[32] = "LISTEN_PID=";
+
+    std::vector<char*> envp;
+    for (char** env = environ; *env; ++env) {
+        if (strncmp(*env, "LISTEN_", 7) == 0 || strncmp(*env, BACKLOG_FD_ENV, strlen(BACKLOG_FD_ENV)) == 0 ||
+            strncmp(*env, READY_FD_ENV, strlen(READY_FD_ENV)) == 0) {
+            continue;
+        }
+        envp.push_back(*env);
+    }
+    envp.push_back(&listen_fds[0]);
+    envp.push_back(&backlog_env[0]);
+    envp.push_back(&ready_env[0]);
+    envp.push_back(listen_pid);
+    envp.push_back(nullptr);
+
+    char* argv[] = { &exe[0], nullptr };
+
+    struct rlimit limit;
+    int max_fd = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        max_fd = static_cast<int>(limit.rlim_cur);
+    }
+
+    std::vector<int> moved(count + 2);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        logger->error("Hot restart failed: fork: " + std::string(strerror(errno)));
+        close(backlog_pipe[0]);
+        close(backlog_pipe[1]);
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Move the inherited fds out of the way, then into place from fd 3
+        int total = count + 2;
+        for (int i = 0; i < total; ++i) {
+            int source = i < count ? listeners[i] : i == count ? backlog_pipe[0] : ready_pipe[1];
+            moved[i] = fcntl(source, F_DUPFD, LISTEN_FDS_START + total);
+        }
+        for (int i = 0; i < total; ++i) {
+            dup2(moved[i], LISTEN_FDS_START + i);
+        }
+
+        // Do not leak client sessions or other descriptors into the new process
+        for (int fd = LISTEN_FDS_START + total; fd < max_fd; ++fd) {
+            close(fd);
+        }
+
+        formatNumber(listen_pid + strlen("LISTEN_PID="), static_cast<long>(getpid()));
+        execve(argv[0], argv, envp.data());
+        _exit(127);
+    }
+
+    close(backlog_pipe[0]);
+    close(ready_pipe[1]);
+    logger->info("Hot restart: started successor process " + std::to_string(pid));
+
+    // Keep serving unless the successor is actually accepting
+    if (!awaitSuccessor(ready_pipe[0], pid, logger)) {
+        close(backlog_pipe[1]);
+        return -1;
+    }
+
+    // Let systemd follow the new process as the service's main PID
+    notifySystemd("MAINPID=" + std::to_string(pid));
+
+    return backlog_pipe[1];
+}
+
+void HotRestart::notifySystemd(const std::string& state) {
+    const char* socket_path = std::getenv("NOTIFY_SOCKET");
+    if (!socket_path || !*socket_path) return;
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t path_len = std::min(strlen(socket_path), sizeof(addr.sun_path) - 1);
+    std::memcpy(addr.sun_path, socket_path, path_len);
+
+    // Abstract namespace sockets are given with a leading '@'
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = '\0';
+
+    sendto(fd, state.data(), state.size(), MSG_NOSIGNAL,
+           reinterpret_cast<struct sockaddr*>(&addr),
+           static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path_len));
+    close(fd);
+}
@@ -0,0 +1,199 @@
+// IoUring.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// io_uring setup, submission and completion without liburing
+
+#include "../includes/IoUring.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#ifdef SMTP2TELEGRAM_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace {
+
+int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// The rings are shared with the kernel: read what it writes with acquire,
+// publish what we write with release
+unsigned loadAcquire(const unsigned* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void storeRelease(unsigned* p, unsigned value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+T* at(void* base, unsigned offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+} // namespace
+
+IoUring::IoUring(unsigned entries)
+    : fd_(-1), pending_(0), sq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_(MAP_FAILED),
+      cq_ring_size_(0), sqes_(MAP_FAILED), sqes_size_(0) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    int fd = ioUringSetup(entries, &params);
+    if (fd < 0) {
+        error_ = std::string("io_uring_setup failed: ") + std::strerror(errno);
+        return;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP both rings live in one mapping
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    cq_ring_ = single ? sq_ring_
+                      : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+        error_ = std::string("io_uring mmap failed: ") + std::strerror(errno);
+        close(fd);
+        return;
+    }
+
+    sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = *at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = at<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = *at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = at<void>(cq_ring_, params.cq_off.cqes);
+    fd_ = fd;
+}
+
+IoUring::~IoUring() {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0) close(fd_);
+}
+
+bool IoUring::registerBuffer(void* data, size_t length) {
+    struct iovec buffer = { data, length };
+    return ioUringRegister(fd_, IORING_REGISTER_BUFFERS, &buffer, 1) == 0;
+}
+
+bool IoUring::registerEventFd(int event_fd) {
+    return ioUringRegister(fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) == 0;
+}
+
+void* IoUring::nextEntry() {
+    unsigned tail = *sq_tail_ + pending_;
+    if (tail - loadAcquire(sq_head_) > sq_mask_) return nullptr;
+
+    struct io_uring_sqe* sqe = &static_cast<struct io_uring_sqe*>(sqes_)[tail & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[tail & sq_mask_] = tail & sq_mask_;
+    ++pending_;
+    return sqe;
+}
+
+bool IoUring::prepareWriteFixed(int fd, const void* data, unsigned length, uint64_t user_data) {
+    auto* sqe = static_cast<struct io_uring_sqe*>(nextEntry());
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = length;
+    sqe->off = static_cast<uint64_t>(-1);  // current position; O_APPEND files append
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool IoUring::prepareMultishotAccept(int listen_fd, uint64_t user_data) {
+    auto* sqe = static_cast<struct io_uring_sqe*>(nextEntry());
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool IoUring::prepareCancel(uint64_t target, uint64_t user_data) {
+    auto* sqe = static_cast<struct io_uring_sqe*>(nextEntry());
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    return true;
+}
+
+int IoUring::submit(unsigned wait_for) {
+    storeRelease(sq_tail_, *sq_tail_ + pending_);
+    unsigned count = pending_;
+    pending_ = 0;
+
+    int result;
+    do {
+        result = ioUringEnter(fd_, count, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (result < 0 && errno == EINTR);
+    return result < 0 ? -errno : result;
+}
+
+bool IoUring::popCompletion(IoCompletion& completion) {
+    unsigned head = *cq_head_;
+    if (head == loadAcquire(cq_tail_)) return false;
+
+    const struct io_uring_cqe& cqe = static_cast<const struct io_uring_cqe*>(cqes_)[head & cq_mask_];
+    completion.user_data = cqe.user_data;
+    completion.result = cqe.res;
+    completion.more = cqe.flags & IORING_CQE_F_MORE;
+    storeRelease(cq_head_, head + 1);
+    return true;
+}
+
+#else // !SMTP2TELEGRAM_IO_URING
+
+IoUring::IoUring(unsigned)
+    : fd_(-1), error_("built without io_uring support"), pending_(0), sq_ring_(nullptr), sq_ring_size_(0),
+      cq_ring_(nullptr), cq_ring_size_(0), sqes_(nullptr), sqes_size_(0) {
+}
+
+IoUring::~IoUring() {
+}
+
+bool IoUring::registerBuffer(void*, size_t) { return false; }
+bool IoUring::registerEventFd(int) { return false; }
+bool IoUring::prepareWriteFixed(int, const void*, unsigned, uint64_t) { return false; }
+bool IoUring::prepareMultishotAccept(int, uint64_t) { return false; }
+bool IoUring::prepareCancel(uint64_t, uint64_t) { return false; }
+int IoUring::submit(unsigned) { return -ENOSYS; }
+bool IoUring::popCompletion(IoCompletion&) { return false; }
+void* IoUring::nextEntry() { return nullptr; }
+
+#endif // SMTP2TELEGRAM_IO_URING
@@ -5,17 +5,66 @@
 // Thread-safe logging implementation
 
 #include "../includes/Logger.h"
+#include "../includes/IoUring.h"
 #include <iostream>
 #include <iomanip>
 #include <sstream>
-#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
 #include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Lines written per io_uring submission at most; a busier log just takes
+// several rounds
+const size_t LOG_RING_BUFFER_SIZE = 256 * 1024;
+const unsigned LOG_RING_ENTRIES = 8;
 
 Logger::Logger(const std::string& log_path, int keep_days)
-    : log_path_(log_path), keep_days_(keep_days) {
+    : log_path_(log_path), keep_days_(keep_days), fd_(-1), writing_(false), stopping_(false) {
+    openLogFile();
 }
 
 Logger::~Logger() {
+    if (writer_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(log_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+    }
+    if (fd_ >= 0) close(fd_);
+}
+
+void Logger::openLogFile() {
+    fd_ = open(log_path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+bool Logger::useIoUring(std::string& error) {
+    std::lock_guard<std::mutex> lock(log_mutex_);
+    if (ring_) return true;
+    if (fd_ < 0) openLogFile();
+    if (fd_ < 0) {
+        error = "cannot open " + log_path_ + ": " + std::strerror(errno);
+        return false;
+    }
+
+    std::unique_ptr<IoUring> ring(new IoUring(LOG_RING_ENTRIES));
+    if (!ring->isAvailable()) {
+        error = ring->error();
+        return false;
+    }
+    ring_buffer_.resize(LOG_RING_BUFFER_SIZE);
+    if (!ring->registerBuffer(ring_buffer_.data(), ring_buffer_.size())) {
+        error = std::string("cannot register log buffer: ") + std::strerror(errno);
+        return false;
+    }
+
+    ring_ = std::move(ring);
+    writer_ = std::thread(&Logger::writerLoop, this);
+    return true;
 }
 
 std::string Logger::getTimestamp() const {
@@ -48,18 +97,75 @@ void Logger::writeLog(const std::string& level, const std::string& message) {
     std::string log_entry = timestamp + " [" + level + "] - " + message;
 
     // Write to file
-    std::ofstream log_file(log_path_, std::ios_base::app);
-    if (log_file) {
-        log_file << log_entry << std::endl;
-        log_file.close();
+    if (ring_) {
+        pending_ += log_entry;
+        pending_ += '\n';
+        wake_.notify_one();
+    } else {
+        if (fd_ < 0) openLogFile();
+        std::string line = log_entry + "\n";
+        writeAll(line.data(), line.size());
     }
 
     // Also print to console
     std::cout << log_entry << std::endl;
 }
 
-void Logger::rotateLogs() {
+void Logger::writeAll(const char* data, size_t length) {
+    while (length > 0 && fd_ >= 0) {
+        ssize_t written = write(fd_, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+void Logger::writerLoop() {
+    std::unique_lock<std::mutex> lock(log_mutex_);
+    for (;;) {
+        wake_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) return;
+
+        // Everything logged since the last round goes out in one write
+        size_t length = std::min(pending_.size(), ring_buffer_.size());
+        std::memcpy(ring_buffer_.data(), pending_.data(), length);
+        pending_.erase(0, length);
+        writing_ = true;
+
+        lock.unlock();
+        flushRing(length);
+        lock.lock();
+
+        writing_ = false;
+        idle_.notify_all();
+    }
+}
+
+void Logger::flushRing(size_t length) {
+    size_t offset = 0;
+    while (offset < length) {
+        IoCompletion completion;
+        if (!ring_->prepareWriteFixed(fd_, ring_buffer_.data() + offset,
+                                      static_cast<unsigned>(length - offset), 0) ||
+            ring_->submit(1) < 0 || !ring_->popCompletion(completion) || completion.result <= 0) {
+            writeAll(ring_buffer_.data() + offset, length - offset);
+            return;
+        }
+        offset += static_cast<size_t>(completion.result);
+    }
+}
+
+void Logger::setKeepDays(int keep_days) {
     std::lock_guard<std::mutex> lock(log_mutex_);
+    keep_days_ = keep_days;
+}
+
+void Logger::rotateLogs() {
+    std::unique_lock<std::mutex> lock(log_mutex_);
+    idle_.wait(lock, [this]() { return pending_.empty() && !writing_; });
 
     std::vector<std::string> lines;
     std::ifstream log_file_in(log_path_);
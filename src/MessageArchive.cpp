@@ -0,0 +1,278 @@
+// MessageArchive.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Archive writer thread and index/segment reading
+
+#include "../includes/MessageArchive.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Logger.h"
+#include "../includes/Config.h"
+#include <zlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Raw bytes waiting for the writer at most; beyond that messages are not
+// archived rather than holding up SMTP sessions
+const size_t MAX_ARCHIVE_BACKLOG = 64 * 1024 * 1024;
+
+const char SEGMENT_SUFFIX[] = ".z";
+const char INDEX_SUFFIX[] = ".idx";
+
+namespace {
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Index fields cannot contain the separators
+std::string indexField(const std::string& value) {
+    std::string field = value;
+    std::replace_if(field.begin(), field.end(), [](char c) { return c == '\t' || c == '\r' || c == '\n'; }, ' ');
+    return field;
+}
+
+bool writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+std::string headerValue(const ParsedEmail& email, const char* name) {
+    for (const auto& header : email.headers) {
+        if (strcasecmp(header.first.c_str(), name) == 0) return header.second;
+    }
+    return "";
+}
+
+std::vector<std::string> listFiles(const std::string& dir, const char* suffix) {
+    std::vector<std::string> names;
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return names;
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 8, "segment-") == 0 && endsWith(name, suffix)) {
+            names.push_back(name);
+        }
+    }
+    closedir(handle);
+    std::sort(names.begin(), names.end());  // names start with the creation time
+    return names;
+}
+
+} // namespace
+
+MessageArchive::MessageArchive(const std::string& dir, uint64_t segment_bytes, int keep_days,
+                               std::shared_ptr<Logger> logger)
+    : dir_(dir), segment_bytes_(segment_bytes), keep_days_(keep_days), logger_(logger),
+      pending_bytes_(0), stopping_(false), segment_fd_(-1), index_fd_(-1), segment_size_(0),
+      segment_sequence_(0) {
+    struct stat st;
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw ConfigException("Cannot create archive directory " + dir + ": " + std::strerror(errno));
+    }
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        throw ConfigException("ARCHIVE_DIR " + dir + " is not a directory");
+    }
+
+    writer_ = std::thread(&MessageArchive::writerLoop, this);
+}
+
+MessageArchive::~MessageArchive() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    closeSegment();
+}
+
+bool MessageArchive::add(std::shared_ptr<const std::string> raw, const ParsedEmail& email) {
+    Pending message;
+    message.time = std::time(nullptr);
+    message.message_id = headerValue(email, "Message-ID");
+    message.from = email.from;
+    message.subject = email.subject;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_bytes_ + raw->size() > MAX_ARCHIVE_BACKLOG) {
+        return false;
+    }
+    pending_bytes_ += raw->size();
+    message.raw = std::move(raw);
+    pending_.push_back(std::move(message));
+    wake_.notify_one();
+    return true;
+}
+
+void MessageArchive::writerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        wake_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) return;
+
+        Pending message = std::move(pending_.front());
+        pending_.pop_front();
+
+        lock.unlock();
+        write(message);
+        lock.lock();
+        pending_bytes_ -= message.raw->size();
+    }
+}
+
+void MessageArchive::write(const Pending& message) {
+    const std::string& raw = *message.raw;
+    uLongf compressed_length = compressBound(raw.size());
+    std::vector<Bytef> compressed(compressed_length);
+    if (compress2(compressed.data(), &compressed_length, reinterpret_cast<const Bytef*>(raw.data()),
+                  raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        logger_->error("Archive: failed to compress message");
+        return;
+    }
+
+    if (segment_fd_ >= 0 && segment_size_ > 0 && segment_size_ + compressed_length > segment_bytes_) {
+        closeSegment();
+    }
+    if (segment_fd_ < 0 && !openSegment()) {
+        return;
+    }
+
+    // The index line goes after the data, so every indexed message is complete
+    std::ostringstream line;
+    line << message.time << '\t' << segment_size_ << '\t' << compressed_length << '\t' << raw.size() << '\t'
+         << indexField(message.message_id) << '\t' << indexField(message.from) << '\t'
+         << indexField(message.subject) << '\n';
+    std::string entry = line.str();
+
+    if (!writeAll(segment_fd_, reinterpret_cast<const char*>(compressed.data()), compressed_length) ||
+        !writeAll(index_fd_, entry.data(), entry.size())) {
+        logger_->error("Archive: failed to write " + segment_name_ + ": " + std::strerror(errno));
+        closeSegment();
+        return;
+    }
+    segment_size_ += compressed_length;
+}
+
+bool MessageArchive::openSegment() {
+    removeExpired();
+
+    // Named by creation time, then process and sequence, so a hot-restart
+    // successor never shares a segment with its predecessor
+    char stamp[32];
+    std::time_t now = std::time(nullptr);
+    struct tm local;
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+    segment_name_ = std::string("segment-") + stamp + "-" + std::to_string(getpid()) + "-" +
+                    std::to_string(segment_sequence_++);
+
+    std::string base = dir_ + "/" + segment_name_;
+    segment_fd_ = ::open((base + SEGMENT_SUFFIX).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    index_fd_ = ::open((base + INDEX_SUFFIX).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (segment_fd_ < 0 || index_fd_ < 0) {
+        logger_->error("Archive: cannot create " + base + ": " + std::strerror(errno));
+        closeSegment();
+        return false;
+    }
+    segment_size_ = 0;
+    return true;
+}
+
+void MessageArchive::closeSegment() {
+    if (segment_fd_ >= 0) ::close(segment_fd_);
+    if (index_fd_ >= 0) ::close(index_fd_);
+    segment_fd_ = -1;
+    index_fd_ = -1;
+}
+
+void MessageArchive::removeExpired() {
+    if (keep_days_ <= 0) return;
+
+    std::time_t cutoff = std::time(nullptr) - static_cast<std::time_t>(keep_days_) * 24 * 60 * 60;
+    for (const auto& name : listFiles(dir_, SEGMENT_SUFFIX)) {
+        std::string base = dir_ + "/" + name.substr(0, name.size() - (sizeof(SEGMENT_SUFFIX) - 1));
+        struct stat st;
+        if (stat((base + SEGMENT_SUFFIX).c_str(), &st) == 0 && st.st_mtime < cutoff) {
+            unlink((base + SEGMENT_SUFFIX).c_str());
+            unlink((base + INDEX_SUFFIX).c_str());
+        }
+    }
+}
+
+std::vector<ArchiveEntry> MessageArchive::readIndex(const std::string& dir) {
+    std::vector<ArchiveEntry> entries;
+    for (const auto& name : listFiles(dir, INDEX_SUFFIX)) {
+        std::ifstream index(dir + "/" + name);
+        std::string segment = name.substr(0, name.size() - (sizeof(INDEX_SUFFIX) - 1)) + SEGMENT_SUFFIX;
+        std::string line;
+        while (std::getline(index, line)) {
+            std::vector<std::string> fields;
+            size_t start = 0;
+            for (int i = 0; i < 6; ++i) {
+                size_t tab = line.find('\t', start);
+                if (tab == std::string::npos) break;
+                fields.push_back(line.substr(start, tab - start));
+                start = tab + 1;
+            }
+            if (fields.size() != 6) continue;  // torn last line
+            fields.push_back(line.substr(start));
+
+            ArchiveEntry entry;
+            try {
+                entry.time = static_cast<std::time_t>(std::stoll(fields[0]));
+                entry.offset = std::stoull(fields[1]);
+                entry.compressed = std::stoull(fields[2]);
+                entry.length = std::stoull(fields[3]);
+            } catch (const std::exception&) {
+                continue;
+            }
+            entry.segment = segment;
+            entry.message_id = fields[4];
+            entry.from = fields[5];
+            entry.subject = fields[6];
+            entries.push_back(std::move(entry));
+        }
+    }
+    return entries;
+}
+
+std::string MessageArchive::readMessage(const std::string& dir, const ArchiveEntry& entry) {
+    std::string path = dir + "/" + entry.segment;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+    }
+
+    // Only this message's frame is read and inflated
+    std::vector<Bytef> compressed(entry.compressed);
+    ssize_t got = pread(fd, compressed.data(), compressed.size(), static_cast<off_t>(entry.offset));
+    ::close(fd);
+    if (got != static_cast<ssize_t>(compressed.size())) {
+        throw std::runtime_error("Truncated archive segment " + path);
+    }
+
+    std::string raw(entry.length, '\0');
+    uLongf length = entry.length;
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &length, compressed.data(), compressed.size()) != Z_OK ||
+        length != entry.length) {
+        throw std::runtime_error("Corrupt message in " + path + " at offset " + std::to_string(entry.offset));
+    }
+    return raw;
+}
@@ -0,0 +1,264 @@
+// MessageTemplate.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Message template compilation and rendering
+
+#include "../includes/MessageTemplate.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Config.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <unistd.h>
+
+namespace {
+
+// Appended to a field cut at its character limit
+const char ELLIPSIS[] = "\xE2\x80\xA6";
+const size_t ELLIPSIS_LENGTH = 3;
+
+// Replacement text for every byte value; bytes that need no escaping map
+// to themselves
+struct EscapeTable {
+    uint8_t length[256];
+    char text[256][6];
+
+    explicit EscapeTable(MessageFormat format) {
+        for (int c = 0; c < 256; ++c) {
+            length[c] = 1;
+            text[c][0] = static_cast<char>(c);
+        }
+        if (format == FORMAT_MARKDOWN_V2) {
+            for (const char* c = "_*[]()~`>#+-=|{}.!\\"; *c; ++c) {
+                set(*c, std::string("\\") + *c);
+            }
+        } else if (format == FORMAT_HTML) {
+            set('&', "&amp;");
+            set('<', "&lt;");
+            set('>', "&gt;");
+            set('"', "&quot;");
+        }
+    }
+
+    void set(char c, const std::string& replacement) {
+        unsigned char index = static_cast<unsigned char>(c);
+        length[index] = static_cast<uint8_t>(replacement.size());
+        std::memcpy(text[index], replacement.data(), replacement.size());
+    }
+};
+
+const EscapeTable MARKDOWN_V2_ESCAPES(FORMAT_MARKDOWN_V2);
+const EscapeTable HTML_ESCAPES(FORMAT_HTML);
+
+const EscapeTable* escapesFor(MessageFormat format) {
+    switch (format) {
+        case FORMAT_MARKDOWN_V2: return &MARKDOWN_V2_ESCAPES;
+        case FORMAT_HTML: return &HTML_ESCAPES;
+        default: return nullptr;
+    }
+}
+
+size_t escapedLength(const EscapeTable* escapes, const char* data, size_t length) {
+    if (!escapes) return length;
+    size_t total = 0;
+    for (size_t i = 0; i < length; ++i) {
+        total += escapes->length[static_cast<unsigned char>(data[i])];
+    }
+    return total;
+}
+
+char* writeEscaped(const EscapeTable* escapes, const char* data, size_t length, char* out) {
+    if (!escapes) {
+        std::memcpy(out, data, length);
+        return out + length;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (escapes->length[c] == 1) {
+            *out++ = data[i];
+        } else {
+            std::memcpy(out, escapes->text[c], escapes->length[c]);
+            out += escapes->length[c];
+        }
+    }
+    return out;
+}
+
+// Byte length of the first max_chars UTF-8 characters of data
+size_t characterPrefix(const char* data, size_t length, size_t max_chars) {
+    size_t chars = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if ((static_cast<unsigned char>(data[i]) & 0xC0) != 0x80 && chars++ == max_chars) {
+            return i;
+        }
+    }
+    return length;
+}
+
+std::string toLower(std::string value) {
+    for (auto& c : value) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return value;
+}
+
+} // namespace
+
+MessageTemplate::MessageTemplate(const std::string& spec, MessageFormat format) : format_(format) {
+    char hostname[256] = {0};
+    if (gethostname(hostname, sizeof(hostname) - 1) == 0) {
+        host_ = hostname;
+    }
+
+    std::string literal;
+    auto flushLiteral = [this, &literal]() {
+        if (literal.empty()) return;
+        ops_.push_back(Op{OP_LITERAL, literal, 0});
+        literal.clear();
+    };
+
+    for (size_t i = 0; i < spec.size(); ++i) {
+        char c = spec[i];
+        if (c == '\\' && i + 1 < spec.size() && (spec[i + 1] == 'n' || spec[i + 1] == 't')) {
+            literal += spec[++i] == 'n' ? '\n' : '\t';
+        } else if ((c == '{' || c == '}') && i + 1 < spec.size() && spec[i + 1] == c) {
+            literal += c;
+            ++i;
+        } else if (c == '}') {
+            throw ConfigException("Unmatched '}' in MESSAGE_TEMPLATE");
+        } else if (c == '{') {
+            size_t close = spec.find('}', i);
+            if (close == std::string::npos) {
+                throw ConfigException("Unterminated field in MESSAGE_TEMPLATE");
+            }
+            std::string field = spec.substr(i + 1, close - i - 1);
+            i = close;
+
+            Op op{OP_LITERAL, "", 0};
+            size_t colon = field.find(':');
+            if (colon != std::string::npos) {
+                std::string limit = field.substr(colon + 1);
+                if (limit.empty() || limit.find_first_not_of("0123456789") != std::string::npos ||
+                    limit.size() > 6 || std::stoul(limit) == 0) {
+                    throw ConfigException("Invalid length in MESSAGE_TEMPLATE field: " + field);
+                }
+                op.max_chars = std::stoul(limit);
+                field.erase(colon);
+            }
+
+            std::string name = toLower(field);
+            if (name == "subject") {
+                op.type = OP_SUBJECT;
+            } else if (name == "from") {
+                op.type = OP_FROM;
+            } else if (name == "to") {
+                op.type = OP_TO;
+            } else if (name == "body") {
+                op.type = OP_BODY;
+            } else if (name == "host") {
+                op.type = OP_HOST;
+            } else if (name.compare(0, 7, "header.") == 0 && name.length() > 7) {
+                op.type = OP_HEADER;
+                op.text = name.substr(7);
+            } else {
+                throw ConfigException("Unknown MESSAGE_TEMPLATE field: " + field);
+            }
+
+            flushLiteral();
+            ops_.push_back(op);
+        } else {
+            literal += c;
+        }
+    }
+    flushLiteral();
+}
+
+void MessageTemplate::fieldValue(const Op& op, const ParsedEmail& email,
+                                 const char*& data, size_t& length, bool& truncated) const {
+    const std::string* value = nullptr;
+    switch (op.type) {
+        case OP_SUBJECT: value = &email.subject; break;
+        case OP_FROM: value = &email.from; break;
+        case OP_TO: value = &email.to; break;
+        case OP_BODY: value = &email.body; break;
+        case OP_HOST: value = &host_; break;
+        case OP_HEADER:
+            for (const auto& header : email.headers) {
+                if (header.first.size() == op.text.size() &&
+                    std::equal(header.first.begin(), header.first.end(), op.text.begin(), [](char a, char b) {
+                        return std::tolower(static_cast<unsigned char>(a)) == b;
+                    })) {
+                    value = &header.second;
+                    break;
+                }
+            }
+            break;
+        case OP_LITERAL: value = &op.text; break;
+    }
+
+    data = value ? value->data() : "";
+    length = value ? value->size() : 0;
+    truncated = false;
+    if (op.max_chars > 0 && length > op.max_chars) {
+        size_t cut = characterPrefix(data, length, op.max_chars);
+        truncated = cut < length;
+        length = cut;
+    }
+}
+
+std::string MessageTemplate::render(const ParsedEmail& email) const {
+    const EscapeTable* escapes = escapesFor(format_);
+    const char* data;
+    size_t length;
+    bool truncated;
+
+    // First pass sizes the output exactly, the second fills it in place
+    size_t total = 0;
+    for (const auto& op : ops_) {
+        if (op.type == OP_LITERAL) {
+            total += op.text.size();
+            continue;
+        }
+        fieldValue(op, email, data, length, truncated);
+        total += escapedLength(escapes, data, length) + (truncated ? ELLIPSIS_LENGTH : 0);
+    }
+
+    std::string result(total, '\0');
+    char* out = &result[0];
+    for (const auto& op : ops_) {
+        if (op.type == OP_LITERAL) {
+            std::memcpy(out, op.text.data(), op.text.size());
+            out += op.text.size();
+            continue;
+        }
+        fieldValue(op, email, data, length, truncated);
+        out = writeEscaped(escapes, data, length, out);
+        if (truncated) {
+            std::memcpy(out, ELLIPSIS, ELLIPSIS_LENGTH);
+            out += ELLIPSIS_LENGTH;
+        }
+    }
+    return result;
+}
+
+const char* MessageTemplate::parseMode() const {
+    switch (format_) {
+        case FORMAT_MARKDOWN_V2: return "MarkdownV2";
+        case FORMAT_HTML: return "HTML";
+        default: return "";
+    }
+}
+
+bool MessageTemplate::parseFormat(const std::string& name, MessageFormat& format) {
+    std::string lower = toLower(name);
+    if (lower.empty() || lower == "plain") {
+        format = FORMAT_PLAIN;
+    } else if (lower == "markdownv2") {
+        format = FORMAT_MARKDOWN_V2;
+    } else if (lower == "html") {
+        format = FORMAT_HTML;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,139 @@
+// PriorityRules.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Message priority classification implementation
+
+#include "../includes/PriorityRules.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Config.h"
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+PriorityRules::PriorityRules(const std::string& spec) {
+    std::istringstream entries(spec);
+    std::string entry;
+    while (std::getline(entries, entry, ';')) {
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+        if (entry.empty()) continue;
+
+        size_t tilde = entry.find('~');
+        size_t eq = entry.rfind('=');
+        if (tilde == std::string::npos || eq == std::string::npos || eq < tilde) {
+            throw ConfigException("Invalid PRIORITY_RULES entry (expected field~text=level): " + entry);
+        }
+
+        Rule rule;
+        std::string field = toLower(entry.substr(0, tilde));
+        rule.needle = toLower(entry.substr(tilde + 1, eq - tilde - 1));
+        std::string level = toLower(entry.substr(eq + 1));
+
+        if (field == "subject") {
+            rule.field = FIELD_SUBJECT;
+        } else if (field == "from") {
+            rule.field = FIELD_FROM;
+        } else if (field == "rcpt") {
+            rule.field = FIELD_RCPT;
+        } else if (field.compare(0, 7, "header.") == 0 && field.length() > 7) {
+            rule.field = FIELD_HEADER;
+            rule.header = field.substr(7);
+        } else {
+            throw ConfigException("Unknown PRIORITY_RULES field: " + field);
+        }
+
+        if (level == "high") {
+            rule.priority = PRIORITY_HIGH;
+        } else if (level == "normal") {
+            rule.priority = PRIORITY_NORMAL;
+        } else if (level == "low") {
+            rule.priority = PRIORITY_LOW;
+        } else {
+            throw ConfigException("Unknown PRIORITY_RULES level: " + level);
+        }
+
+        rules_.push_back(rule);
+    }
+}
+
+MessagePriority PriorityRules::classify(const ParsedEmail& email,
+                                        const std::vector<std::string>& recipients) const {
+    for (const auto& rule : rules_) {
+        if (matches(rule, email, recipients)) {
+            return rule.priority;
+        }
+    }
+
+    return fromHeaders(email);
+}
+
+bool PriorityRules::matches(const Rule& rule, const ParsedEmail& email,
+                            const std::vector<std::string>& recipients) const {
+    switch (rule.field) {
+        case FIELD_SUBJECT:
+            return containsIgnoreCase(email.subject, rule.needle);
+        case FIELD_FROM:
+            return containsIgnoreCase(email.from, rule.needle);
+        case FIELD_RCPT:
+            for (const auto& recipient : recipients) {
+                if (containsIgnoreCase(recipient, rule.needle)) return true;
+            }
+            return false;
+        case FIELD_HEADER:
+            return containsIgnoreCase(findHeader(email, rule.header), rule.needle);
+    }
+    return false;
+}
+
+MessagePriority PriorityRules::fromHeaders(const ParsedEmail& email) const {
+    // X-Priority: 1 (Highest) .. 5 (Lowest)
+    std::string x_priority = findHeader(email, "x-priority");
+    size_t digit = x_priority.find_first_of("12345");
+    if (digit != std::string::npos) {
+        char level = x_priority[digit];
+        if (level <= '2') return PRIORITY_HIGH;
+        if (level >= '4') return PRIORITY_LOW;
+        return PRIORITY_NORMAL;
+    }
+
+    std::string importance = toLower(findHeader(email, "importance"));
+    if (importance.find("high") != std::string::npos) return PRIORITY_HIGH;
+    if (importance.find("low") != std::string::npos) return PRIORITY_LOW;
+
+    std::string priority = toLower(findHeader(email, "priority"));
+    if (priority.find("non-urgent") != std::string::npos) return PRIORITY_LOW;
+    if (priority.find("urgent") != std::string::npos) return PRIORITY_HIGH;
+
+    return PRIORITY_NORMAL;
+}
+
+std::string PriorityRules::name(MessagePriority priority) {
+    switch (priority) {
+        case PRIORITY_HIGH: return "high";
+        case PRIORITY_LOW: return "low";
+        default: return "normal";
+    }
+}
+
+std::string PriorityRules::findHeader(const ParsedEmail& email, const std::string& lower_name) {
+    for (const auto& header : email.headers) {
+        if (toLower(header.first) == lower_name) return header.second;
+    }
+    return "";
+}
+
+bool PriorityRules::containsIgnoreCase(const std::string& haystack, const std::string& lower_needle) {
+    auto it = std::search(haystack.begin(), haystack.end(), lower_needle.begin(), lower_needle.end(),
+                          [](char a, char b) {
+                              return std::tolower(static_cast<unsigned char>(a)) == b;
+                          });
+    return it != haystack.end();
+}
+
+std::string PriorityRules::toLower(const std::string& value) {
+    std::string result = value;
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
@@ -0,0 +1,152 @@
+// RecipientRouter.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Recipient routing implementation
+
+#include "../includes/RecipientRouter.h"
+#include "../includes/Config.h"
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+RecipientRouter::RecipientRouter(const std::string& spec, const std::string& default_chat_id)
+    : route_count_(0) {
+    default_chat_ids_.push_back(default_chat_id);
+
+    std::istringstream entries(spec);
+    std::string entry;
+    while (std::getline(entries, entry, ';')) {
+        entry = trim(entry);
+        if (entry.empty()) continue;
+
+        size_t colon = entry.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            throw ConfigException("Invalid ROUTES entry (expected pattern:chat_id): " + entry);
+        }
+
+        std::string pattern = toLower(trim(entry.substr(0, colon)));
+        std::vector<std::string> chat_ids;
+
+        std::istringstream chats(entry.substr(colon + 1));
+        std::string chat_id;
+        while (std::getline(chats, chat_id, ',')) {
+            chat_id = trim(chat_id);
+            if (!chat_id.empty()) chat_ids.push_back(chat_id);
+        }
+
+        if (chat_ids.empty()) {
+            throw ConfigException("ROUTES entry has no chat IDs: " + entry);
+        }
+
+        addRoute(pattern, chat_ids);
+        ++route_count_;
+    }
+}
+
+void RecipientRouter::addRoute(const std::string& pattern, const std::vector<std::string>& chat_ids) {
+    size_t at = pattern.find('@');
+
+    if (at == std::string::npos) {
+        addDomain(pattern, chat_ids);
+    } else if (at == 0) {
+        addDomain(pattern.substr(1), chat_ids);
+    } else if (at == pattern.length() - 1) {
+        auto& target = local_parts_[pattern.substr(0, at)];
+        target.insert(target.end(), chat_ids.begin(), chat_ids.end());
+    } else {
+        auto& target = addresses_[pattern];
+        target.insert(target.end(), chat_ids.begin(), chat_ids.end());
+    }
+}
+
+void RecipientRouter::addDomain(const std::string& domain, const std::vector<std::string>& chat_ids) {
+    // Labels are inserted right to left so "example.com" also covers "mx.example.com"
+    DomainNode* node = &domains_;
+    size_t end = domain.length();
+
+    while (end > 0) {
+        size_t dot = domain.rfind('.', end - 1);
+        size_t start = (dot == std::string::npos) ? 0 : dot + 1;
+        std::string label = domain.substr(start, end - start);
+
+        auto& child = node->children[label];
+        if (!child) child.reset(new DomainNode());
+        node = child.get();
+
+        if (dot == std::string::npos) break;
+        end = dot;
+    }
+
+    node->chat_ids.insert(node->chat_ids.end(), chat_ids.begin(), chat_ids.end());
+}
+
+const std::vector<std::string>* RecipientRouter::findDomain(const std::string& domain) const {
+    const DomainNode* node = &domains_;
+    const std::vector<std::string>* best = nullptr;
+    size_t end = domain.length();
+
+    while (end > 0) {
+        size_t dot = domain.rfind('.', end - 1);
+        size_t start = (dot == std::string::npos) ? 0 : dot + 1;
+
+        auto it = node->children.find(domain.substr(start, end - start));
+        if (it == node->children.end()) break;
+
+        node = it->second.get();
+        if (!node->chat_ids.empty()) best = &node->chat_ids;
+
+        if (dot == std::string::npos) break;
+        end = dot;
+    }
+
+    return best;
+}
+
+std::vector<std::string> RecipientRouter::resolve(const std::string& address) const {
+    std::string addr = toLower(address);
+
+    // Most specific match wins: full address, then local-part, then domain
+    auto exact = addresses_.find(addr);
+    if (exact != addresses_.end()) return exact->second;
+
+    size_t at = addr.find('@');
+    if (at != std::string::npos) {
+        auto local = local_parts_.find(addr.substr(0, at));
+        if (local != local_parts_.end()) return local->second;
+
+        const std::vector<std::string>* domain = findDomain(addr.substr(at + 1));
+        if (domain) return *domain;
+    }
+
+    return default_chat_ids_;
+}
+
+std::vector<std::string> RecipientRouter::resolveAll(const std::vector<std::string>& addresses) const {
+    if (addresses.empty()) return default_chat_ids_;
+
+    std::vector<std::string> result;
+    for (const auto& address : addresses) {
+        for (const auto& chat_id : resolve(address)) {
+            if (std::find(result.begin(), result.end(), chat_id) == result.end()) {
+                result.push_back(chat_id);
+            }
+        }
+    }
+
+    return result;
+}
+
+std::string RecipientRouter::toLower(const std::string& value) {
+    std::string result = value;
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+std::string RecipientRouter::trim(const std::string& value) {
+    size_t start = value.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) return "";
+    size_t end = value.find_last_not_of(" \t\r\n");
+    return value.substr(start, end - start + 1);
+}
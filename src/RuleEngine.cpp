@@ -0,0 +1,370 @@
+// RuleEngine.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Filter rule compilation and matching
+
+#include "../includes/RuleEngine.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Config.h"
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// Shorter required literals of a regex would match too often to save work
+const size_t MIN_PREFILTER_LENGTH = 3;
+
+namespace {
+
+struct Token {
+    std::string text;
+    char quote;  // '"' or '/' for quoted tokens, 0 otherwise
+};
+
+// Split a rule line at whitespace; "..." and /.../ may contain spaces and
+// escaped quotes
+bool tokenize(const std::string& line, std::vector<Token>& tokens) {
+    size_t i = 0;
+    while (i < line.size()) {
+        if (std::isspace(static_cast<unsigned char>(line[i]))) {
+            ++i;
+            continue;
+        }
+
+        Token token;
+        token.quote = 0;
+        if (line[i] == '"' || line[i] == '/') {
+            token.quote = line[i++];
+            bool closed = false;
+            while (i < line.size()) {
+                char c = line[i++];
+                if (c == token.quote) {
+                    closed = true;
+                    break;
+                }
+                if (c == '\\' && i < line.size()) {
+                    char next = line[i++];
+                    // A regex keeps its escapes, except for the delimiter
+                    if (token.quote == '/' && next != '/') token.text += '\\';
+                    token.text += next;
+                    continue;
+                }
+                token.text += c;
+            }
+            if (!closed) return false;
+        } else {
+            while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i]))) {
+                token.text += line[i++];
+            }
+        }
+        tokens.push_back(token);
+    }
+    return true;
+}
+
+std::string toLower(std::string value) {
+    for (auto& c : value) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return value;
+}
+
+std::string lineError(int number, const std::string& message) {
+    return "RULES_FILE line " + std::to_string(number) + ": " + message;
+}
+
+} // namespace
+
+RuleEngine::RuleEngine(const std::string& spec, size_t body_bytes) : class_count_(1), body_bytes_(body_bytes) {
+    std::istringstream lines(spec);
+    std::string line;
+    int number = 0;
+    while (std::getline(lines, line)) {
+        ++number;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line[start] == '#') continue;
+        parseLine(line, number);
+    }
+    buildAutomaton();
+}
+
+void RuleEngine::parseLine(const std::string& line, int number) {
+    std::vector<Token> tokens;
+    if (!tokenize(line, tokens)) {
+        throw ConfigException(lineError(number, "unterminated quote"));
+    }
+    if (tokens.size() < 3) {
+        throw ConfigException(lineError(number, "expected field, pattern and action"));
+    }
+
+    Rule rule;
+    rule.line = number;
+    rule.literal = -1;
+    rule.priority = PRIORITY_NORMAL;
+
+    std::string field = toLower(tokens[0].text);
+    if (field == "subject") {
+        rule.fields = FIELD_SUBJECT;
+    } else if (field == "from") {
+        rule.fields = FIELD_FROM;
+    } else if (field == "body") {
+        rule.fields = FIELD_BODY;
+    } else if (field == "any") {
+        rule.fields = FIELD_SUBJECT | FIELD_FROM | FIELD_BODY;
+    } else {
+        throw ConfigException(lineError(number, "unknown field " + tokens[0].text));
+    }
+
+    const Token& pattern = tokens[1];
+    if (pattern.quote == 0 || pattern.text.empty()) {
+        throw ConfigException(lineError(number, "pattern must be \"text\" or /regex/"));
+    }
+    rule.is_regex = pattern.quote == '/';
+    if (rule.is_regex) {
+        try {
+            rule.regex = std::regex(pattern.text, std::regex::ECMAScript | std::regex::icase | std::regex::optimize);
+        } catch (const std::regex_error& e) {
+            throw ConfigException(lineError(number, "invalid regex /" + pattern.text + "/: " + e.what()));
+        }
+        std::string literal = requiredLiteral(pattern.text);
+        if (!literal.empty()) rule.literal = addPattern(literal);
+    } else {
+        rule.literal = addPattern(toLower(pattern.text));
+    }
+
+    std::string action = toLower(tokens[2].text);
+    std::string argument = tokens.size() > 3 ? tokens[3].text : "";
+    if (action != "drop" && action != "route" && action != "priority" && action != "prefix") {
+        throw ConfigException(lineError(number, "unknown action " + tokens[2].text));
+    }
+    size_t expected = action == "drop" ? 3 : 4;
+    if (tokens.size() != expected) {
+        throw ConfigException(lineError(number, action == "drop" ? "drop takes no argument"
+                                                                 : "expected one argument for " + action));
+    }
+
+    if (action == "drop") {
+        rule.action = ACTION_DROP;
+    } else if (action == "route") {
+        rule.action = ACTION_ROUTE;
+        std::istringstream chats(argument);
+        std::string chat;
+        while (std::getline(chats, chat, ',')) {
+            if (!chat.empty()) rule.chat_ids.push_back(chat);
+        }
+        if (rule.chat_ids.empty()) {
+            throw ConfigException(lineError(number, "route needs at least one chat ID"));
+        }
+    } else if (action == "priority") {
+        rule.action = ACTION_PRIORITY;
+        std::string level = toLower(argument);
+        if (level == "high") {
+            rule.priority = PRIORITY_HIGH;
+        } else if (level == "normal") {
+            rule.priority = PRIORITY_NORMAL;
+        } else if (level == "low") {
+            rule.priority = PRIORITY_LOW;
+        } else {
+            throw ConfigException(lineError(number, "unknown priority " + argument));
+        }
+    } else {
+        rule.action = ACTION_PREFIX;
+        rule.prefix = argument;
+    }
+
+    rules_.push_back(std::move(rule));
+}
+
+int RuleEngine::addPattern(const std::string& literal) {
+    patterns_.push_back(literal);
+    return static_cast<int>(patterns_.size() - 1);
+}
+
+void RuleEngine::buildAutomaton() {
+    // Byte classes: one per byte value that occurs in a pattern (upper case
+    // folded onto lower case), class 0 for everything else
+    std::memset(classes_, 0, sizeof(classes_));
+    for (const auto& pattern : patterns_) {
+        for (char c : pattern) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (classes_[byte] == 0) classes_[byte] = static_cast<uint8_t>(class_count_++);
+        }
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+        classes_[c] = classes_[std::tolower(c)];
+    }
+
+    // Trie; a zero transition means no edge, since no edge leads to the root
+    states_.assign(1, State());
+    transitions_.assign(class_count_, 0);
+    for (uint32_t id = 0; id < patterns_.size(); ++id) {
+        uint32_t state = 0;
+        for (char c : patterns_[id]) {
+            uint32_t& next = transitions_[state * class_count_ + classes_[static_cast<unsigned char>(c)]];
+            if (next == 0) {
+                next = static_cast<uint32_t>(states_.size());
+                states_.push_back(State());
+                transitions_.resize(transitions_.size() + class_count_, 0);
+            }
+            state = transitions_[state * class_count_ + classes_[static_cast<unsigned char>(c)]];
+        }
+        states_[state].matches.push_back(id);
+    }
+
+    // Breadth-first: fill in failure transitions, so the table holds the
+    // complete automaton, and inherit the matches of each failure state
+    std::vector<uint32_t> fail(states_.size(), 0);
+    std::vector<uint32_t> queue;
+    queue.push_back(0);
+    for (size_t head = 0; head < queue.size(); ++head) {
+        uint32_t state = queue[head];
+        for (size_t c = 0; c < class_count_; ++c) {
+            uint32_t& next = transitions_[state * class_count_ + c];
+            uint32_t fallback = state == 0 ? 0 : transitions_[fail[state] * class_count_ + c];
+            if (next == 0) {
+                next = fallback;
+                continue;
+            }
+            fail[next] = fallback;
+            const auto& inherited = states_[fallback].matches;
+            states_[next].matches.insert(states_[next].matches.end(), inherited.begin(), inherited.end());
+            queue.push_back(next);
+        }
+    }
+}
+
+void RuleEngine::scan(const char* data, size_t length, unsigned bit, std::vector<unsigned>& hits) const {
+    uint32_t state = 0;
+    for (size_t i = 0; i < length; ++i) {
+        state = transitions_[state * class_count_ + classes_[static_cast<unsigned char>(data[i])]];
+        for (uint32_t id : states_[state].matches) {
+            hits[id] |= bit;
+        }
+    }
+}
+
+RuleOutcome RuleEngine::evaluate(const ParsedEmail& email) const {
+    RuleOutcome outcome;
+    if (rules_.empty()) return outcome;
+
+    // One pass over each field finds every literal at once
+    size_t body_length = std::min(email.body.size(), body_bytes_);
+    std::vector<unsigned> hits(patterns_.size(), 0);
+    if (!patterns_.empty()) {
+        scan(email.subject.data(), email.subject.size(), FIELD_SUBJECT, hits);
+        scan(email.from.data(), email.from.size(), FIELD_FROM, hits);
+        scan(email.body.data(), body_length, FIELD_BODY, hits);
+    }
+
+    bool routed = false;
+    bool prefixed = false;
+    for (const auto& rule : rules_) {
+        // Only the first rule of each action counts; skip the rest unmatched
+        if ((rule.action == ACTION_ROUTE && routed) || (rule.action == ACTION_PRIORITY && outcome.has_priority) ||
+            (rule.action == ACTION_PREFIX && prefixed)) {
+            continue;
+        }
+
+        unsigned candidates = rule.literal >= 0 ? hits[rule.literal] & rule.fields : rule.fields;
+        bool matched = candidates != 0 && !rule.is_regex;
+        if (candidates != 0 && rule.is_regex) {
+            // Run the regex only on fields that passed the prefilter
+            matched = ((candidates & FIELD_SUBJECT) && std::regex_search(email.subject, rule.regex)) ||
+                      ((candidates & FIELD_FROM) && std::regex_search(email.from, rule.regex)) ||
+                      ((candidates & FIELD_BODY) &&
+                       std::regex_search(email.body.data(), email.body.data() + body_length, rule.regex));
+        }
+        if (!matched) continue;
+
+        switch (rule.action) {
+            case ACTION_DROP:
+                outcome.drop = true;
+                outcome.rule_line = rule.line;
+                return outcome;
+            case ACTION_ROUTE:
+                outcome.chat_ids = rule.chat_ids;
+                routed = true;
+                break;
+            case ACTION_PRIORITY:
+                outcome.priority = rule.priority;
+                outcome.has_priority = true;
+                break;
+            case ACTION_PREFIX:
+                outcome.prefix = rule.prefix;
+                prefixed = true;
+                break;
+        }
+    }
+    return outcome;
+}
+
+std::string RuleEngine::requiredLiteral(const std::string& regex) {
+    // With alternation no single literal is required
+    if (regex.find('|') != std::string::npos) return "";
+
+    std::string best;
+    std::string run;
+    bool last_literal = false;  // run ends with a character a quantifier may apply to
+    int depth = 0;              // literals inside groups are skipped: the group may be optional
+
+    auto endRun = [&]() {
+        if (run.size() > best.size()) best = run;
+        run.clear();
+        last_literal = false;
+    };
+
+    for (size_t i = 0; i < regex.size(); ++i) {
+        char c = regex[i];
+        if (c == '*' || c == '?' || c == '{') {
+            // The preceding character may be absent
+            if (last_literal) run.pop_back();
+            endRun();
+            if (c == '{') {
+                size_t close = regex.find('}', i);
+                if (close == std::string::npos) break;
+                i = close;
+            }
+        } else if (c == '+') {
+            // The character is there at least once, but may repeat
+            endRun();
+        } else if (c == '(') {
+            endRun();
+            ++depth;
+        } else if (c == ')') {
+            endRun();
+            if (depth > 0) --depth;
+        } else if (c == '[') {
+            endRun();
+            size_t j = i + 1;
+            if (j < regex.size() && regex[j] == '^') ++j;
+            if (j < regex.size() && regex[j] == ']') ++j;
+            while (j < regex.size() && regex[j] != ']') {
+                if (regex[j] == '\\') ++j;
+                ++j;
+            }
+            i = j;
+        } else if (c == '.' || c == '^' || c == '$') {
+            endRun();
+        } else if (c == '\\') {
+            if (i + 1 >= regex.size()) break;
+            char next = regex[++i];
+            if (std::isalnum(static_cast<unsigned char>(next))) {
+                endRun();  // class, anchor, backreference or escaped code
+                // The operand of \x, \u and \c is not text of its own
+                if (next == 'x') i += 2;
+                else if (next == 'u') i += 4;
+                else if (next == 'c') i += 1;
+            } else if (depth == 0) {
+                run += static_cast<char>(std::tolower(static_cast<unsigned char>(next)));
+                last_literal = true;
+            }
+        } else if (depth == 0) {
+            run += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            last_literal = true;
+        }
+    }
+    endRun();
+
+    return best.size() >= MIN_PREFILTER_LENGTH ? best : "";
+}
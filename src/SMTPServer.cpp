@@ -6,233 +6,685 @@
 
 #include "../includes/SMTPServer.h"
 #include "../includes/Logger.h"
+#include "../includes/ConfigStore.h"
+#include "../includes/RecipientRouter.h"
+#include "../includes/DedupCache.h"
+#include "../includes/DeliveryQueue.h"
+#include "../includes/HotRestart.h"
 #include "../includes/TelegramClient.h"
-#include "../includes/EmailParser.h"
+#include "../includes/Config.h"
+#include "../includes/MessageTemplate.h"
+#include "../includes/CharsetConverter.h"
+#include "../includes/RuleEngine.h"
+#include "../includes/SessionCapture.h"
+#include "../includes/MessageArchive.h"
+#include "../includes/StormCollapser.h"
+#include "../includes/AdmissionControl.h"
 #include <iostream>
 #include <sstream>
-#include <thread>
 #include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
 using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+// SO_REUSEPORT lets every worker bind its own socket to the same port;
+// the kernel then spreads incoming connections across them
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+// Resumable TLS sessions kept for clients without ticket support
+const long TLS_SESSION_CACHE_SIZE = 20480;
+
+// Requests in flight per worker ring: the multishot accept and its cancel
+const unsigned ACCEPT_RING_ENTRIES = 4;
+
+// user_data tags of the accept ring requests
+const uint64_t RING_ACCEPT = 1;
+const uint64_t RING_CANCEL = 2;
+
+// How long a session (ticket or cached) can be resumed
+const long TLS_SESSION_LIFETIME_SECONDS = 7200;
+
+namespace {
+
+// True if type is in a comma-separated list of MIME types; "image/*"
+// matches every image type
+bool typeListed(const std::string& list, const std::string& type) {
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+
+        std::string entry = list.substr(start, end - start);
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+
+        if (entry == type || entry == "*/*") return true;
+        if (entry.size() > 2 && entry.compare(entry.size() - 2, 2, "/*") == 0 &&
+            type.compare(0, entry.size() - 1, entry, 0, entry.size() - 1) == 0) {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+// True for an inherited listener bound to a Unix-domain socket (LMTP)
+bool isUnixSocket(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0 &&
+           addr.ss_family == AF_UNIX;
+}
+
+} // namespace
 
 SMTPServer::SMTPServer(const std::string& hostname, int port,
-                       std::shared_ptr<TelegramClient> telegram,
+                       std::shared_ptr<DeliveryQueue> queue,
                        std::shared_ptr<Logger> logger,
-                       std::shared_ptr<EmailParser> parser)
-    : hostname_(hostname), port_(port), telegram_(telegram),
-      logger_(logger), parser_(parser), shutdown_requested_(false) {
+                       std::shared_ptr<EmailParser> parser,
+                       std::shared_ptr<ConfigStore> config,
+                       std::shared_ptr<AdmissionControl> admission)
+    : hostname_(hostname), port_(port), queue_(queue),
+      logger_(logger), parser_(parser), config_(config), admission_(admission),
+      shutdown_requested_(false), restart_requested_(false), worker_count_(1),
+      pin_cpus_(false), handoff_fd_(-1), tls_required_(false), lmtp_mode_(0666), io_uring_(false) {
 }
 
 SMTPServer::~SMTPServer() {
 }
 
-void SMTPServer::shutdown() {
-    shutdown_requested_ = true;
-    logger_->info("Shutdown requested");
+void SMTPServer::configureWorkers(int workers, bool pin_cpus) {
+    worker_count_ = workers > 0 ? workers : 1;
+    pin_cpus_ = pin_cpus;
 }
 
-void SMTPServer::sendResponse(tcp::socket& socket, const std::string& response) {
+void SMTPServer::configureTls(const std::string& cert_path, const std::string& key_path, bool required) {
+    namespace ssl = boost::asio::ssl;
+    auto context = std::unique_ptr<ssl::context>(new ssl::context(ssl::context::tls_server));
+
     try {
-        boost::asio::write(socket, boost::asio::buffer(response));
-    } catch (const std::exception& e) {
-        logger_->error("Failed to send response: " + std::string(e.what()));
+        context->set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 |
+                             ssl::context::no_sslv3 | ssl::context::no_tlsv1 |
+                             ssl::context::no_tlsv1_1 | ssl::context::single_dh_use);
+        context->use_certificate_chain_file(cert_path);
+        context->use_private_key_file(key_path, ssl::context::pem);
+    } catch (const boost::system::system_error& e) {
+        throw ConfigException("Failed to load TLS certificate or key: " + std::string(e.what()));
     }
+
+    // Let repeat clients resume instead of doing a full handshake: tickets
+    // (stateless, keys shared by all workers through this context) and a
+    // server-side session cache for clients without ticket support
+    SSL_CTX* native = context->native_handle();
+    static const unsigned char session_context[] = "smtp2telegram";
+    SSL_CTX_set_session_id_context(native, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(native, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(native, TLS_SESSION_LIFETIME_SECONDS);
+    SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+
+    tls_context_ = std::move(context);
+    tls_required_ = required;
+    logger_->info(std::string("STARTTLS enabled") + (required ? " and required" : ""));
 }
 
-bool SMTPServer::readCommand(tcp::socket& socket, boost::asio::streambuf& buf, std::string& command) {
-    try {
-        boost::system::error_code ec;
-        boost::asio::read_until(socket, buf, "\r\n", ec);
+void SMTPServer::configureLmtp(const std::string& path, int mode) {
+    lmtp_path_ = path;
+    lmtp_mode_ = mode;
+}
 
-        if (ec) {
-            if (ec != boost::asio::error::eof) {
-                logger_->error("Error reading command: " + ec.message());
-            }
-            return false;
+void SMTPServer::configureIoUring(bool enabled) {
+    io_uring_ = enabled;
+}
+
+void SMTPServer::configureCapture(const std::string& path, uint64_t max_bytes) {
+    capture_ = std::make_shared<SessionCapture>(path, max_bytes);
+    logger_->warning("Recording SMTP sessions, including message contents, to " + path);
+}
+
+void SMTPServer::configureArchive(const std::string& dir, uint64_t segment_bytes, int keep_days) {
+    archive_ = std::make_shared<MessageArchive>(dir, segment_bytes, keep_days, logger_);
+    logger_->info("Archiving received messages to " + dir);
+}
+
+void SMTPServer::configureStorm(const std::string& fields, int window_seconds, int edit_interval,
+                                size_t max_groups) {
+    storm_ = std::make_shared<StormCollapser>(fields, window_seconds, edit_interval, max_groups, logger_);
+    logger_->info("Collapsing repeated alerts (" + std::to_string(window_seconds) + "s window)");
+}
+
+void SMTPServer::shutdown() {
+    shutdown_requested_ = true;
+}
+
+void SMTPServer::requestRestart() {
+    restart_requested_ = true;
+}
+
+std::string SMTPServer::deliverEmail(EmailParser& parser,
+                                     std::string& email_data,
+                                     const std::vector<std::string>& recipients) {
+    // The whole message is handled with the settings current at arrival
+    std::shared_ptr<const RuntimeConfig> runtime = config_->current();
+
+    // Parse and format once, whatever the number of target chats
+    ParsedEmail parsed = parser.parse(email_data);
+
+    // Files are uploaded straight from the received message; share it with
+    // the job (and the archive) instead of copying it. It stays counted in
+    // MAX_INFLIGHT_BYTES until the last of them lets go, so a backlog held
+    // while Telegram is down cannot grow without bound
+    std::shared_ptr<const std::string> raw;
+    std::shared_ptr<AdmissionControl> admission = admission_;
+    auto shareRaw = [&raw, &email_data, &admission]() {
+        if (!raw) {
+            size_t size = email_data.size();
+            admission->holdBytes(size);
+            raw.reset(new std::string(std::move(email_data)), [admission, size](const std::string* data) {
+                delete data;
+                admission->releaseBytes(size);
+            });
         }
+        return raw;
+    };
+
+    // Everything accepted is archived, including what is suppressed below
+    if (archive_ && !archive_->add(shareRaw(), parsed)) {
+        logger_->warning("Archive backlog full, message not archived");
+    }
+
+    uint64_t fingerprint = runtime->dedup ? runtime->dedup->fingerprint(parsed) : 0;
+    if (runtime->dedup && runtime->dedup->isDuplicate(fingerprint)) {
+        logger_->info("Duplicate email suppressed (" + std::to_string(runtime->dedup->suppressedCount()) +
+                      " suppressed since startup)");
+        return "250 OK: Duplicate message accepted\r\n";
+    }
+
+    if (parsed.from.empty() && parsed.subject.empty() && parsed.body.empty()) {
+        logger_->warning("Empty email received");
+        return "250 OK: Empty message accepted\r\n";
+    }
 
-        std::istream is(&buf);
-        std::getline(is, command);
-        if (!command.empty() && command.back() == '\r') {
-            command.pop_back();
+    RuleOutcome outcome;
+    if (runtime->rules) {
+        outcome = runtime->rules->evaluate(parsed);
+        if (outcome.drop) {
+            logger_->info("Email dropped by filter rule on line " + std::to_string(outcome.rule_line));
+            return "250 OK: Message dropped by filter rule\r\n";
         }
+        parsed.subject.insert(0, outcome.prefix);
+    }
 
-        return true;
-    } catch (const std::exception& e) {
-        logger_->error("Exception reading command: " + std::string(e.what()));
-        return false;
+    std::string telegram_msg = runtime->message_template ? runtime->message_template->render(parsed)
+                                                         : parser.formatForTelegram(parsed);
+
+    // Telegram refuses invalid UTF-8 outright; validate once, and measure
+    // the length in characters while at it
+    size_t characters = CharsetConverter::repairUtf8(telegram_msg);
+
+    DeliveryJob job;
+    job.chat_ids = outcome.chat_ids.empty() ? runtime->router->resolveAll(recipients) : outcome.chat_ids;
+    job.priority = outcome.has_priority ? outcome.priority : runtime->priorities->classify(parsed, recipients);
+    job.telegram = runtime->telegram;
+
+    const Config& config = *runtime->config;
+    std::string overflow = config.getTelegramOverflow();
+    if ((overflow == "document" || overflow == "eml") && !TelegramClient::fitsInMessage(characters)) {
+        // Send the whole email as a file instead of cutting it off
+        std::ostringstream caption;
+        if (!parsed.from.empty()) caption << "From: " << parsed.from << "\n";
+        if (!parsed.subject.empty()) caption << "Subject: " << parsed.subject << "\n";
+        caption << "(full message attached)";
+        job.message = TelegramClient::fitCaption(caption.str());
+
+        if (overflow == "eml") {
+            job.document.buffer = shareRaw();
+            job.document.filename = "message.eml";
+            job.document.content_type = "message/rfc822";
+        } else {
+            job.document.buffer = std::make_shared<const std::string>(std::move(telegram_msg));
+            job.document.filename = "message.txt";
+            job.document.content_type = "text/plain";
+        }
+        job.document.length = job.document.buffer->size();
+    } else {
+        job.message = std::move(telegram_msg);
     }
-}
 
-bool SMTPServer::readData(tcp::socket& socket, boost::asio::streambuf& buf, std::string& data) {
-    try {
-        boost::system::error_code ec;
-        boost::asio::read_until(socket, buf, "\r\n.\r\n", ec);
+    std::string attachment_types = config.getAttachmentTypes();
+    for (const auto& attachment : parsed.attachments) {
+        if (attachment_types.empty()) break;
+        if (!typeListed(attachment_types, attachment.content_type)) continue;
 
-        if (ec) {
-            logger_->error("Error reading DATA: " + ec.message());
-            return false;
+        if (static_cast<int>(job.attachments.size()) >= config.getAttachmentMaxCount()) {
+            logger_->warning("Attachment limit reached, skipping the remaining attachments");
+            break;
         }
 
-        std::istream data_stream(&buf);
-        std::ostringstream oss;
-        oss << data_stream.rdbuf();
-        data = oss.str();
+        TelegramFile file;
+        file.buffer = shareRaw();
+        file.offset = attachment.offset;
+        file.length = attachment.length;
+        file.base64 = attachment.base64;
+        file.filename = attachment.filename.empty() ? "attachment" : attachment.filename;
+        CharsetConverter::repairUtf8(file.filename);
+        file.content_type = attachment.content_type;
+
+        size_t size = file.size();
+        if (size > static_cast<size_t>(config.getAttachmentMaxSize())) {
+            logger_->warning("Skipping attachment " + file.filename + " (" + std::to_string(size) +
+                             " bytes exceeds ATTACHMENT_MAX_SIZE)");
+            continue;
+        }
+        job.attachments.push_back(std::move(file));
+    }
 
-        // Remove the terminating .\r\n
-        if (data.length() >= 5) {
-            data = data.substr(0, data.length() - 5);
+    // A repeated alert only bumps the count on the first one; messages sent
+    // as files or with attachments always go out in full
+    if (storm_ && !job.document.buffer && job.attachments.empty() &&
+        TelegramClient::fitsInMessage(characters + StormCollapser::FOOTER_RESERVE)) {
+        job.storm_key = storm_->key(parsed, job.chat_ids);
+        if (storm_->collapse(job.storm_key)) {
+            logger_->info("Repeated alert collapsed (" + std::to_string(storm_->collapsedCount()) +
+                          " collapsed since startup)");
+            return "250 OK: Repeated message accepted\r\n";
         }
+        job.storm = storm_;
+    }
 
-        return true;
-    } catch (const std::exception& e) {
-        logger_->error("Exception reading DATA: " + std::string(e.what()));
+    std::string priority = PriorityRules::name(job.priority);
+    bool has_document = static_cast<bool>(job.document.buffer);
+    size_t attachments = job.attachments.size();
+    std::shared_ptr<StormCollapser> storm = job.storm;
+    uint64_t storm_key = job.storm_key;
+    if (!queue_->enqueue(std::move(job))) {
+        // The retry must open a fresh group rather than be counted into this one
+        if (storm) {
+            storm->abandon(storm_key);
+        }
+        logger_->error("Delivery queue full, deferring email");
+        return "451 Delivery queue full, try again later\r\n";
+    }
+    if (runtime->dedup) {
+        runtime->dedup->remember(fingerprint);
+    }
+
+    std::string as = has_document ? " as a document" : "";
+    if (attachments > 0) {
+        as += " with " + std::to_string(attachments) + " attachment(s)";
+    }
+    logger_->info("Email queued for delivery" + as + " (" + priority + " priority)");
+    return "250 OK: Message queued\r\n";
+}
+
+SessionTimeouts SMTPServer::sessionTimeouts() const {
+    std::shared_ptr<const RuntimeConfig> runtime = config_->current();
+    SessionTimeouts timeouts;
+    timeouts.command = runtime->config->getSmtpCommandTimeout();
+    timeouts.data = runtime->config->getSmtpDataTimeout();
+    timeouts.session = runtime->config->getSmtpSessionTimeout();
+    return timeouts;
+}
+
+void SMTPServer::openAcceptor(Worker& worker, bool reuse_port_enabled) {
+    tcp::endpoint endpoint(boost::asio::ip::make_address(hostname_), port_);
+
+    worker.acceptor.open(endpoint.protocol());
+    worker.acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if (reuse_port_enabled) {
+        worker.acceptor.set_option(reuse_port(true));
+    }
+    worker.acceptor.bind(endpoint);
+    worker.acceptor.listen();
+}
+
+void SMTPServer::assignAcceptor(Worker& worker, int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0) {
+        throw std::runtime_error("Inherited socket " + std::to_string(fd) + " is not usable");
+    }
+
+    worker.acceptor.assign(addr.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), fd);
+}
+
+void SMTPServer::openLmtpAcceptor(Worker& worker, int inherited_fd) {
+    worker.lmtp_acceptor.reset(new stream_protocol::acceptor(worker.io_context));
+    if (inherited_fd >= 0) {
+        worker.lmtp_acceptor->assign(stream_protocol(), inherited_fd);
+        return;
+    }
+
+    // A socket left behind by an earlier run would make bind fail; anything
+    // other than a socket at the path is left alone
+    struct stat st;
+    if (lstat(lmtp_path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(lmtp_path_.c_str());
+    }
+
+    worker.lmtp_acceptor->open(stream_protocol());
+    worker.lmtp_acceptor->bind(stream_protocol::endpoint(lmtp_path_));
+    if (chmod(lmtp_path_.c_str(), static_cast<mode_t>(lmtp_mode_)) != 0) {
+        logger_->warning("Failed to set permissions of LMTP socket " + lmtp_path_);
+    }
+    worker.lmtp_acceptor->listen();
+}
+
+void SMTPServer::restart(const std::vector<std::unique_ptr<Worker>>& workers) {
+    std::vector<int> listeners;
+    for (const auto& worker : workers) {
+        listeners.push_back(worker->acceptor.native_handle());
+    }
+    if (workers.front()->lmtp_acceptor) {
+        listeners.push_back(workers.front()->lmtp_acceptor->native_handle());
+    }
+
+    // The successor appends to the same capture file from its first session
+    if (capture_) {
+        capture_->stop();
+    }
+
+    handoff_fd_ = HotRestart::spawnSuccessor(listeners, logger_);
+    if (handoff_fd_ < 0) {
+        if (capture_) {
+            capture_->resume();
+        }
+        logger_->error("Hot restart aborted, continuing to serve");
+        return;
+    }
+
+    // The successor accepts on the same sockets; stop accepting here and drain
+    shutdown();
+}
+
+bool SMTPServer::openRing(Worker& worker, std::string& error) {
+    std::unique_ptr<IoUring> ring(new IoUring(ACCEPT_RING_ENTRIES));
+    if (!ring->isAvailable()) {
+        error = ring->error();
         return false;
     }
+
+    // Completions wake the io_context through an eventfd, so sessions keep
+    // running on the same thread as with epoll
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || !ring->registerEventFd(event_fd)) {
+        error = std::string("cannot register eventfd: ") + std::strerror(errno);
+        if (event_fd >= 0) ::close(event_fd);
+        return false;
+    }
+
+    worker.ring_event.reset(new boost::asio::posix::stream_descriptor(worker.io_context, event_fd));
+    worker.ring = std::move(ring);
+    return true;
 }
 
-void SMTPServer::handleConnection(tcp::socket& socket) {
-    try {
-        tcp::endpoint remote_ep = socket.remote_endpoint();
-        std::ostringstream conn_msg;
-        conn_msg << "Connection from " << remote_ep.address().to_string()
-                 << ":" << remote_ep.port();
-        logger_->info(conn_msg.str());
+void SMTPServer::startAccept(Worker& worker) {
+    if (worker.ring) {
+        if (startRingAccept(worker)) return;
+        logger_->warning("io_uring accept failed, falling back to epoll");
+        boost::system::error_code ignored;
+        worker.ring_event->close(ignored);
+        worker.ring.reset();
+    }
+
+    worker.acceptor.async_accept(
+        [this, &worker](const boost::system::error_code& ec, tcp::socket socket) {
+            if (!ec) {
+                std::make_shared<SMTPSession>(std::move(socket), *this, worker.parser,
+                                              worker.sessions, logger_)->start();
+            } else if (ec != boost::asio::error::operation_aborted) {
+                logger_->error("Accept error: " + ec.message());
+            }
 
-        // Set socket timeout
-        struct timeval tv;
-        tv.tv_sec = 30;
-        tv.tv_usec = 0;
-        setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
-                  (const char*)&tv, sizeof(tv));
+            if (worker.acceptor.is_open()) {
+                startAccept(worker);
+            }
+        });
+}
 
-        // Send greeting
-        sendResponse(socket, "220 smtp2telegram ESMTP Service Ready\r\n");
+bool SMTPServer::startRingAccept(Worker& worker) {
+    // One request keeps accepting until it is cancelled or fails. A blocking
+    // listener would park the accept in a kernel worker thread instead of
+    // being polled
+    boost::system::error_code ec;
+    worker.acceptor.non_blocking(true, ec);
+    return !ec && worker.ring->prepareMultishotAccept(worker.acceptor.native_handle(), RING_ACCEPT) &&
+           worker.ring->submit() >= 0;
+}
 
-        boost::asio::streambuf buf;
-        std::string email_data;
+void SMTPServer::watchRing(Worker& worker) {
+    worker.ring_event->async_read_some(
+        boost::asio::buffer(&worker.ring_event_count, sizeof(worker.ring_event_count)),
+        [this, &worker](const boost::system::error_code& ec, size_t) {
+            if (ec) return;  // closed at shutdown or after falling back
 
-        while (!shutdown_requested_) {
-            buf.consume(buf.size());
-            std::string cmd;
+            if (!drainRing(worker)) {
+                watchRing(worker);
+                return;
+            }
 
-            if (!readCommand(socket, buf, cmd)) {
-                break;
+            // The accept is no longer armed; re-arm it, or use epoll if the
+            // kernel rejected it
+            if (!worker.acceptor.is_open()) return;
+            if (worker.ring && startRingAccept(worker)) {
+                watchRing(worker);
+                return;
             }
+            boost::system::error_code ignored;
+            worker.ring_event->close(ignored);
+            worker.ring.reset();
+            startAccept(worker);
+        });
+}
 
-            logger_->info("SMTP command: " + cmd);
-
-            if (cmd.find("EHLO") == 0 || cmd.find("ehlo") == 0) {
-                sendResponse(socket, "250-smtp2telegram greets you\r\n");
-                sendResponse(socket, "250-PIPELINING\r\n");
-                sendResponse(socket, "250-SIZE 35882577\r\n");
-                sendResponse(socket, "250-8BITMIME\r\n");
-                sendResponse(socket, "250-ENHANCEDSTATUSCODES\r\n");
-                sendResponse(socket, "250-CHUNKING\r\n");
-                sendResponse(socket, "250 HELP\r\n");
-            } else if (cmd.find("HELO") == 0 || cmd.find("helo") == 0) {
-                sendResponse(socket, "250 smtp2telegram greets you\r\n");
-            } else if (cmd.find("MAIL FROM:") == 0 || cmd.find("mail from:") == 0) {
-                sendResponse(socket, "250 OK\r\n");
-            } else if (cmd.find("RCPT TO:") == 0 || cmd.find("rcpt to:") == 0) {
-                sendResponse(socket, "250 OK\r\n");
-            } else if (cmd == "DATA" || cmd == "data") {
-                sendResponse(socket, "354 End data with <CR><LF>.<CR><LF>\r\n");
-
-                if (readData(socket, buf, email_data)) {
-                    // Parse and send email
-                    ParsedEmail parsed = parser_->parse(email_data);
-                    std::string telegram_msg = parser_->formatForTelegram(parsed);
-
-                    if (!telegram_msg.empty()) {
-                        if (telegram_->sendMessage(telegram_msg)) {
-                            logger_->info("Email forwarded to Telegram");
-                            sendResponse(socket, "250 OK: Message accepted\r\n");
-                        } else {
-                            logger_->error("Failed to forward email to Telegram");
-                            sendResponse(socket, "451 Temporary failure\r\n");
-                        }
-                    } else {
-                        logger_->warning("Empty email received");
-                        sendResponse(socket, "250 OK: Empty message accepted\r\n");
-                    }
-                } else {
-                    sendResponse(socket, "451 Requested action aborted: local error in processing\r\n");
-                }
-            } else if (cmd == "QUIT" || cmd == "quit") {
-                sendResponse(socket, "221 Bye\r\n");
-                break;
-            } else if (cmd == "RSET" || cmd == "rset") {
-                email_data.clear();
-                sendResponse(socket, "250 OK\r\n");
-            } else if (cmd == "NOOP" || cmd == "noop") {
-                sendResponse(socket, "250 OK\r\n");
-            } else if (cmd.empty()) {
-                // Ignore empty commands
+bool SMTPServer::drainRing(Worker& worker) {
+    bool ended = false;
+    IoCompletion completion;
+    while (worker.ring && worker.ring->popCompletion(completion)) {
+        if (completion.user_data != RING_ACCEPT) continue;
+        if (!completion.more) ended = true;
+
+        if (completion.result >= 0) {
+            tcp::socket socket(worker.io_context);
+            boost::system::error_code ec;
+            socket.assign(worker.acceptor.local_endpoint(ec).protocol(), completion.result, ec);
+            if (ec) {
+                ::close(completion.result);
+                logger_->error("Accept error: " + ec.message());
                 continue;
-            } else {
-                // Unknown command, but be lenient
-                logger_->warning("Unknown command: " + cmd);
-                sendResponse(socket, "250 OK\r\n");
             }
+            std::make_shared<SMTPSession>(std::move(socket), *this, worker.parser,
+                                          worker.sessions, logger_)->start();
+        } else if (completion.result == -EINVAL) {
+            // Multishot accept needs Linux 5.19
+            logger_->warning("Kernel does not support io_uring multishot accept, falling back to epoll");
+            worker.ring.reset();
+        } else if (completion.result != -ECANCELED) {
+            logger_->error("Accept error: " + std::string(std::strerror(-completion.result)));
         }
+    }
+    return ended;
+}
 
+void SMTPServer::startAcceptLmtp(Worker& worker) {
+    worker.lmtp_acceptor->async_accept(
+        [this, &worker](const boost::system::error_code& ec, stream_protocol::socket socket) {
+            if (!ec) {
+                std::make_shared<SMTPSession>(std::move(socket), *this, worker.parser,
+                                              worker.sessions, logger_)->start();
+            } else if (ec != boost::asio::error::operation_aborted) {
+                logger_->error("LMTP accept error: " + ec.message());
+            }
+
+            if (worker.lmtp_acceptor->is_open()) {
+                startAcceptLmtp(worker);
+            }
+        });
+}
+
+void SMTPServer::watchShutdown(Worker& worker) {
+    // Signal handlers only set a flag; poll it from inside the event loop
+    worker.shutdown_timer.expires_after(std::chrono::milliseconds(100));
+    worker.shutdown_timer.async_wait([this, &worker](const boost::system::error_code& ec) {
+        if (ec) return;
+
+        if (!shutdown_requested_) {
+            watchShutdown(worker);
+            return;
+        }
+
+        boost::system::error_code ignored;
+        if (worker.ring) {
+            // The ring holds its own reference to the listening socket: cancel
+            // the accept so a hot-restart successor gets every new connection,
+            // and start sessions for connections accepted meanwhile
+            worker.ring->prepareCancel(RING_ACCEPT, RING_CANCEL);
+            worker.ring->submit(1);
+            drainRing(worker);
+            worker.ring_event->close(ignored);
+        }
+        worker.acceptor.close(ignored);
+        if (worker.lmtp_acceptor) {
+            // The socket file stays: a hot-restart successor is accepting on it
+            worker.lmtp_acceptor->close(ignored);
+        }
+
+        // Idle sessions close now, busy ones after their current transaction
+        SMTPSession::Registry sessions = worker.sessions;
+        for (auto* session : sessions) {
+            session->requestClose();
+        }
+    });
+}
+
+void SMTPServer::runWorker(Worker& worker, int index) {
+    if (pin_cpus_) {
+        // Only CPUs the process may run on (taskset, cgroup cpusets) are used
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        std::vector<int> usable;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) usable.push_back(cpu);
+            }
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        if (!usable.empty()) {
+            CPU_SET(usable[index % usable.size()], &cpus);
+        }
+        if (usable.empty() || pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            logger_->warning("Failed to pin SMTP worker " + std::to_string(index) + " to a CPU");
+        }
+    }
+
+    try {
+        worker.io_context.run();
     } catch (const std::exception& e) {
-        logger_->error("Connection error: " + std::string(e.what()));
+        logger_->error("SMTP worker " + std::to_string(index) + " error: " + std::string(e.what()));
     }
 }
 
 void SMTPServer::run() {
     try {
-        boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context,
-                               tcp::endpoint(boost::asio::ip::make_address(hostname_), port_));
+        // Sockets from systemd or a previous process are used as-is; a
+        // Unix-domain one is the LMTP listener
+        std::vector<int> inherited;
+        int inherited_lmtp = -1;
+        for (int fd : HotRestart::inheritedListeners()) {
+            if (!isUnixSocket(fd)) {
+                inherited.push_back(fd);
+            } else if (inherited_lmtp < 0 && !lmtp_path_.empty()) {
+                inherited_lmtp = fd;
+            } else {
+                ::close(fd);
+            }
+        }
+        if (!inherited.empty() && static_cast<int>(inherited.size()) > worker_count_) {
+            // Every inherited socket needs an acceptor or its connections stall
+            worker_count_ = static_cast<int>(inherited.size());
+        }
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (int i = 0; i < worker_count_; ++i) {
+            workers.emplace_back(new Worker(*parser_));
+            if (inherited.empty()) {
+                openAcceptor(*workers.back(), worker_count_ > 1);
+            } else if (i < static_cast<int>(inherited.size())) {
+                assignAcceptor(*workers.back(), inherited[i]);
+            } else {
+                assignAcceptor(*workers.back(), dup(inherited[i % inherited.size()]));
+            }
+        }
 
         std::ostringstream listen_msg;
         listen_msg << "Starting SMTP server on " << hostname_ << ":" << port_;
+        if (worker_count_ > 1) {
+            listen_msg << " (" << worker_count_ << " workers)";
+        }
+        if (!inherited.empty()) {
+            listen_msg << " using " << inherited.size() << " inherited socket(s)";
+        }
         logger_->info(listen_msg.str());
 
-        while (!shutdown_requested_) {
-            tcp::socket socket(io_context);
-
-            // Use async accept with timeout to allow checking shutdown flag
-            boost::system::error_code ec;
+        if (!lmtp_path_.empty()) {
+            openLmtpAcceptor(*workers.front(), inherited_lmtp);
+            logger_->info("Accepting LMTP on " + lmtp_path_ + (inherited_lmtp >= 0 ? " (inherited socket)" : ""));
+        }
 
-            // Set acceptor to non-blocking mode
-            acceptor.non_blocking(true);
-
-            // Try to accept with polling
-            while (!shutdown_requested_) {
-                ec.clear();
-                acceptor.accept(socket, ec);
-
-                if (!ec) {
-                    // Successfully accepted a connection
-                    break;
-                } else if (ec == boost::asio::error::would_block) {
-                    // No connection yet, sleep briefly and check shutdown flag
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    continue;
-                } else {
-                    // Real error
-                    logger_->error("Accept error: " + ec.message());
-                    break;
+        if (io_uring_) {
+            std::string error;
+            for (auto& worker : workers) {
+                if (!openRing(*worker, error)) break;
+            }
+            if (!error.empty()) {
+                logger_->warning("io_uring unavailable (" + error + "), accepting through epoll");
+                for (auto& worker : workers) {
+                    worker->ring_event.reset();
+                    worker->ring.reset();
                 }
+            } else {
+                logger_->info("Accepting through io_uring multishot accept");
             }
+        }
 
-            if (shutdown_requested_ || ec) {
-                break;
+        for (int i = 0; i < worker_count_; ++i) {
+            Worker& worker = *workers[i];
+            startAccept(worker);
+            if (worker.ring) {
+                watchRing(worker);
+            }
+            if (worker.lmtp_acceptor) {
+                startAcceptLmtp(worker);
             }
+            watchShutdown(worker);
+            worker.thread = std::thread(&SMTPServer::runWorker, this, std::ref(worker), i);
+        }
 
-            handleConnection(socket);
+        HotRestart::notifySystemd("READY=1");
+        HotRestart::notifyPredecessor();
 
-            // Close socket
-            try {
-                socket.close();
-            } catch (...) {
-                // Ignore close errors
+        while (!shutdown_requested_) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (restart_requested_.exchange(false)) {
+                logger_->info("Hot restart requested");
+                restart(workers);
             }
         }
+        logger_->info("Shutdown requested");
+
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
 
         logger_->info("SMTP server stopped");
 
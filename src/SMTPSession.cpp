@@ -0,0 +1,728 @@
+// SMTPSession.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Asynchronous SMTP session implementation
+
+#include "../includes/SMTPSession.h"
+#include "../includes/SMTPServer.h"
+#include "../includes/Logger.h"
+#include "../includes/AdmissionControl.h"
+#include "../includes/SessionCapture.h"
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cctype>
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+// Advertised in EHLO as SIZE; also bounds DATA and BDAT accumulation
+const size_t MAX_MESSAGE_SIZE = 35882577;
+
+// DATA is read and accounted in pieces of at most this size
+const size_t DATA_READ_SIZE = 65536;
+
+// Longest command line accepted, without its CRLF
+const size_t MAX_COMMAND_LINE = 4096;
+
+// Bound of the read buffer: a command line, or one read of message data
+// (message data moves into email_data_ as it arrives)
+const size_t READ_BUFFER_SIZE = MAX_COMMAND_LINE + DATA_READ_SIZE;
+
+// Terminator of DATA; the leading CRLF ends the last line of the message
+const char DATA_TERMINATOR[] = "\r\n.\r\n";
+const size_t DATA_TERMINATOR_LENGTH = 5;
+
+const char SIZE_EXCEEDED_REPLY[] = "552 5.3.4 Message size exceeds fixed maximum message size\r\n";
+const char STORAGE_REPLY[] = "452 4.3.1 Insufficient system storage, try again later\r\n";
+const char CONGESTED_REPLY[] = "452 4.3.1 Delivery queue full, try again later\r\n";
+const char TLS_REQUIRED_REPLY[] = "530 5.7.0 Must issue a STARTTLS command first\r\n";
+const char LINE_TOO_LONG_REPLY[] = "500 5.5.2 Line too long\r\n";
+
+SMTPSession::SMTPSession(tcp::socket socket,
+                         SMTPServer& server,
+                         EmailParser& parser,
+                         Registry& registry,
+                         std::shared_ptr<Logger> logger)
+    : socket_(std::move(socket)), timer_(socket_.get_executor()),
+      session_timer_(socket_.get_executor()), buf_(READ_BUFFER_SIZE),
+      server_(server), parser_(parser), registry_(registry), logger_(logger),
+      timeouts_(server.sessionTimeouts()), admitted_(false), reserved_bytes_(0),
+      awaiting_command_(false), close_requested_(false), closed_(false), capture_(nullptr), capture_id_(0) {
+    registry_.insert(this);
+}
+
+SMTPSession::SMTPSession(stream_protocol::socket socket,
+                         SMTPServer& server,
+                         EmailParser& parser,
+                         Registry& registry,
+                         std::shared_ptr<Logger> logger)
+    : socket_(socket.get_executor()), local_(new stream_protocol::socket(std::move(socket))),
+      timer_(socket_.get_executor()), session_timer_(socket_.get_executor()),
+      buf_(READ_BUFFER_SIZE), server_(server), parser_(parser), registry_(registry),
+      logger_(logger), timeouts_(server.sessionTimeouts()), admitted_(false), reserved_bytes_(0),
+      awaiting_command_(false), close_requested_(false), closed_(false), capture_(nullptr), capture_id_(0) {
+    registry_.insert(this);
+}
+
+SMTPSession::~SMTPSession() {
+    releaseReservation();
+    if (capture_) {
+        capture_->close(capture_id_);
+    }
+    if (admitted_) {
+        server_.admission().releaseConnection(remote_address_);
+    }
+    registry_.erase(this);
+}
+
+void SMTPSession::start() {
+    if (local_) {
+        // Local clients all share the loopback address for admission limits
+        remote_address_ = boost::asio::ip::address_v6::loopback();
+        logger_->info("Connection on LMTP socket");
+    } else {
+        try {
+            tcp::endpoint remote_ep = socket_.remote_endpoint();
+            remote_address_ = remote_ep.address();
+            std::ostringstream conn_msg;
+            conn_msg << "Connection from " << remote_ep.address().to_string()
+                     << ":" << remote_ep.port();
+            logger_->info(conn_msg.str());
+        } catch (const std::exception& e) {
+            logger_->error("Connection error: " + std::string(e.what()));
+            return;
+        }
+    }
+
+    Admission admission = server_.admission().admitConnection(remote_address_);
+    if (admission != ADMIT) {
+        bool per_ip = admission == REJECT_PER_IP;
+        logger_->warning(std::string(per_ip ? "Too many connections from " : "Connection limit reached, refusing ") +
+                         remote_address_.to_string());
+        queueResponse(per_ip ? "421 4.7.0 Too many connections from your address, try again later\r\n"
+                             : "421 4.3.2 Too many connections, try again later\r\n");
+        auto self = shared_from_this();
+        flush([self]() { self->close(); });
+        return;
+    }
+    admitted_ = true;
+    armSessionTimer();
+
+    capture_ = server_.capture();
+    if (capture_) {
+        capture_id_ = capture_->open(local_ != nullptr);
+    }
+
+    queueResponse(local_ ? "220 smtp2telegram LMTP Service Ready\r\n"
+                         : "220 smtp2telegram ESMTP Service Ready\r\n");
+    processInput();
+}
+
+void SMTPSession::requestClose() {
+    close_requested_ = true;
+    if (awaiting_command_) {
+        close();
+    }
+}
+
+void SMTPSession::queueResponse(const std::string& response) {
+    pending_.push_back(response);
+}
+
+void SMTPSession::queueMessageReply(const std::string& reply) {
+    // RFC 2033: after the message, one reply for each successful RCPT, in
+    // order. All recipients share one delivery job, so they share its outcome
+    size_t replies = local_ && !recipients_.empty() ? recipients_.size() : 1;
+    for (size_t i = 0; i < replies; ++i) {
+        queueResponse(reply);
+    }
+}
+
+void SMTPSession::flush(std::function<void()> then) {
+    if (pending_.empty()) {
+        then();
+        return;
+    }
+
+    // Keep the strings alive until the write completes
+    writing_.swap(pending_);
+    pending_.clear();
+
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(writing_.size());
+    for (const auto& response : writing_) {
+        buffers.push_back(boost::asio::buffer(response));
+    }
+
+    auto self = shared_from_this();
+    withStream([&](auto& stream) {
+        boost::asio::async_write(stream, buffers,
+            [self, then](const boost::system::error_code& ec, size_t) {
+                self->writing_.clear();
+                if (ec) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        self->logger_->error("Failed to send response: " + ec.message());
+                    }
+                    self->close();
+                    return;
+                }
+                then();
+            });
+    });
+}
+
+bool SMTPSession::hasBufferedCommand() const {
+    auto data = buf_.data();
+    auto begin = boost::asio::buffers_begin(data);
+    auto end = boost::asio::buffers_end(data);
+    return std::find(begin, end, '\n') != end;
+}
+
+void SMTPSession::armTimer(int seconds, const char* phase) {
+    // Re-arming cancels the previous phase's deadline
+    timer_.expires_after(std::chrono::seconds(seconds));
+
+    std::weak_ptr<SMTPSession> weak = shared_from_this();
+    timer_.async_wait([weak, phase](const boost::system::error_code& ec) {
+        auto self = weak.lock();
+        if (!ec && self) {
+            self->expire(phase);
+        }
+    });
+}
+
+void SMTPSession::armSessionTimer() {
+    if (timeouts_.session <= 0) return;
+
+    session_timer_.expires_after(std::chrono::seconds(timeouts_.session));
+
+    std::weak_ptr<SMTPSession> weak = shared_from_this();
+    session_timer_.async_wait([weak](const boost::system::error_code& ec) {
+        auto self = weak.lock();
+        if (!ec && self) {
+            self->expire("Session");
+        }
+    });
+}
+
+void SMTPSession::expire(const char* phase) {
+    if (closed_) return;
+    logger_->warning(std::string(phase) + " timeout, closing connection from " + remote_address_.to_string());
+
+    // Best effort: a client that stopped reading must not hold the session
+    // open (not attempted inside TLS, where a plaintext reply would be garbage)
+    if (writing_.empty() && !tls_) {
+        static const std::string reply = "421 4.4.2 smtp2telegram Timeout, closing connection\r\n";
+        boost::system::error_code ignored;
+        if (local_) {
+            local_->non_blocking(true, ignored);
+            local_->write_some(boost::asio::buffer(reply), ignored);
+        } else {
+            socket_.non_blocking(true, ignored);
+            socket_.write_some(boost::asio::buffer(reply), ignored);
+        }
+    }
+    close();
+}
+
+void SMTPSession::close() {
+    if (closed_) return;
+    closed_ = true;
+
+    boost::system::error_code ignored;
+    timer_.cancel();
+    session_timer_.cancel();
+    if (local_) {
+        local_->shutdown(stream_protocol::socket::shutdown_both, ignored);
+        local_->close(ignored);
+    } else {
+        socket_.shutdown(tcp::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+    }
+}
+
+void SMTPSession::processInput() {
+    if (closed_) return;
+
+    while (hasBufferedCommand()) {
+        if (close_requested_) {
+            queueResponse("421 smtp2telegram Service shutting down\r\n");
+            break;
+        }
+
+        std::string cmd;
+        std::istream is(&buf_);
+        std::getline(is, cmd);
+        if (!cmd.empty() && cmd.back() == '\r') {
+            cmd.pop_back();
+        }
+        if (cmd.size() > MAX_COMMAND_LINE) {
+            rejectLongLine();
+            return;
+        }
+        if (capture_) {
+            capture_->command(capture_id_, cmd);
+        }
+
+        if (!handleCommand(cmd)) {
+            return;
+        }
+    }
+
+    auto self = shared_from_this();
+    if (close_requested_) {
+        flush([self]() { self->close(); });
+        return;
+    }
+
+    // RFC 2920: replies may be held back only while more commands are buffered
+    flush([self]() { self->readCommand(); });
+}
+
+void SMTPSession::readCommand() {
+    awaiting_command_ = true;
+    armTimer(timeouts_.command, "Command");
+
+    auto self = shared_from_this();
+    withStream([&](auto& stream) {
+        boost::asio::async_read_until(stream, buf_, "\r\n",
+            [self](const boost::system::error_code& ec, size_t) {
+                self->awaiting_command_ = false;
+                if (ec == boost::asio::error::not_found) {
+                    // The buffer filled up without a line ending
+                    self->rejectLongLine();
+                    return;
+                }
+                if (ec) {
+                    if (ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted) {
+                        self->logger_->error("Error reading command: " + ec.message());
+                    }
+                    self->close();
+                    return;
+                }
+                self->processInput();
+            });
+    });
+}
+
+void SMTPSession::rejectLongLine() {
+    logger_->warning("Command line too long, closing connection from " + remote_address_.to_string());
+    queueResponse(LINE_TOO_LONG_REPLY);
+    auto self = shared_from_this();
+    flush([self]() { self->close(); });
+}
+
+void SMTPSession::startTls() {
+    // RFC 3207: anything the client pipelined after STARTTLS is discarded
+    buf_.consume(buf_.size());
+    tls_.reset(new boost::asio::ssl::stream<tcp::socket&>(socket_, *server_.tlsContext()));
+    armTimer(timeouts_.command, "TLS handshake");
+
+    auto self = shared_from_this();
+    tls_->async_handshake(boost::asio::ssl::stream_base::server,
+        [self](const boost::system::error_code& ec) {
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted) {
+                    self->logger_->error("TLS handshake failed: " + ec.message());
+                }
+                self->close();
+                return;
+            }
+
+            // The client starts over with EHLO; no earlier state survives
+            self->resetTransaction();
+            SSL* ssl = self->tls_->native_handle();
+            self->logger_->info(std::string("TLS established (") + SSL_get_version(ssl) +
+                                (SSL_session_reused(ssl) ? ", resumed)" : ")"));
+            self->readCommand();
+        });
+}
+
+void SMTPSession::readData() {
+    // Empty message: terminator immediately follows the DATA line
+    if (buf_.size() < 3) {
+        auto self = shared_from_this();
+        withStream([&](auto& stream) {
+            boost::asio::async_read(stream, buf_, boost::asio::transfer_at_least(3 - buf_.size()),
+                [self](const boost::system::error_code& ec, size_t) {
+                    if (ec) {
+                        if (ec != boost::asio::error::operation_aborted) {
+                            self->logger_->error("Error reading DATA: " + ec.message());
+                        }
+                        self->close();
+                        return;
+                    }
+                    self->readData();
+                });
+        });
+        return;
+    }
+
+    auto begin = boost::asio::buffers_begin(buf_.data());
+    if (std::string(begin, begin + 3) == ".\r\n") {
+        buf_.consume(3);
+        email_data_.clear();
+        finishData();
+        return;
+    }
+
+    readDataBody();
+}
+
+void SMTPSession::readDataBody() {
+    // Move what has arrived into the message, accounting for it as it comes,
+    // so a sender cannot make us buffer more than the limits allow
+    size_t arrived = buf_.size();
+    if (arrived > 0) {
+        size_t scan_from = email_data_.size() >= DATA_TERMINATOR_LENGTH - 1
+                               ? email_data_.size() - (DATA_TERMINATOR_LENGTH - 1) : 0;
+
+        if (data_reply_.empty()) {
+            if (email_data_.size() + arrived > MAX_MESSAGE_SIZE) {
+                logger_->error("DATA exceeds maximum message size");
+                data_reply_ = SIZE_EXCEEDED_REPLY;
+            } else {
+                reserve(arrived, STORAGE_REPLY);
+            }
+            if (!data_reply_.empty()) {
+                releaseReservation();
+            }
+        }
+
+        const char* data = static_cast<const char*>(buf_.data().data());
+        email_data_.append(data, arrived);
+        buf_.consume(arrived);
+
+        size_t end = email_data_.find(DATA_TERMINATOR, scan_from, DATA_TERMINATOR_LENGTH);
+        if (end != std::string::npos) {
+            // Anything after the terminator is pipelined commands
+            size_t rest = end + DATA_TERMINATOR_LENGTH;
+            std::ostream(&buf_).write(email_data_.data() + rest, email_data_.size() - rest);
+            email_data_.resize(end);
+            finishData();
+            return;
+        }
+
+        if (!data_reply_.empty()) {
+            // Discarding: keep only what could be the start of the terminator
+            email_data_.erase(0, email_data_.size() - std::min(email_data_.size(), DATA_TERMINATOR_LENGTH - 1));
+        }
+    }
+
+    auto self = shared_from_this();
+    withStream([&](auto& stream) {
+        stream.async_read_some(buf_.prepare(DATA_READ_SIZE),
+            [self](const boost::system::error_code& ec, size_t n) {
+                if (ec) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        self->logger_->error("Error reading DATA: " + ec.message());
+                    }
+                    self->close();
+                    return;
+                }
+                self->buf_.commit(n);
+                self->readDataBody();
+            });
+    });
+}
+
+void SMTPSession::finishData() {
+    if (capture_) {
+        capture_->data(capture_id_, email_data_.data(), email_data_.size());
+    }
+    if (data_reply_.empty()) {
+        queueMessageReply(server_.deliverEmail(parser_, email_data_, recipients_));
+    } else {
+        queueMessageReply(data_reply_);
+    }
+    resetTransaction();
+
+    // Sync point: the reply to the message is not held back
+    auto self = shared_from_this();
+    flush([self]() { self->processInput(); });
+}
+
+bool SMTPSession::reserve(size_t size, const std::string& reply) {
+    if (!server_.admission().reserveBytes(size)) {
+        logger_->warning("In-flight message data limit reached, deferring message");
+        data_reply_ = reply;
+        return false;
+    }
+    reserved_bytes_ += size;
+    return true;
+}
+
+void SMTPSession::releaseReservation() {
+    if (reserved_bytes_ > 0) {
+        server_.admission().releaseBytes(reserved_bytes_);
+        reserved_bytes_ = 0;
+    }
+}
+
+void SMTPSession::resetTransaction() {
+    // Give the buffer back; an idle session should not pin a large message
+    std::string().swap(email_data_);
+    data_reply_.clear();
+    recipients_.clear();
+    releaseReservation();
+}
+
+void SMTPSession::readChunk(size_t size, size_t remaining, bool last) {
+    // Move the chunk into the message as it arrives; buf_ holds one read at most
+    size_t available = std::min(remaining, buf_.size());
+    if (available > 0) {
+        const char* data = static_cast<const char*>(buf_.data().data());
+        email_data_.append(data, available);
+        if (capture_) {
+            capture_->chunk(capture_id_, data, available);
+        }
+        buf_.consume(available);
+        remaining -= available;
+    }
+
+    if (remaining == 0) {
+        finishChunk(size, last);
+        return;
+    }
+
+    auto self = shared_from_this();
+    size_t want = std::min(remaining, DATA_READ_SIZE);
+    withStream([&](auto& stream) {
+        boost::asio::async_read(stream, buf_, boost::asio::transfer_at_least(want),
+            [self, size, remaining, last](const boost::system::error_code& ec, size_t) {
+                if (ec) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        self->logger_->error("Error reading BDAT chunk: " + ec.message());
+                    }
+                    self->close();
+                    return;
+                }
+                self->readChunk(size, remaining, last);
+            });
+    });
+}
+
+void SMTPSession::discardChunk(size_t remaining, bool last) {
+    size_t available = std::min(remaining, buf_.size());
+    if (capture_ && available > 0) {
+        capture_->chunk(capture_id_, static_cast<const char*>(buf_.data().data()), available);
+    }
+    buf_.consume(available);
+    remaining -= available;
+
+    if (remaining == 0) {
+        // The failure reply is repeated for every chunk up to the last one
+        if (last) {
+            queueMessageReply(data_reply_);
+            resetTransaction();
+        } else {
+            queueResponse(data_reply_);
+        }
+        auto self = shared_from_this();
+        flush([self]() { self->processInput(); });
+        return;
+    }
+
+    auto self = shared_from_this();
+    size_t want = std::min(remaining, DATA_READ_SIZE);
+    withStream([&](auto& stream) {
+        boost::asio::async_read(stream, buf_, boost::asio::transfer_at_least(want),
+            [self, remaining, last](const boost::system::error_code& ec, size_t) {
+                if (ec) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        self->logger_->error("Error reading BDAT chunk: " + ec.message());
+                    }
+                    self->close();
+                    return;
+                }
+                self->discardChunk(remaining, last);
+            });
+    });
+}
+
+void SMTPSession::finishChunk(size_t size, bool last) {
+    if (!last) {
+        queueResponse("250 OK: " + std::to_string(size) + " octets received\r\n");
+        processInput();
+        return;
+    }
+
+    queueMessageReply(server_.deliverEmail(parser_, email_data_, recipients_));
+    resetTransaction();
+
+    auto self = shared_from_this();
+    flush([self]() { self->processInput(); });
+}
+
+size_t SMTPSession::declaredSize(const std::string& command) const {
+    // SIZE=n parameter of MAIL FROM (RFC 1870)
+    std::string upper = command;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    size_t pos = upper.find(" SIZE=");
+    if (pos == std::string::npos) return 0;
+    return static_cast<size_t>(std::strtoull(command.c_str() + pos + 6, nullptr, 10));
+}
+
+std::string SMTPSession::extractAddress(const std::string& command) const {
+    size_t colon = command.find(':');
+    if (colon == std::string::npos) return "";
+
+    std::string arg = command.substr(colon + 1);
+    size_t open = arg.find('<');
+    if (open != std::string::npos) {
+        size_t close = arg.find('>', open);
+        return arg.substr(open + 1, close == std::string::npos ? std::string::npos : close - open - 1);
+    }
+
+    // Bare address, possibly followed by ESMTP parameters
+    size_t start = arg.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = arg.find_first_of(" \t", start);
+    return arg.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+bool SMTPSession::startsTransaction(const std::string& cmd) const {
+    static const char* const verbs[] = {"MAIL", "RCPT", "DATA", "BDAT"};
+    for (const char* verb : verbs) {
+        if (cmd.size() >= 4 && std::equal(verb, verb + 4, cmd.begin(), [](char a, char b) {
+                return a == std::toupper(static_cast<unsigned char>(b));
+            })) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SMTPSession::handleCommand(const std::string& cmd) {
+    logger_->info("SMTP command: " + cmd);
+
+    auto self = shared_from_this();
+
+    // The Unix-domain socket is local; TLS is neither offered nor required
+    if (server_.isTlsRequired() && !tls_ && !local_ && startsTransaction(cmd)) {
+        // A refused BDAT chunk would be read as commands; end the session
+        queueResponse(TLS_REQUIRED_REPLY);
+        if (cmd.find("BDAT ") == 0 || cmd.find("bdat ") == 0) {
+            flush([self]() { self->close(); });
+            return false;
+        }
+        return true;
+    }
+
+    if (local_ && (cmd.find("EHLO") == 0 || cmd.find("ehlo") == 0 ||
+                   cmd.find("HELO") == 0 || cmd.find("helo") == 0)) {
+        queueResponse("500 5.5.1 LMTP requires LHLO\r\n");
+    } else if (local_ ? cmd.find("LHLO") == 0 || cmd.find("lhlo") == 0
+                      : cmd.find("EHLO") == 0 || cmd.find("ehlo") == 0) {
+        queueResponse("250-smtp2telegram greets you\r\n"
+                      "250-PIPELINING\r\n"
+                      "250-SIZE 35882577\r\n"
+                      "250-8BITMIME\r\n"
+                      "250-ENHANCEDSTATUSCODES\r\n"
+                      "250-CHUNKING\r\n");
+        if (server_.tlsContext() && !tls_ && !local_) {
+            queueResponse("250-STARTTLS\r\n");
+        }
+        queueResponse("250 HELP\r\n");
+    } else if (cmd == "STARTTLS" || cmd == "starttls") {
+        if (!server_.tlsContext() || local_) {
+            queueResponse("502 5.5.1 STARTTLS not supported\r\n");
+        } else if (tls_) {
+            queueResponse("503 5.5.1 TLS already active\r\n");
+        } else {
+            queueResponse("220 2.0.0 Ready to start TLS\r\n");
+            flush([self]() { self->startTls(); });
+            return false;
+        }
+    } else if (cmd.find("HELO") == 0 || cmd.find("helo") == 0) {
+        queueResponse("250 smtp2telegram greets you\r\n");
+    } else if (cmd.find("MAIL FROM:") == 0 || cmd.find("mail from:") == 0) {
+        resetTransaction();
+
+        // Refuse early when the message cannot be accepted anyway
+        size_t declared = declaredSize(cmd);
+        if (declared > MAX_MESSAGE_SIZE) {
+            queueResponse(SIZE_EXCEEDED_REPLY);
+        } else if (!server_.admission().hasRoomFor(declared)) {
+            queueResponse(STORAGE_REPLY);
+        } else if (server_.admission().isCongested()) {
+            queueResponse(CONGESTED_REPLY);
+        } else {
+            queueResponse("250 OK\r\n");
+        }
+    } else if (cmd.find("RCPT TO:") == 0 || cmd.find("rcpt to:") == 0) {
+        recipients_.push_back(extractAddress(cmd));
+        queueResponse("250 OK\r\n");
+    } else if (cmd == "DATA" || cmd == "data") {
+        if (local_ && recipients_.empty()) {
+            // RFC 2033: with no recipient there is nobody to report to
+            queueResponse("503 5.5.1 No valid recipients\r\n");
+            return true;
+        }
+        if (server_.admission().isCongested()) {
+            resetTransaction();
+            queueResponse(CONGESTED_REPLY);
+            return true;
+        }
+
+        // Sync point: the client waits for 354 before sending the message;
+        // the whole message must then arrive within the DATA deadline, however
+        // it is trickled
+        queueResponse("354 End data with <CR><LF>.<CR><LF>\r\n");
+        flush([self]() {
+            self->armTimer(self->timeouts_.data, "DATA");
+            self->readData();
+        });
+        return false;
+    } else if (cmd.find("BDAT ") == 0 || cmd.find("bdat ") == 0) {
+        std::istringstream args(cmd.substr(5));
+        size_t chunk_size = 0;
+        std::string last;
+        if (!(args >> chunk_size)) {
+            queueResponse("501 Syntax error in BDAT parameters\r\n");
+            return true;
+        }
+        args >> last;
+        bool is_last = last == "LAST" || last == "last";
+        armTimer(timeouts_.data, "BDAT");
+
+        // A refused chunk must still be drained from the stream
+        if (data_reply_.empty()) {
+            if (email_data_.size() + chunk_size > MAX_MESSAGE_SIZE) {
+                data_reply_ = SIZE_EXCEEDED_REPLY;
+            } else if (email_data_.empty() && server_.admission().isCongested()) {
+                data_reply_ = CONGESTED_REPLY;
+            } else {
+                reserve(chunk_size, STORAGE_REPLY);
+            }
+        }
+        if (!data_reply_.empty()) {
+            std::string().swap(email_data_);
+            releaseReservation();
+            discardChunk(chunk_size, is_last);
+        } else {
+            readChunk(chunk_size, chunk_size, is_last);
+        }
+        return false;
+    } else if (cmd == "QUIT" || cmd == "quit") {
+        queueResponse("221 Bye\r\n");
+        flush([self]() { self->close(); });
+        return false;
+    } else if (cmd == "RSET" || cmd == "rset") {
+        resetTransaction();
+        queueResponse("250 OK\r\n");
+    } else if (cmd == "NOOP" || cmd == "noop") {
+        queueResponse("250 OK\r\n");
+    } else if (cmd.empty()) {
+        // Ignore empty commands
+    } else {
+        // Unknown command, but be lenient
+        logger_->warning("Unknown command: " + cmd);
+        queueResponse("250 OK\r\n");
+    }
+
+    return true;
+}
@@ -0,0 +1,208 @@
+// SessionCapture.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Capture file writer and reader
+
+#include "../includes/SessionCapture.h"
+#include "../includes/Config.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const char CAPTURE_MAGIC[] = "S2TCAP1\n";
+const size_t CAPTURE_MAGIC_LENGTH = 8;
+
+// Records are written in blocks of about this size
+const size_t CAPTURE_FLUSH_SIZE = 64 * 1024;
+
+namespace {
+
+int64_t nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+} // namespace
+
+SessionCapture::SessionCapture(const std::string& path, uint64_t max_bytes)
+    : max_bytes_(max_bytes), fd_(-1), written_(0), last_time_us_(0), next_session_(1), stopped_(false),
+      paused_(false) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        std::string reason = std::strerror(errno);
+        if (fd_ >= 0) ::close(fd_);
+        throw ConfigException("Cannot open capture file " + path + ": " + reason);
+    }
+
+    written_ = static_cast<uint64_t>(st.st_size);
+    if (written_ == 0) {
+        buffer_.append(CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH);
+        written_ = CAPTURE_MAGIC_LENGTH;
+    }
+
+    // Start a new segment: absolute time, session ids from 1 again
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_START, 0, nullptr, 0);
+}
+
+SessionCapture::~SessionCapture() {
+    stop();
+    ::close(fd_);
+}
+
+uint64_t SessionCapture::open(bool lmtp) {
+    uint64_t session = next_session_.fetch_add(1, std::memory_order_relaxed);
+    const char* protocol = lmtp ? "lmtp" : "smtp";
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_OPEN, session, protocol, 4);
+    return session;
+}
+
+void SessionCapture::command(uint64_t session, const std::string& line) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_COMMAND, session, line.data(), line.size());
+}
+
+void SessionCapture::data(uint64_t session, const char* data, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_DATA, session, data, length);
+}
+
+void SessionCapture::chunk(uint64_t session, const char* data, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_CHUNK, session, data, length);
+}
+
+void SessionCapture::close(uint64_t session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(CAPTURE_CLOSE, session, nullptr, 0);
+}
+
+void SessionCapture::stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writeBuffer();
+    paused_ = true;
+}
+
+void SessionCapture::resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    paused_ = false;
+}
+
+void SessionCapture::append(CaptureRecordType type, uint64_t session, const char* data, size_t length) {
+    if (stopped_ || paused_) return;
+
+    int64_t now = nowMicros();
+    uint64_t time = type == CAPTURE_START ? static_cast<uint64_t>(now)
+                                          : static_cast<uint64_t>(std::max<int64_t>(now - last_time_us_, 0));
+
+    std::string header;
+    header += static_cast<char>(type);
+    putVarint(header, session);
+    putVarint(header, time);
+    putVarint(header, length);
+
+    // Stop cleanly at a record boundary so the file stays readable
+    if (max_bytes_ > 0 && written_ + header.size() + length > max_bytes_) {
+        stopped_ = true;
+        return;
+    }
+
+    buffer_ += header;
+    buffer_.append(data ? data : "", length);
+    written_ += header.size() + length;
+    last_time_us_ = std::max(now, last_time_us_);
+
+    if (buffer_.size() >= CAPTURE_FLUSH_SIZE) {
+        writeBuffer();
+    }
+}
+
+void SessionCapture::writeBuffer() {
+    // One append per block of whole records
+    const char* data = buffer_.data();
+    size_t length = buffer_.size();
+    while (length > 0) {
+        ssize_t written = ::write(fd_, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            stopped_ = true;
+            break;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    buffer_.clear();
+}
+
+CaptureReader::CaptureReader(const std::string& path) : file_(nullptr), time_us_(0), segment_(0) {
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) {
+        throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+    }
+
+    char magic[CAPTURE_MAGIC_LENGTH];
+    if (std::fread(magic, 1, CAPTURE_MAGIC_LENGTH, file_) != CAPTURE_MAGIC_LENGTH ||
+        std::memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+        std::fclose(file_);
+        throw std::runtime_error(path + " is not a session capture file");
+    }
+}
+
+CaptureReader::~CaptureReader() {
+    std::fclose(file_);
+}
+
+bool CaptureReader::readVarint(uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = std::fgetc(file_);
+        if (c == EOF) return false;
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+bool CaptureReader::next(CaptureRecord& record) {
+    for (;;) {
+        int type = std::fgetc(file_);
+        uint64_t session, time, length;
+        if (type == EOF || type > CAPTURE_CLOSE ||
+            !readVarint(session) || !readVarint(time) || !readVarint(length)) {
+            return false;
+        }
+
+        record.data.resize(length);
+        if (length > 0 && std::fread(&record.data[0], 1, length, file_) != length) {
+            return false;
+        }
+
+        if (type == CAPTURE_START) {
+            time_us_ = static_cast<int64_t>(time);
+            ++segment_;
+            continue;
+        }
+
+        time_us_ += static_cast<int64_t>(time);
+        record.type = static_cast<CaptureRecordType>(type);
+        record.session = (segment_ << 40) | session;
+        record.time_us = time_us_;
+        return true;
+    }
+}
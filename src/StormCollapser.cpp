@@ -0,0 +1,210 @@
+// StormCollapser.cpp
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Alert storm grouping and debounced message edits
+
+#include "../includes/StormCollapser.h"
+#include "../includes/EmailParser.h"
+#include "../includes/Logger.h"
+#include "../includes/Config.h"
+#include <sstream>
+#include <functional>
+
+StormCollapser::StormCollapser(const std::string& fields, int window_seconds, int edit_interval,
+                               size_t max_groups, std::shared_ptr<Logger> logger)
+    : window_(window_seconds), edit_interval_(edit_interval), max_groups_(max_groups),
+      use_subject_(false), use_from_(false), use_to_(false), logger_(logger), collapsed_(0),
+      stopping_(false) {
+    std::istringstream stream(fields);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+        field.erase(0, field.find_first_not_of(" \t"));
+        field.erase(field.find_last_not_of(" \t") + 1);
+
+        if (field == "subject") use_subject_ = true;
+        else if (field == "from") use_from_ = true;
+        else if (field == "to") use_to_ = true;
+        else if (!field.empty()) throw ConfigException("Unknown STORM_FIELDS entry: " + field);
+    }
+
+    if (!use_subject_ && !use_from_ && !use_to_) {
+        throw ConfigException("STORM_FIELDS must name at least one of subject, from, to");
+    }
+
+    editor_ = std::thread(&StormCollapser::editLoop, this);
+}
+
+StormCollapser::~StormCollapser() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    editor_.join();
+}
+
+uint64_t StormCollapser::key(const ParsedEmail& email, const std::vector<std::string>& chat_ids) const {
+    // Field tags keep e.g. subject "a" + from "b" distinct from subject "ab"
+    std::string key;
+    if (use_subject_) key += 'S' + email.subject + '\0';
+    if (use_from_) key += 'F' + email.from + '\0';
+    if (use_to_) key += 'T' + email.to + '\0';
+    for (const auto& chat_id : chat_ids) {
+        key += 'C' + chat_id + '\0';
+    }
+    return std::hash<std::string>()(key);
+}
+
+bool StormCollapser::collapse(uint64_t key) {
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = groups_.find(key);
+    if (it != groups_.end() && now - it->second.opened < window_) {
+        Group& group = it->second;
+        ++group.count;
+        group.last_at = std::time(nullptr);
+        ++collapsed_;
+        if (group.posted) wake_.notify_one();
+        return true;
+    }
+
+    if (it == groups_.end()) {
+        if (groups_.size() >= max_groups_) evict(now);
+        it = groups_.emplace(key, Group()).first;
+    }
+
+    Group& group = it->second;
+    group.opened = now;
+    group.last_edit = now;
+    group.last_at = std::time(nullptr);
+    group.count = 1;
+    group.shown = 1;
+    group.posted = false;
+    group.message.clear();
+    group.chat_ids.clear();
+    group.sent.clear();
+    group.telegram.reset();
+    return false;
+}
+
+void StormCollapser::posted(uint64_t key, const std::string& message, const std::vector<std::string>& chat_ids,
+                            const std::vector<TelegramSent>& sent, std::shared_ptr<TelegramClient> telegram) {
+    bool any = false;
+    for (const auto& entry : sent) {
+        if (entry.message_id) any = true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = groups_.find(key);
+    if (it == groups_.end()) return;  // evicted meanwhile
+
+    Group& group = it->second;
+    if (!any) {
+        drop(it);
+        return;
+    }
+
+    group.posted = true;
+    group.message = message;
+    group.chat_ids = chat_ids;
+    group.sent = sent;
+    group.telegram = telegram;
+    if (group.count > group.shown) wake_.notify_one();
+}
+
+void StormCollapser::abandon(uint64_t key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = groups_.find(key);
+    if (it != groups_.end() && !it->second.posted) drop(it);
+}
+
+void StormCollapser::drop(std::unordered_map<uint64_t, Group>::iterator it) {
+    // Nothing to edit; the next message opens a new group and is sent
+    if (it->second.count > 1) {
+        logger_->warning("Alert group closed before posting, " + std::to_string(it->second.count - 1) +
+                         " repeat(s) collapsed into it are lost");
+    }
+    groups_.erase(it);
+}
+
+uint64_t StormCollapser::collapsedCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return collapsed_;
+}
+
+void StormCollapser::evict(std::chrono::steady_clock::time_point now) {
+    // Closed groups first; if all are open, the oldest one
+    auto oldest = groups_.end();
+    for (auto it = groups_.begin(); it != groups_.end();) {
+        const Group& group = it->second;
+        if (now - group.opened >= window_ && group.count == group.shown) {
+            it = groups_.erase(it);
+            continue;
+        }
+        if (oldest == groups_.end() || group.opened < oldest->second.opened) oldest = it;
+        ++it;
+    }
+    if (groups_.size() >= max_groups_ && oldest != groups_.end()) {
+        groups_.erase(oldest);
+    }
+}
+
+std::string StormCollapser::footer(unsigned count, std::time_t last_at) {
+    char stamp[16];
+    struct tm local;
+    std::strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime_r(&last_at, &local));
+    return "\n\nrepeated ×" + std::to_string(count) + ", last at " + stamp;
+}
+
+void StormCollapser::editLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        // The group whose edit is due; when stopping, every pending one is
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + window_;
+        auto due = groups_.end();
+        for (auto it = groups_.begin(); it != groups_.end(); ++it) {
+            const Group& group = it->second;
+            if (!group.posted || group.count == group.shown) continue;
+            auto at = group.last_edit + edit_interval_;
+            if (at <= now || stopping_) {
+                due = it;
+                break;
+            }
+            if (at < next) next = at;
+        }
+
+        if (due == groups_.end()) {
+            if (stopping_) return;
+            wake_.wait_until(lock, next);
+            continue;
+        }
+
+        uint64_t key = due->first;
+        Group& group = due->second;
+        auto opened = group.opened;
+        std::string message = group.message + footer(group.count, group.last_at);
+        std::vector<std::string> chat_ids = group.chat_ids;
+        std::vector<TelegramSent> sent = group.sent;
+        std::shared_ptr<TelegramClient> telegram = group.telegram;
+        group.shown = group.count;
+        group.last_edit = now;
+
+        lock.unlock();
+        bool retry = false;
+        for (size_t i = 0; i < sent.size(); ++i) {
+            if (!sent[i].message_id) continue;
+            TelegramResult result = telegram->editMessage(chat_ids[i], sent[i], message);
+            if (result == TELEGRAM_FAILED || result == TELEGRAM_THROTTLED) retry = true;
+        }
+        lock.lock();
+
+        // Try again after the interval, unless the group has moved on
+        if (retry && !stopping_) {
+            auto it = groups_.find(key);
+            if (it != groups_.end() && it->second.opened == opened) it->second.shown = 0;
+        }
+    }
+}
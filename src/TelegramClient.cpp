@@ -6,16 +6,160 @@
 
 #include "../includes/TelegramClient.h"
 #include "../includes/Logger.h"
+#include "../includes/CharsetConverter.h"
 #include <curl/curl.h>
 #include <thread>
 #include <chrono>
+#include <future>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
 
 // Telegram message limit is 4096 characters
 const size_t TELEGRAM_MESSAGE_LIMIT = 4096;
 
-TelegramClient::TelegramClient(const std::string& api_key, const std::string& chat_id,
+// Captions of sendDocument are limited to 1024 characters
+const size_t TELEGRAM_CAPTION_LIMIT = 1024;
+
+// Room kept free in each part of a split message for the "(12/34)" marker
+const size_t SPLIT_MARKER_RESERVE = 32;
+
+// Larger images go out as documents; sendPhoto rejects them
+const size_t TELEGRAM_PHOTO_LIMIT = 10 * 1024 * 1024;
+
+// Sideline for a 429 that does not say how long to wait
+const int DEFAULT_RETRY_AFTER_SECONDS = 5;
+
+// Longest a send waits in line for a sidelined bot before it gives up
+// the attempt; the bot itself stays out as long as Telegram asked
+const int MAX_BOT_WAIT_SECONDS = 30;
+
+namespace {
+
+bool isContinuationByte(char c) {
+    return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+// UTF-16 code units of the character starting with lead
+size_t characterWidth(unsigned char lead) {
+    return lead >= 0xF0 ? 2 : 1;
+}
+
+// Byte offset at which text holds as many whole characters as fit in limit
+// UTF-16 code units
+size_t characterOffset(const std::string& text, size_t limit) {
+    size_t units = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (isContinuationByte(text[i])) continue;
+        units += characterWidth(c);
+        if (units > limit) return i;
+    }
+    return text.size();
+}
+
+// Base64 alphabet value of each byte, or -1
+struct Base64Table {
+    signed char value[256];
+    Base64Table() {
+        std::memset(value, -1, sizeof(value));
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; ++i) {
+            value[static_cast<unsigned char>(alphabet[i])] = static_cast<signed char>(i);
+        }
+    }
+};
+
+const Base64Table BASE64;
+
+// Read position of an upload within the buffer it is streamed from;
+// base64 is decoded on the fly into curl's send buffer
+struct UploadSource {
+    const char* data;
+    size_t length;
+    size_t pos;
+    bool base64;
+    uint32_t bits;
+    int bit_count;
+};
+
+size_t readCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+    UploadSource* source = static_cast<UploadSource*>(userp);
+    size_t room = size * nitems;
+
+    if (!source->base64) {
+        size_t len = std::min(room, source->length - source->pos);
+        std::memcpy(buffer, source->data + source->pos, len);
+        source->pos += len;
+        return len;
+    }
+
+    size_t out = 0;
+    while (out < room && source->pos < source->length) {
+        char c = source->data[source->pos];
+        if (c == '=') {
+            source->pos = source->length; // Padding ends the data
+            break;
+        }
+        ++source->pos;
+
+        int value = BASE64.value[static_cast<unsigned char>(c)];
+        if (value < 0) continue; // Line breaks and other noise
+
+        source->bits = (source->bits << 6) | static_cast<uint32_t>(value);
+        source->bit_count += 6;
+        if (source->bit_count >= 8) {
+            source->bit_count -= 8;
+            buffer[out++] = static_cast<char>((source->bits >> source->bit_count) & 0xFF);
+        }
+    }
+    return out;
+}
+
+int seekCallback(void* userp, curl_off_t offset, int origin) {
+    // curl rewinds the body when it has to resend it, e.g. after a redirect
+    UploadSource* source = static_cast<UploadSource*>(userp);
+    if (origin != SEEK_SET || offset != 0) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    source->pos = 0;
+    source->bits = 0;
+    source->bit_count = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+// retry_after of a 429 response ("parameters":{"retry_after":N})
+int retryAfter(const std::string& response) {
+    size_t key = response.find("\"retry_after\"");
+    if (key == std::string::npos) return DEFAULT_RETRY_AFTER_SECONDS;
+    size_t colon = response.find(':', key);
+    if (colon == std::string::npos) return DEFAULT_RETRY_AFTER_SECONDS;
+    int seconds = std::atoi(response.c_str() + colon + 1);
+    return seconds > 0 ? seconds : DEFAULT_RETRY_AFTER_SECONDS;
+}
+
+// message_id of a sendMessage result ("result":{"message_id":N,...}), or 0
+int64_t messageId(const std::string& response) {
+    size_t key = response.find("\"message_id\"");
+    if (key == std::string::npos) return 0;
+    size_t colon = response.find(':', key);
+    if (colon == std::string::npos) return 0;
+    return std::strtoll(response.c_str() + colon + 1, nullptr, 10);
+}
+
+bool isPhoto(const TelegramFile& file, size_t size) {
+    return (file.content_type == "image/jpeg" || file.content_type == "image/png") &&
+           size <= TELEGRAM_PHOTO_LIMIT;
+}
+
+} // namespace
+
+TelegramClient::TelegramClient(std::shared_ptr<BotPool> bots, const std::string& chat_id,
                                std::shared_ptr<Logger> logger)
-    : api_key_(api_key), chat_id_(chat_id), logger_(logger) {
+    : bots_(bots), chat_id_(chat_id), logger_(logger), split_long_messages_(false) {
 }
 
 TelegramClient::~TelegramClient() {
@@ -26,50 +170,193 @@ size_t TelegramClient::writeCallback(void* contents, size_t size, size_t nmemb,
     return size * nmemb;
 }
 
-std::string TelegramClient::escapeMessage(const std::string& message) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return "";
-
-    char* escaped = curl_easy_escape(curl, message.c_str(), message.length());
+std::string TelegramClient::escapeMessage(void* curl, const std::string& message) {
+    char* escaped = curl_easy_escape(static_cast<CURL*>(curl), message.c_str(), message.length());
     std::string result = escaped ? escaped : "";
 
     if (escaped) curl_free(escaped);
-    curl_easy_cleanup(curl);
 
     return result;
 }
 
+size_t TelegramFile::size() const {
+    if (!base64) return length;
+
+    // Count the alphabet characters; every four of them make three bytes
+    const char* data = buffer->data() + offset;
+    size_t symbols = 0;
+    for (size_t i = 0; i < length && data[i] != '='; ++i) {
+        if (BASE64.value[static_cast<unsigned char>(data[i])] >= 0) ++symbols;
+    }
+    return symbols * 6 / 8;
+}
+
+bool TelegramClient::fitsInMessage(const std::string& message) {
+    // Bytes bound the characters from above, so most messages need no count
+    return message.length() <= TELEGRAM_MESSAGE_LIMIT ||
+           fitsInMessage(CharsetConverter::utf16Length(message.data(), message.size()));
+}
+
+bool TelegramClient::fitsInMessage(size_t characters) {
+    return characters <= TELEGRAM_MESSAGE_LIMIT;
+}
+
+std::string TelegramClient::fitCaption(const std::string& caption) {
+    std::string result = caption;
+    if (CharsetConverter::repairUtf8(result) <= TELEGRAM_CAPTION_LIMIT) return result;
+
+    result.resize(characterOffset(result, TELEGRAM_CAPTION_LIMIT - 3));
+    return result + "...";
+}
+
+std::vector<std::string> TelegramClient::splitMessage(const std::string& message) {
+    const size_t limit = TELEGRAM_MESSAGE_LIMIT - SPLIT_MARKER_RESERVE;
+    std::vector<std::string> parts;
+
+    // One pass: remember the last line and word break of the current part
+    // and cut there when the part is full; a break in the first half would
+    // leave a near-empty part, so an unbroken run is cut mid-word instead
+    size_t start = 0;
+    size_t line_break = std::string::npos;
+    size_t word_break = std::string::npos;
+    size_t units = 0;  // characters in the current part
+    for (size_t i = 0; i < message.size(); ++i) {
+        size_t width = isContinuationByte(message[i]) ? 0 : characterWidth(static_cast<unsigned char>(message[i]));
+        if (width && units + width > limit) {
+            size_t cut;
+            size_t next;
+            if (line_break != std::string::npos && line_break - start > limit / 2) {
+                cut = line_break;
+                next = cut + 1;
+                if (message[cut - 1] == '\r') --cut;
+            } else if (word_break != std::string::npos && word_break - start > limit / 2) {
+                cut = word_break;
+                next = cut + 1;
+            } else {
+                cut = i;
+                next = cut;
+            }
+
+            parts.push_back(message.substr(start, cut - start));
+            start = next;
+            // Breaks after the cut still belong to the next part
+            line_break = std::string::npos;
+            if (word_break != std::string::npos && word_break < start) {
+                word_break = std::string::npos;
+            }
+            units = CharsetConverter::utf16Length(message.data() + start, i - start);
+        }
+        units += width;
+
+        if (message[i] == '\n') {
+            line_break = i;
+        } else if (message[i] == ' ' || message[i] == '\t') {
+            word_break = i;
+        }
+    }
+    if (start < message.size()) {
+        parts.push_back(message.substr(start));
+    }
+
+    for (size_t i = 0; i < parts.size(); ++i) {
+        parts[i] += "\n(" + std::to_string(i + 1) + "/" + std::to_string(parts.size()) + ")";
+    }
+    return parts;
+}
+
 void TelegramClient::truncateIfNeeded(std::string& message) {
-    if (message.length() > TELEGRAM_MESSAGE_LIMIT) {
-        message = message.substr(0, TELEGRAM_MESSAGE_LIMIT - 50);
+    if (!fitsInMessage(message)) {
+        message.resize(characterOffset(message, TELEGRAM_MESSAGE_LIMIT - 50));
         message += "\n\n... (message truncated)";
     }
 }
 
-bool TelegramClient::performRequest(const std::string& message, std::string& response) {
-    CURL* curl = curl_easy_init();
+TelegramResult TelegramClient::performRequest(const BotPool::Lease& bot, const std::string& chat_id,
+                                    const std::string& message, bool formatted, std::string& response,
+                                    int64_t message_id) {
+    CURL* curl = static_cast<CURL*>(bot.handle());
     if (!curl) {
         logger_->error("Failed to initialize CURL");
-        return false;
+        return TELEGRAM_FAILED;
     }
 
+    // Reset options but keep the connection open for the next request
+    curl_easy_reset(curl);
+
     std::string truncated_msg = message;
     truncateIfNeeded(truncated_msg);
 
-    std::string escaped_message = escapeMessage(truncated_msg);
+    std::string escaped_message = escapeMessage(curl, truncated_msg);
     if (escaped_message.empty()) {
-        curl_easy_cleanup(curl);
         logger_->error("Failed to escape message");
-        return false;
+        return TELEGRAM_FAILED;
     }
 
-    std::string url = "https://api.telegram.org/bot" + api_key_ +
-                      "/sendMessage?chat_id=" + chat_id_ +
+    std::string url = "https://api.telegram.org/bot" + bot.token() +
+                      (message_id ? "/editMessageText?chat_id=" : "/sendMessage?chat_id=") + chat_id +
                       "&text=" + escaped_message;
+    if (message_id) {
+        url += "&message_id=" + std::to_string(message_id);
+    }
+    if (formatted && !parse_mode_.empty() && fitsInMessage(message)) {
+        url += "&parse_mode=" + parse_mode_;
+    }
 
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+    return finishRequest(curl, response);
+}
+
+TelegramResult TelegramClient::performUpload(const BotPool::Lease& bot, const std::string& chat_id,
+                                             const TelegramFile& file, const std::string& caption,
+                                             std::string& response) {
+    CURL* curl = static_cast<CURL*>(bot.handle());
+    if (!curl) {
+        logger_->error("Failed to initialize CURL");
+        return TELEGRAM_FAILED;
+    }
+    curl_easy_reset(curl);
+
+    size_t size = file.size();
+    bool photo = isPhoto(file, size);
+    std::string url = "https://api.telegram.org/bot" + bot.token() + (photo ? "/sendPhoto" : "/sendDocument");
+
+    curl_mime* form = curl_mime_init(curl);
+    curl_mimepart* part = curl_mime_addpart(form);
+    curl_mime_name(part, "chat_id");
+    curl_mime_data(part, chat_id.c_str(), CURL_ZERO_TERMINATED);
+
+    if (!caption.empty()) {
+        part = curl_mime_addpart(form);
+        curl_mime_name(part, "caption");
+        curl_mime_data(part, caption.c_str(), CURL_ZERO_TERMINATED);
+    }
+
+    // The file part is read straight from the shared buffer as curl sends it
+    UploadSource source = {file.buffer->data() + file.offset, file.length, 0, file.base64, 0, 0};
+    part = curl_mime_addpart(form);
+    curl_mime_name(part, photo ? "photo" : "document");
+    curl_mime_filename(part, file.filename.c_str());
+    curl_mime_type(part, file.content_type.empty() ? "application/octet-stream" : file.content_type.c_str());
+    curl_mime_data_cb(part, static_cast<curl_off_t>(size), readCallback, seekCallback,
+                      nullptr, &source);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
+    // Allow slow uplinks time for tens of megabytes, but not for a stall
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+
+    TelegramResult result = finishRequest(curl, response);
+    curl_mime_free(form);
+    return result;
+}
+
+TelegramResult TelegramClient::finishRequest(void* handle, std::string& response) {
+    CURL* curl = static_cast<CURL*>(handle);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 
@@ -78,28 +365,153 @@ bool TelegramClient::performRequest(const std::string& message, std::string& res
     long response_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 
-    curl_easy_cleanup(curl);
-
     if (res != CURLE_OK) {
         logger_->error("Telegram API request failed: " + std::string(curl_easy_strerror(res)));
-        return false;
+        return TELEGRAM_FAILED;
+    }
+
+    if (response_code == 429) {
+        return TELEGRAM_THROTTLED;
     }
 
     if (response_code != 200) {
         logger_->error("Telegram API returned HTTP " + std::to_string(response_code) + ": " + response);
-        return false;
+        // Malformed, forbidden (bot blocked or removed) or too large
+        bool rejected = response_code == 400 || response_code == 403 || response_code == 413;
+        return rejected ? TELEGRAM_REJECTED : TELEGRAM_FAILED;
     }
 
-    return true;
+    return TELEGRAM_SENT;
 }
 
 bool TelegramClient::sendMessage(const std::string& message, int max_retries) {
+    return sendMessage(chat_id_, message, max_retries);
+}
+
+bool TelegramClient::sendMessage(const std::string& chat_id, const std::string& message, int max_retries) {
+    return deliverMessage(chat_id, message, max_retries) == TELEGRAM_SENT;
+}
+
+TelegramResult TelegramClient::deliverMessage(const std::string& chat_id, const std::string& message,
+                                              int max_retries, TelegramSent* sent) {
+    BotPool::Lease bot = bots_->acquire(chat_id);
+
+    TelegramResult result;
+    if (split_long_messages_ && !fitsInMessage(message)) {
+        // Parts go out one after another from the same bot so they arrive
+        // in order; a failed part stops the rest
+        std::vector<std::string> parts = splitMessage(message);
+        result = TELEGRAM_SENT;
+        for (size_t i = 0; i < parts.size() && result == TELEGRAM_SENT; ++i) {
+            result = sendWithRetries(bot, chat_id, parts[i], false, max_retries);
+        }
+        if (result == TELEGRAM_SENT) {
+            logger_->info("Telegram message sent successfully to " + chat_id + " in " +
+                          std::to_string(parts.size()) + " parts");
+        }
+    } else {
+        result = sendWithRetries(bot, chat_id, message, true, max_retries, sent);
+        if (result == TELEGRAM_SENT) {
+            logger_->info("Telegram message sent successfully to " + chat_id);
+        }
+    }
+
+    return result;
+}
+
+bool TelegramClient::switchBot(BotPool::Lease& bot, const std::string& chat_id, const std::string& response) {
+    int seconds = retryAfter(response);
+    bots_->sideline(bot, seconds);
+    logger_->warning("Bot " + std::to_string(bot.index() + 1) + " rate limited by Telegram, sidelined for " +
+                     std::to_string(seconds) + " seconds");
+
+    bot = bots_->acquire(chat_id);
+    return bot.readyIn() == 0;
+}
+
+void TelegramClient::waitForBot(const BotPool::Lease& bot) {
+    int seconds = std::min(bot.readyIn(), MAX_BOT_WAIT_SECONDS);
+    if (seconds > 0) {
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    }
+}
+
+TelegramResult TelegramClient::sendWithRetries(BotPool::Lease& bot, const std::string& chat_id,
+                                               const std::string& message, bool formatted, int max_retries,
+                                               TelegramSent* sent) {
+    for (int attempt = 1; attempt <= max_retries; ++attempt) {
+        std::string response;
+
+        waitForBot(bot);
+        TelegramResult result = performRequest(bot, chat_id, message, formatted, response);
+        if (result == TELEGRAM_SENT) {
+            if (sent) {
+                sent->message_id = messageId(response);
+                sent->bot = bot.index();
+            }
+            return result;
+        }
+
+        if (result == TELEGRAM_THROTTLED) {
+            // Another bot standing in is not a retry; each 429 sidelines one
+            // bot, so this ends once every bot has been throttled
+            if (switchBot(bot, chat_id, response)) --attempt;
+            continue;
+        }
+
+        if (result == TELEGRAM_REJECTED) {
+            // Broken markup, e.g. from a template: the text is still worth sending
+            if (formatted && !parse_mode_.empty() && response.find("can't parse entities") != std::string::npos) {
+                logger_->warning("Telegram could not parse the " + parse_mode_ + " markup, sending as plain text");
+                formatted = false;
+                continue;
+            }
+            logger_->error("Telegram rejected the message to " + chat_id + ", not retrying");
+            return result;
+        }
+
+        if (attempt < max_retries) {
+            int wait_seconds = attempt * 2; // Exponential backoff
+            logger_->warning("Retry " + std::to_string(attempt) + "/" +
+                           std::to_string(max_retries) + " in " +
+                           std::to_string(wait_seconds) + " seconds...");
+            std::this_thread::sleep_for(std::chrono::seconds(wait_seconds));
+        }
+    }
+
+    logger_->error("Failed to send Telegram message to " + chat_id + " after " +
+                   std::to_string(max_retries) + " attempts");
+    return TELEGRAM_FAILED;
+}
+
+bool TelegramClient::sendFile(const std::string& chat_id, const TelegramFile& file,
+                              const std::string& caption, int max_retries) {
+    return deliverFile(chat_id, file, caption, max_retries) == TELEGRAM_SENT;
+}
+
+TelegramResult TelegramClient::deliverFile(const std::string& chat_id, const TelegramFile& file,
+                                           const std::string& caption, int max_retries) {
+    BotPool::Lease bot = bots_->acquire(chat_id);
+
     for (int attempt = 1; attempt <= max_retries; ++attempt) {
         std::string response;
 
-        if (performRequest(message, response)) {
-            logger_->info("Telegram message sent successfully");
-            return true;
+        waitForBot(bot);
+        TelegramResult result = performUpload(bot, chat_id, file, caption, response);
+        if (result == TELEGRAM_SENT) {
+            logger_->info("Telegram file " + file.filename + " (" + std::to_string(file.size()) +
+                          " bytes) sent successfully to " + chat_id);
+            return result;
+        }
+
+        if (result == TELEGRAM_THROTTLED) {
+            if (switchBot(bot, chat_id, response)) --attempt;
+            continue;
+        }
+
+        if (result == TELEGRAM_REJECTED) {
+            logger_->error("Telegram rejected file " + file.filename + " for " + chat_id + ", not retrying");
+            return result;
         }
 
         if (attempt < max_retries) {
@@ -111,11 +523,139 @@ bool TelegramClient::sendMessage(const std::string& message, int max_retries) {
         }
     }
 
-    logger_->error("Failed to send Telegram message after " + std::to_string(max_retries) + " attempts");
-    return false;
+    logger_->error("Failed to send Telegram file " + file.filename + " to " + chat_id + " after " +
+                   std::to_string(max_retries) + " attempts");
+    return TELEGRAM_FAILED;
+}
+
+size_t TelegramClient::broadcastMessage(const std::vector<std::string>& chat_ids, const std::string& message,
+                                        size_t* rejected, std::vector<TelegramSent>* sent) {
+    if (sent) sent->assign(chat_ids.size(), TelegramSent());
+    return broadcast(chat_ids, [this, &chat_ids, &message, sent](size_t i) {
+        return deliverMessage(chat_ids[i], message, 3, sent ? &(*sent)[i] : nullptr);
+    }, rejected);
+}
+
+size_t TelegramClient::broadcastFile(const std::vector<std::string>& chat_ids, const TelegramFile& file,
+                                     const std::string& caption, size_t* rejected) {
+    return broadcast(chat_ids, [this, &chat_ids, &file, &caption](size_t i) {
+        return deliverFile(chat_ids[i], file, caption, 3);
+    }, rejected);
+}
+
+TelegramResult TelegramClient::editMessage(const std::string& chat_id, const TelegramSent& sent,
+                                           const std::string& message) {
+    // Only the bot that posted a message can edit it, so there is no
+    // switching bots here; a throttled edit is left to the caller
+    BotPool::Lease bot = bots_->acquireBot(sent.bot);
+    bool formatted = true;
+    for (;;) {
+        std::string response;
+        waitForBot(bot);
+        TelegramResult result = performRequest(bot, chat_id, message, formatted, response, sent.message_id);
+        if (result == TELEGRAM_THROTTLED) {
+            bots_->sideline(bot, retryAfter(response));
+        } else if (result == TELEGRAM_REJECTED) {
+            if (response.find("message is not modified") != std::string::npos) {
+                return TELEGRAM_SENT;
+            }
+            if (formatted && !parse_mode_.empty() && response.find("can't parse entities") != std::string::npos) {
+                formatted = false;
+                continue;
+            }
+        }
+        return result;
+    }
+}
+
+size_t TelegramClient::broadcast(const std::vector<std::string>& chat_ids,
+                                 const std::function<TelegramResult(size_t)>& send,
+                                 size_t* rejected) {
+    std::vector<TelegramResult> results;
+    results.reserve(chat_ids.size());
+    if (chat_ids.size() == 1) {
+        results.push_back(send(0));
+    } else {
+        // Each chat retries independently, so one slow chat does not hold up the others
+        std::vector<std::future<TelegramResult>> sends;
+        sends.reserve(chat_ids.size());
+        for (size_t i = 0; i < chat_ids.size(); ++i) {
+            sends.push_back(std::async(std::launch::async, [&send, i]() {
+                return send(i);
+            }));
+        }
+        for (auto& pending : sends) {
+            results.push_back(pending.get());
+        }
+    }
+
+    size_t delivered = 0;
+    for (TelegramResult result : results) {
+        if (result == TELEGRAM_SENT) ++delivered;
+        if (result == TELEGRAM_REJECTED && rejected) ++*rejected;
+    }
+    return delivered;
+}
+
+TelegramHealth TelegramClient::checkHealth(std::string& bot_username) {
+    // A bot with a revoked key would fail every request scheduled on it
+    TelegramHealth health = TELEGRAM_OK;
+    for (size_t i = 0; i < bots_->size() && health == TELEGRAM_OK; ++i) {
+        std::string username;
+        health = checkBot(bots_->token(i), username);
+        if (health == TELEGRAM_OK) {
+            bot_username += (i > 0 ? ", @" : "") + username;
+        } else if (bots_->size() > 1) {
+            logger_->warning("Bot " + std::to_string(i + 1) + " failed the health check");
+        }
+    }
+    return health;
 }
 
-bool TelegramClient::testConnection() {
-    logger_->info("Testing Telegram bot connection...");
-    return sendMessage("smtp2telegram: Connection test successful", 1);
+TelegramHealth TelegramClient::checkBot(const std::string& token, std::string& bot_username) {
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        logger_->error("Failed to initialize CURL");
+        return TELEGRAM_UNREACHABLE;
+    }
+
+    std::string url = "https://api.telegram.org/bot" + token + "/getMe";
+    std::string response;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = curl_easy_perform(curl);
+
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK) {
+        return TELEGRAM_UNREACHABLE;
+    }
+
+    if (response_code == 401 || response_code == 404) {
+        return TELEGRAM_UNAUTHORIZED;
+    }
+
+    if (response_code != 200) {
+        return TELEGRAM_UNREACHABLE;
+    }
+
+    // Only the bot's username is of interest; avoid a JSON dependency
+    size_t key = response.find("\"username\"");
+    if (key != std::string::npos) {
+        size_t start = response.find('"', response.find(':', key) + 1);
+        if (start != std::string::npos) {
+            ++start;
+            bot_username = response.substr(start, response.find('"', start) - start);
+        }
+    }
+
+    return TELEGRAM_OK;
 }
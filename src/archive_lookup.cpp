@@ -0,0 +1,101 @@
+// archive_lookup.cpp (smtp2telegram-archive)
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Lists and extracts messages from the ARCHIVE_DIR archive
+
+#include "../includes/MessageArchive.h"
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+
+namespace {
+
+void usage() {
+    std::cerr << "Usage: smtp2telegram-archive [--dir DIR] list [TEXT]\n"
+              << "       smtp2telegram-archive [--dir DIR] show MESSAGE-ID|SEGMENT:OFFSET\n"
+              << "  list   archived messages, or those whose Message-ID, sender or subject contain TEXT\n"
+              << "  show   write one raw message to standard output\n"
+              << "  --dir  archive directory (default: ~/smtp2telegram/archive)\n";
+}
+
+std::string lower(const std::string& s) {
+    std::string result = s;
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    return result;
+}
+
+std::string reference(const ArchiveEntry& entry) {
+    return entry.segment + ":" + std::to_string(entry.offset);
+}
+
+int list(const std::vector<ArchiveEntry>& entries, const std::string& text) {
+    std::string needle = lower(text);
+    for (const auto& entry : entries) {
+        if (!needle.empty() && lower(entry.message_id).find(needle) == std::string::npos &&
+            lower(entry.from).find(needle) == std::string::npos &&
+            lower(entry.subject).find(needle) == std::string::npos) {
+            continue;
+        }
+
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::localtime(&entry.time));
+        std::cout << stamp << "  " << reference(entry) << "  " << entry.length << " bytes\n"
+                  << "    Message-ID: " << entry.message_id << "\n"
+                  << "    From: " << entry.from << "\n"
+                  << "    Subject: " << entry.subject << "\n";
+    }
+    return 0;
+}
+
+int show(const std::string& dir, const std::vector<ArchiveEntry>& entries, const std::string& id) {
+    // Message-IDs may be given with or without the angle brackets; the
+    // newest copy wins
+    std::string bare = id.size() > 2 && id.front() == '<' && id.back() == '>' ? id.substr(1, id.size() - 2) : id;
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        const std::string& message_id = it->message_id;
+        bool match = reference(*it) == id || message_id == id || message_id == "<" + bare + ">" ||
+                     message_id == bare;
+        if (match) {
+            std::cout << MessageArchive::readMessage(dir, *it);
+            return 0;
+        }
+    }
+    std::cerr << "No archived message " << id << "\n";
+    return 1;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const char* home = std::getenv("HOME");
+    std::string dir = home ? std::string(home) + "/smtp2telegram/archive" : "archive";
+
+    int i = 1;
+    if (i + 1 < argc && std::string(argv[i]) == "--dir") {
+        dir = argv[i + 1];
+        i += 2;
+    }
+    if (i >= argc) {
+        usage();
+        return 2;
+    }
+
+    std::string command = argv[i++];
+    try {
+        std::vector<ArchiveEntry> entries = MessageArchive::readIndex(dir);
+        if (command == "list" && i + 1 >= argc) {
+            return list(entries, i < argc ? argv[i] : "");
+        }
+        if (command == "show" && i + 1 == argc) {
+            return show(dir, entries, argv[i]);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    usage();
+    return 2;
+}
@@ -10,19 +10,38 @@
 #include "../includes/TelegramClient.h"
 #include "../includes/EmailParser.h"
 #include "../includes/SMTPServer.h"
+#include "../includes/ConfigStore.h"
+#include "../includes/DeliveryQueue.h"
+#include "../includes/HotRestart.h"
+#include "../includes/AdmissionControl.h"
 #include <iostream>
 #include <memory>
 #include <csignal>
 #include <cstdlib>
+#include <algorithm>
 
 // Global pointer for signal handler
 std::shared_ptr<SMTPServer> g_server;
 std::shared_ptr<Logger> g_logger;
+std::shared_ptr<ConfigStore> g_config;
+volatile std::sig_atomic_t g_stop_signal = 0;
 
-void signalHandler(int signal) {
-    if (g_logger) {
-        g_logger->info("Received signal " + std::to_string(signal) + ", shutting down...");
+// Handlers only set flags: other threads may hold the logger's mutex
+
+void reloadHandler(int signal) {
+    if (g_config) {
+        g_config->requestReload();
+    }
+}
+
+void restartHandler(int signal) {
+    if (g_server) {
+        g_server->requestRestart();
     }
+}
+
+void signalHandler(int signal) {
+    g_stop_signal = signal;
     if (g_server) {
         g_server->shutdown();
     }
@@ -31,51 +50,124 @@ void signalHandler(int signal) {
 int main() {
     try {
         // Load configuration
-        Config config;
-        config.load();
+        auto loaded = std::make_shared<Config>();
+        loaded->load();
+        const Config& config = *loaded;
 
         // Create logger
         g_logger = std::make_shared<Logger>(config.getLogPath(), config.getLogKeepDays());
         g_logger->info("=== SMTP2Telegram Starting ===");
+        if (config.getIoBackend() == "io_uring") {
+            std::string error;
+            if (g_logger->useIoUring(error)) {
+                g_logger->info("Writing the log through io_uring");
+            } else {
+                g_logger->warning("io_uring unavailable for the log (" + error + "), using write()");
+            }
+        }
+
+        // Compile routing, priority and dedup settings into the first snapshot
+        g_config = std::make_shared<ConfigStore>(loaded, g_logger);
         g_logger->info("Configuration loaded successfully");
 
         // Rotate old logs
         g_logger->rotateLogs();
 
-        // Create Telegram client
-        auto telegram = std::make_shared<TelegramClient>(
-            config.getApiKey(),
-            config.getChatId(),
-            g_logger
+        // Create email parser
+        auto parser = std::make_shared<EmailParser>();
+
+        // Start the delivery workers; they hold messages until a background
+        // getMe check confirms Telegram is reachable
+        auto queue = std::make_shared<DeliveryQueue>(
+            g_config,
+            g_logger,
+            config.getDeliveryWorkers(),
+            config.getDeliveryQueueSize()
         );
+        queue->start();
 
-        // Test Telegram connection
-        g_logger->info("Testing Telegram connection...");
-        if (!telegram->testConnection()) {
-            g_logger->error("Failed to connect to Telegram. Please check your API_KEY and CHAT_ID.");
-            return 1;
+        // Pick up the backlog of the process we are replacing, if any
+        int backlog_fd = HotRestart::inheritedBacklogFd();
+        if (backlog_fd >= 0) {
+            queue->receiveHandOff(backlog_fd);
         }
 
-        // Create email parser
-        auto parser = std::make_shared<EmailParser>();
+        // Refuse connections and mail early rather than accept more than
+        // can be held or delivered. The watermarks are kept at least one
+        // message apart, or small queues would flip state on every check
+        size_t queue_size = static_cast<size_t>(config.getDeliveryQueueSize());
+        size_t queue_high = std::max<size_t>(queue_size * config.getQueueHighWatermark() / 100, 1);
+        size_t queue_low = std::min(queue_size * config.getQueueLowWatermark() / 100, queue_high - 1);
+        auto admission = std::make_shared<AdmissionControl>(
+            config.getMaxConnections(),
+            config.getMaxConnectionsPerIp(),
+            config.getMaxInflightBytes(),
+            queue_high,
+            queue_low,
+            queue,
+            g_logger
+        );
 
         // Create SMTP server
         g_server = std::make_shared<SMTPServer>(
             config.getSmtpHostname(),
             config.getSmtpPort(),
-            telegram,
+            queue,
             g_logger,
-            parser
+            parser,
+            g_config,
+            admission
         );
+        g_server->configureWorkers(config.getSmtpWorkers(), config.getSmtpCpuPinning());
+        if (!config.getSmtpTlsCert().empty()) {
+            g_server->configureTls(config.getSmtpTlsCert(), config.getSmtpTlsKey(), config.getSmtpRequireTls());
+        }
+        if (!config.getLmtpSocket().empty()) {
+            g_server->configureLmtp(config.getLmtpSocket(), config.getLmtpSocketMode());
+        }
+        g_server->configureIoUring(config.getIoBackend() == "io_uring");
+        if (!config.getCaptureFile().empty()) {
+            g_server->configureCapture(config.getCaptureFile(),
+                                       static_cast<uint64_t>(config.getCaptureMaxMb()) * 1024 * 1024);
+        }
+        if (!config.getArchiveDir().empty()) {
+            g_server->configureArchive(config.getArchiveDir(),
+                                       static_cast<uint64_t>(config.getArchiveSegmentMb()) * 1024 * 1024,
+                                       config.getArchiveKeepDays());
+        }
+        if (config.getStormWindow() > 0) {
+            g_server->configureStorm(config.getStormFields(), config.getStormWindow(),
+                                     config.getStormEditInterval(),
+                                     static_cast<size_t>(config.getStormMaxGroups()));
+        }
 
         // Set up signal handlers for graceful shutdown
         std::signal(SIGINT, signalHandler);
         std::signal(SIGTERM, signalHandler);
+        std::signal(SIGUSR2, restartHandler);
+        std::signal(SIGHUP, reloadHandler);
+        std::signal(SIGPIPE, SIG_IGN);
 
         g_logger->info("Signal handlers registered");
 
+        // Reload on SIGHUP or whenever .env changes
+        g_config->startWatching();
+
         // Run the server (blocking)
         g_server->run();
+        if (g_stop_signal) {
+            g_logger->info("Stopped by signal " + std::to_string(g_stop_signal));
+        }
+
+        // Pass the backlog to the new process after a hot restart,
+        // otherwise flush it before exiting
+        if (g_server->handoffFd() >= 0) {
+            queue->handOff(g_server->handoffFd());
+        } else {
+            queue->stop();
+        }
+
+        g_config->stopWatching();
 
         g_logger->info("=== SMTP2Telegram Stopped ===");
 
@@ -0,0 +1,428 @@
+// smtp_replay.cpp (smtp2telegram-replay)
+// Copyright (c) 2024 William Bellavance Jr.
+// SPDX-License-Identifier: MIT
+//
+// Replays a session capture against a server or straight into EmailParser
+
+#include "../includes/SessionCapture.h"
+#include "../includes/EmailParser.h"
+#include <boost/asio.hpp>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+using boost::asio::ip::tcp;
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+struct ReplaySession {
+    std::vector<CaptureRecord> records;
+};
+
+struct ReplayStats {
+    size_t sessions = 0;
+    size_t messages = 0;
+    size_t accepted = 0;   // 2xx reply to the message
+    size_t deferred = 0;   // 4xx
+    size_t rejected = 0;   // 5xx
+    size_t failed = 0;     // sessions cut short by a connection error
+    uint64_t bytes = 0;    // sent, or parsed with --parser
+};
+
+std::string upper(const std::string& s) {
+    std::string result = s;
+    std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+    return result;
+}
+
+bool startsWith(const std::string& s, const char* prefix) {
+    return upper(s).compare(0, std::char_traits<char>::length(prefix), prefix) == 0;
+}
+
+// Sessions in the order they were opened, each with its records
+std::vector<ReplaySession> loadSessions(const std::string& path, int64_t& first_time_us) {
+    CaptureReader reader(path);
+    std::vector<ReplaySession> sessions;
+    std::map<uint64_t, size_t> index;
+    first_time_us = -1;
+
+    CaptureRecord record;
+    while (reader.next(record)) {
+        if (first_time_us < 0) first_time_us = record.time_us;
+        auto it = index.find(record.session);
+        if (it == index.end()) {
+            it = index.emplace(record.session, sessions.size()).first;
+            sessions.emplace_back();
+        }
+        sessions[it->second].records.push_back(std::move(record));
+        if (sessions[it->second].records.back().type == CAPTURE_CLOSE) {
+            index.erase(it);
+        }
+    }
+    return sessions;
+}
+
+// Messages as the server handed them to the parser: DATA payloads, and the
+// chunks of a BDAT transaction up to its LAST chunk
+std::vector<std::string> extractMessages(const std::vector<ReplaySession>& sessions) {
+    std::vector<std::string> messages;
+    for (const auto& session : sessions) {
+        std::string chunks;
+        bool last = false;
+        const auto& records = session.records;
+        for (size_t i = 0; i < records.size(); ++i) {
+            const CaptureRecord& record = records[i];
+            if (record.type == CAPTURE_COMMAND && startsWith(record.data, "BDAT")) {
+                last = upper(record.data).find(" LAST") != std::string::npos;
+            } else if (record.type == CAPTURE_DATA) {
+                messages.push_back(record.data);
+            } else if (record.type == CAPTURE_CHUNK) {
+                chunks += record.data;
+                bool more = i + 1 < records.size() && records[i + 1].type == CAPTURE_CHUNK;
+                if (!more && last) {
+                    messages.push_back(std::move(chunks));
+                    chunks.clear();
+                }
+            }
+        }
+    }
+    return messages;
+}
+
+class Replay;
+
+// One captured session played back over its own connection
+class ReplayClient : public std::enable_shared_from_this<ReplayClient> {
+public:
+    ReplayClient(Replay& replay, const ReplaySession& session);
+    void start();
+
+private:
+    Replay& replay_;
+    const ReplaySession& session_;
+    tcp::socket socket_;
+    boost::asio::steady_timer timer_;
+    boost::asio::streambuf buf_;
+    std::string out_;
+    size_t next_;
+    bool last_chunk_;  // the pending BDAT command ends the message
+    bool done_;
+
+    void step();
+    void send(const CaptureRecord& record);
+    void readReply(bool message);
+    void finish(bool failed);
+};
+
+class Replay {
+public:
+    Replay(boost::asio::io_context& io_context, const tcp::endpoint& endpoint,
+           const std::vector<ReplaySession>& sessions, int64_t first_time_us, double speed,
+           size_t connections)
+        : io_context_(io_context), endpoint_(endpoint), sessions_(sessions), first_time_us_(first_time_us),
+          speed_(speed), connections_(connections), next_(0), active_(0), start_(Clock::now()) {}
+
+    void run() {
+        start_ = Clock::now();
+        launch();
+        io_context_.run();
+    }
+
+    // False at maximum speed: records go out as soon as the previous reply is in
+    bool paced() const { return speed_ > 0; }
+
+    // When a record is due
+    Clock::time_point due(const CaptureRecord& record) const {
+        auto offset = static_cast<int64_t>((record.time_us - first_time_us_) / speed_);
+        return start_ + std::chrono::microseconds(offset);
+    }
+
+    void finished() {
+        --active_;
+        launch();
+    }
+
+    boost::asio::io_context& io_context() { return io_context_; }
+    const tcp::endpoint& endpoint() const { return endpoint_; }
+    ReplayStats stats;
+
+private:
+    boost::asio::io_context& io_context_;
+    tcp::endpoint endpoint_;
+    const std::vector<ReplaySession>& sessions_;
+    int64_t first_time_us_;
+    double speed_;
+    size_t connections_;
+    size_t next_;
+    size_t active_;
+    Clock::time_point start_;
+
+    void launch() {
+        while (active_ < connections_ && next_ < sessions_.size()) {
+            ++active_;
+            ++stats.sessions;
+            std::make_shared<ReplayClient>(*this, sessions_[next_++])->start();
+        }
+    }
+};
+
+ReplayClient::ReplayClient(Replay& replay, const ReplaySession& session)
+    : replay_(replay), session_(session), socket_(replay.io_context()), timer_(replay.io_context()),
+      next_(0), last_chunk_(false), done_(false) {
+}
+
+void ReplayClient::start() {
+    // Connect when the session was opened, then read the greeting
+    auto self = shared_from_this();
+    auto connect = [self]() {
+        self->socket_.async_connect(self->replay_.endpoint(), [self](const boost::system::error_code& ec) {
+            if (ec) {
+                std::cerr << "Connect failed: " << ec.message() << "\n";
+                self->finish(true);
+                return;
+            }
+            // A BDAT command and its chunk go out as two writes
+            boost::system::error_code ignored;
+            self->socket_.set_option(tcp::no_delay(true), ignored);
+            self->readReply(false);
+        });
+    };
+    if (!replay_.paced()) {
+        connect();
+        return;
+    }
+    timer_.expires_at(replay_.due(session_.records.front()));
+    timer_.async_wait([connect](const boost::system::error_code&) { connect(); });
+}
+
+void ReplayClient::step() {
+    // Skip what the connection itself stands for
+    while (next_ < session_.records.size() && session_.records[next_].type == CAPTURE_OPEN) {
+        ++next_;
+    }
+    if (next_ == session_.records.size()) {
+        finish(false);
+        return;
+    }
+
+    const CaptureRecord& record = session_.records[next_++];
+    if (!replay_.paced()) {
+        send(record);
+        return;
+    }
+    auto self = shared_from_this();
+    timer_.expires_at(replay_.due(record));
+    timer_.async_wait([self, &record](const boost::system::error_code&) { self->send(record); });
+}
+
+void ReplayClient::send(const CaptureRecord& record) {
+    bool expect_reply = true;
+    bool message = false;
+    switch (record.type) {
+    case CAPTURE_COMMAND:
+        // Sessions replay in plain SMTP: no TLS, LHLO becomes EHLO
+        if (startsWith(record.data, "STARTTLS")) {
+            step();
+            return;
+        }
+        out_ = startsWith(record.data, "LHLO") ? "EHLO" + record.data.substr(4) : record.data;
+        out_ += "\r\n";
+        if (startsWith(record.data, "BDAT")) {
+            expect_reply = false;  // answered after its chunk
+            last_chunk_ = upper(record.data).find(" LAST") != std::string::npos;
+        }
+        break;
+    case CAPTURE_DATA:
+        out_ = record.data.empty() ? ".\r\n" : record.data + "\r\n.\r\n";
+        message = true;
+        break;
+    case CAPTURE_CHUNK:
+        out_ = record.data;
+        expect_reply = next_ == session_.records.size() || session_.records[next_].type != CAPTURE_CHUNK;
+        message = expect_reply && last_chunk_;
+        break;
+    case CAPTURE_CLOSE:
+        finish(false);
+        return;
+    default:
+        step();
+        return;
+    }
+
+    replay_.stats.bytes += out_.size();
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_, boost::asio::buffer(out_),
+        [self, expect_reply, message](const boost::system::error_code& ec, size_t) {
+            if (ec) {
+                self->finish(true);
+            } else if (expect_reply) {
+                self->readReply(message);
+            } else {
+                self->step();
+            }
+        });
+}
+
+void ReplayClient::readReply(bool message) {
+    auto self = shared_from_this();
+    boost::asio::async_read_until(socket_, buf_, "\r\n",
+        [self, message](const boost::system::error_code& ec, size_t n) {
+            if (ec) {
+                self->finish(true);
+                return;
+            }
+            std::string line(boost::asio::buffers_begin(self->buf_.data()),
+                             boost::asio::buffers_begin(self->buf_.data()) + n);
+            self->buf_.consume(n);
+
+            // Continuation lines of a multiline reply
+            if (line.size() >= 4 && line[3] == '-') {
+                self->readReply(message);
+                return;
+            }
+
+            if (message) {
+                ReplayStats& stats = self->replay_.stats;
+                ++stats.messages;
+                if (line[0] == '2') ++stats.accepted;
+                else if (line[0] == '4') ++stats.deferred;
+                else ++stats.rejected;
+            }
+            if (line.compare(0, 3, "421") == 0) {
+                self->finish(false);
+                return;
+            }
+            self->step();
+        });
+}
+
+void ReplayClient::finish(bool failed) {
+    if (done_) return;
+    done_ = true;
+    if (failed) ++replay_.stats.failed;
+
+    boost::system::error_code ignored;
+    timer_.cancel();
+    socket_.close(ignored);
+    replay_.finished();
+}
+
+void usage() {
+    std::cerr << "Usage: smtp2telegram-replay [options] CAPTURE_FILE\n"
+              << "  --host HOST        server to replay against (default: 127.0.0.1)\n"
+              << "  --port PORT        (default: 2525)\n"
+              << "  --speed N|max      time scale of the capture (default: 1)\n"
+              << "  --connections N    sessions in flight at most (default: 64)\n"
+              << "  --parser           parse the messages with EmailParser instead of sending them\n"
+              << "  --iterations N     with --parser, passes over the messages (default: 1)\n";
+}
+
+void printRate(const char* label, double count, double seconds) {
+    std::cout << label << std::fixed << std::setprecision(1) << (seconds > 0 ? count / seconds : 0.0) << "\n";
+}
+
+int runParser(const std::vector<ReplaySession>& sessions, int iterations) {
+    std::vector<std::string> messages = extractMessages(sessions);
+    EmailParser parser;
+    ReplayStats stats;
+
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const auto& message : messages) {
+            ParsedEmail email = parser.parse(message);
+            stats.bytes += message.size();
+            ++stats.messages;
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << "Parsed " << stats.messages << " messages (" << stats.bytes << " bytes) in "
+              << std::fixed << std::setprecision(3) << seconds << " s\n";
+    printRate("Messages/s: ", static_cast<double>(stats.messages), seconds);
+    printRate("MB/s: ", static_cast<double>(stats.bytes) / (1024 * 1024), seconds);
+    return 0;
+}
+
+int runServer(const std::vector<ReplaySession>& sessions, int64_t first_time_us, const std::string& host,
+              int port, double speed, size_t connections) {
+    boost::asio::io_context io_context;
+    tcp::endpoint endpoint(boost::asio::ip::make_address(host), static_cast<unsigned short>(port));
+    Replay replay(io_context, endpoint, sessions, first_time_us, speed, connections);
+
+    auto start = Clock::now();
+    replay.run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    const ReplayStats& stats = replay.stats;
+    std::cout << "Replayed " << stats.sessions << " sessions, " << stats.messages << " messages ("
+              << stats.bytes << " bytes) in " << std::fixed << std::setprecision(3) << seconds << " s\n"
+              << "Accepted: " << stats.accepted << ", deferred: " << stats.deferred
+              << ", rejected: " << stats.rejected << ", failed sessions: " << stats.failed << "\n";
+    printRate("Messages/s: ", static_cast<double>(stats.messages), seconds);
+    return stats.failed > 0 ? 1 : 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string host = "127.0.0.1";
+    int port = 2525;
+    double speed = 1;
+    size_t connections = 64;
+    bool parser = false;
+    int iterations = 1;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--speed" && has_value) {
+            std::string value = argv[++i];
+            speed = value == "max" ? 0 : std::atof(value.c_str());
+            if (value != "max" && speed <= 0) {
+                usage();
+                return 2;
+            }
+        } else if (arg == "--connections" && has_value) {
+            connections = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--parser") {
+            parser = true;
+        } else if (arg == "--iterations" && has_value) {
+            iterations = std::max(1, std::atoi(argv[++i]));
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (path.empty()) {
+        usage();
+        return 2;
+    }
+
+    try {
+        int64_t first_time_us;
+        std::vector<ReplaySession> sessions = loadSessions(path, first_time_us);
+        if (sessions.empty()) {
+            std::cerr << path << " contains no sessions\n";
+            return 1;
+        }
+        return parser ? runParser(sessions, iterations)
+                      : runServer(sessions, first_time_us, host, port, speed, connections);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}